@@ -3,17 +3,321 @@
 //
 // Written by nicolasweber@gmx.de, released under MIT license
 
+#include "flow.h"
+
 #include <algorithm>
+#include <cassert>
+#include <cerrno>
 #include <cmath>
+#include <cstdarg>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <climits>
+#include <csignal>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <list>
 #include <map>
 #include <string>
 #include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if !defined(FLOW_NO_PROFILE) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+
+#ifdef _MSC_VER
+#define FLOW_THREAD_LOCAL __declspec(thread)
+#else
+#define FLOW_THREAD_LOCAL __thread
+#endif
+
+// Wall clock time in seconds.
+double now() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+
+#ifndef FLOW_NO_PROFILE
+// Timers and counters for the stages of the pipeline. Stages are timed with
+// PROFILE_SCOPE("name") at the top of a block, and labeled with the variant
+// (icon size) and pyramid level that are being worked on. Compile with
+// -DFLOW_NO_PROFILE to remove all probes.
+
+struct TraceEvent {
+  const char* name;
+  double start, duration;
+  int variant, level;
+  int thread;
+};
+
+// What the current thread is working on (icon size and pyramid level), -1 if
+// nothing in particular. Set with PROFILE_SET_VARIANT and PROFILE_SET_LEVEL.
+FLOW_THREAD_LOCAL int tlsProfileVariant = -1;
+FLOW_THREAD_LOCAL int tlsProfileLevel = -1;
+FLOW_THREAD_LOCAL int tlsProfileThread = 0;
+
+// The current thread's hardware counters, see
+// Profiler::enableHardwareCounters(). -1 until they're opened, -2 if they
+// can't be.
+FLOW_THREAD_LOCAL int tlsCyclesFd = -1;
+FLOW_THREAD_LOCAL int tlsInstructionsFd = -1;
+
+struct StageStats {
+  long long calls;
+  double seconds;
+  long long cycles, instructions;
+
+  StageStats() : calls(0), seconds(0), cycles(0), instructions(0) {}
+};
+
+class Profiler {
+ public:
+  bool enabled;
+  bool trace;  // keep every event for writeTrace(), not only the sums
+
+  std::vector<TraceEvent> events;
+  std::map<std::string, StageStats> stages;  // key: name/variant/level
+  std::map<std::string, long long> counters;
+  long long bytesAllocated, workspace, peakWorkspace;
+
+  Profiler() : enabled(false), trace(false), bytesAllocated(0), workspace(0),
+      peakWorkspace(0), origin(now()), hardwareCounters(false),
+      nextThreadId(1) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  // Counts cycles and instructions per stage as well. Returns false if the
+  // system doesn't let us (needs Linux and perf_event_paranoid <= 2).
+  // Counters only count the thread that opens them, so every thread opens
+  // its own on its first probe, and closes them when it exits.
+  bool enableHardwareCounters() {
+#ifdef __linux__
+    if (pthread_key_create(&countersKey, closeThreadCounters) != 0)
+      return false;
+    hardwareCounters = openThreadCounters();
+#endif
+    return hardwareCounters;
+  }
+
+  // The current thread's counts so far, or 0s.
+  void readHardwareCounters(long long* cycles, long long* instructions) {
+    *cycles = *instructions = 0;
+#ifdef __linux__
+    if (!hardwareCounters || !openThreadCounters()) return;
+    if (read(tlsCyclesFd, cycles, sizeof(*cycles)) != sizeof(*cycles))
+      *cycles = 0;
+    if (read(tlsInstructionsFd, instructions, sizeof(*instructions))
+        != sizeof(*instructions))
+      *instructions = 0;
+#endif
+  }
+
+  void addEvent(const char* name, double start, double end,
+      long long cycles, long long instructions) {
+    char key[256];
+    snprintf(key, sizeof(key), "%s/%d/%d", name, tlsProfileVariant,
+        tlsProfileLevel);
+    pthread_mutex_lock(&mutex);
+    if (tlsProfileThread == 0)
+      tlsProfileThread = nextThreadId++;
+    StageStats& s = stages[key];
+    ++s.calls;
+    s.seconds += end - start;
+    s.cycles += cycles;
+    s.instructions += instructions;
+    if (trace) {
+      TraceEvent e = { name, start - origin, end - start, tlsProfileVariant,
+          tlsProfileLevel, tlsProfileThread };
+      events.push_back(e);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void count(const char* name, long long n) {
+    pthread_mutex_lock(&mutex);
+    counters[name] += n;
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void alloc(size_t bytes) {
+    if (!enabled) return;
+    pthread_mutex_lock(&mutex);
+    bytesAllocated += bytes;
+    workspace += bytes;
+    peakWorkspace = std::max(peakWorkspace, workspace);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void release(size_t bytes) {
+    if (!enabled) return;
+    pthread_mutex_lock(&mutex);
+    workspace -= bytes;
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // Writes the per stage, variant and level sums and the counters as JSON.
+  bool writeSummary(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "{\n  \"stages\": [\n");
+    std::map<std::string, StageStats>::iterator it, end = stages.end();
+    size_t i = 0;
+    for (it = stages.begin(); it != end; ++it, ++i) {
+      char name[256];
+      int v, l;
+      sscanf(it->first.c_str(), "%255[^/]/%d/%d", name, &v, &l);
+      fprintf(f, "    { \"stage\": \"%s\", \"variant\": %d, \"level\": %d, "
+          "\"calls\": %lld, \"ms\": %.3f", name, v, l, it->second.calls,
+          1000 * it->second.seconds);
+      if (hardwareCounters)
+        fprintf(f, ", \"cycles\": %lld, \"instructions\": %lld",
+            it->second.cycles, it->second.instructions);
+      fprintf(f, " }%s\n", i + 1 == stages.size() ? "" : ",");
+    }
+    fprintf(f, "  ],\n  \"counters\": {\n");
+    std::map<std::string, long long>::iterator ci;
+    for (ci = counters.begin(); ci != counters.end(); ++ci)
+      fprintf(f, "    \"%s\": %lld,\n", ci->first.c_str(), ci->second);
+    fprintf(f, "    \"bytesAllocated\": %lld,\n", bytesAllocated);
+    fprintf(f, "    \"peakWorkspace\": %lld\n  }\n}\n", peakWorkspace);
+    return fclose(f) == 0;
+  }
+
+  // Writes all events in Chrome's trace event format (load it in
+  // chrome://tracing or ui.perfetto.dev).
+  bool writeTrace(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < events.size(); ++i) {
+      const TraceEvent& e = events[i];
+      fprintf(f, "{\"name\":\"%s\",\"cat\":\"flow\",\"ph\":\"X\","
+          "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"variant\":%d,\"level\":%d}},\n",
+          e.name, 1e6 * e.start, 1e6 * e.duration, e.thread, e.variant,
+          e.level);
+    }
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+        "\"args\":{\"name\":\"flow\"}}\n]}\n");
+    return fclose(f) == 0;
+  }
+
+ private:
+  double origin;
+  bool hardwareCounters;
+  int nextThreadId;
+  pthread_mutex_t mutex;
+
+#ifdef __linux__
+  pthread_key_t countersKey;  // closes a thread's counters when it exits
+
+  // Opens the current thread's counters if that hasn't been tried yet.
+  // Returns false if they can't be.
+  bool openThreadCounters() {
+    if (tlsCyclesFd == -2) return false;
+    if (tlsCyclesFd != -1) return true;
+    int cycles = openCounter(PERF_COUNT_HW_CPU_CYCLES);
+    int instructions = openCounter(PERF_COUNT_HW_INSTRUCTIONS);
+    if (cycles == -1 || instructions == -1) {
+      if (cycles != -1) close(cycles);
+      if (instructions != -1) close(instructions);
+      tlsCyclesFd = -2;
+      return false;
+    }
+    tlsCyclesFd = cycles;
+    tlsInstructionsFd = instructions;
+    pthread_setspecific(countersKey, this);
+    return true;
+  }
+
+  static void closeThreadCounters(void*) {
+    if (tlsCyclesFd < 0) return;
+    close(tlsCyclesFd);
+    close(tlsInstructionsFd);
+    tlsCyclesFd = tlsInstructionsFd = -1;
+  }
+
+  int openCounter(int config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#endif
+};
+
+Profiler gProfiler;
+
+class ScopedProbe {
+ public:
+  ScopedProbe(const char* name) : name_(name) {
+    if (!gProfiler.enabled) return;
+    gProfiler.readHardwareCounters(&cycles_, &instructions_);
+    start_ = now();
+  }
+
+  ~ScopedProbe() {
+    if (!gProfiler.enabled) return;
+    double end = now();
+    long long cycles, instructions;
+    gProfiler.readHardwareCounters(&cycles, &instructions);
+    gProfiler.addEvent(name_, start_, end, cycles - cycles_,
+        instructions - instructions_);
+  }
+
+ private:
+  const char* name_;
+  double start_;
+  long long cycles_, instructions_;
+};
+
+#define PROFILE_CONCAT2(a, b) a ## b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name) \
+  ScopedProbe PROFILE_CONCAT(probe_, __LINE__)(name)
+#define PROFILE_COUNT(name, n) \
+  do { if (gProfiler.enabled) gProfiler.count(name, n); } while (0)
+#define PROFILE_ALLOC(bytes) gProfiler.alloc(bytes)
+#define PROFILE_RELEASE(bytes) gProfiler.release(bytes)
+#define PROFILE_SET_VARIANT(v) tlsProfileVariant = (v)
+#define PROFILE_SET_LEVEL(l) tlsProfileLevel = (l)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNT(name, n)
+#define PROFILE_ALLOC(bytes)
+#define PROFILE_RELEASE(bytes)
+#define PROFILE_SET_VARIANT(v)
+#define PROFILE_SET_LEVEL(l)
+#endif
+
 
 void gray64fromRgb64(double* dest, const double* src, int w, int h) {
+  PROFILE_SCOPE("convert");
   for (int y = 0; y < h; ++y) {
     for (int x = 0; x < w; ++x) {
       dest[y*w + x] =
@@ -25,6 +329,7 @@ void gray64fromRgb64(double* dest, const double* src, int w, int h) {
 }
 
 void rgb64fromRgba32(double* dest, unsigned char* src, int w, int h) {
+  PROFILE_SCOPE("convert");
   int bps = 4 * w;
   for (int y = 0; y < h; ++y) {
     for (int x = 0; x < w; ++x) {
@@ -36,6 +341,7 @@ void rgb64fromRgba32(double* dest, unsigned char* src, int w, int h) {
 }
 
 void mask64fromRgba32(double* dest, unsigned char* src, int w, int h) {
+  PROFILE_SCOPE("convert");
   int bps = 4 * w;
   for (int y = 0; y < h; ++y)
     for (int x = 0; x < w; ++x)
@@ -50,10 +356,87 @@ T clamp(T v, T minV, T maxV) {
   return v;
 }
 
+// Keeps freed image buffers around, so that repeated solves don't go through
+// malloc for every temporary. allocImage() and freeImage() use the workspace
+// installed for the current thread in tlsWorkspace, if there is one.
+class Workspace {
+ public:
+  Workspace(size_t maxBytes = 64 << 20) : maxBytes(maxBytes), bytes(0) {}
+
+  ~Workspace() {
+    std::multimap<size_t, double*>::iterator it;
+    for (it = buffers.begin(); it != buffers.end(); ++it)
+      free(it->second);
+  }
+
+  // Returns a buffer of exactly size bytes, or NULL.
+  double* take(size_t size) {
+    std::multimap<size_t, double*>::iterator it = buffers.find(size);
+    if (it == buffers.end()) return NULL;
+    double* pix = it->second;
+    buffers.erase(it);
+    bytes -= size;
+    return pix;
+  }
+
+  // Keeps pix for later, unless that'd make the workspace too big.
+  bool give(double* pix, size_t size) {
+    if (bytes + size > maxBytes) return false;
+    buffers.insert(std::make_pair(size, pix));
+    bytes += size;
+    return true;
+  }
+
+ private:
+  std::multimap<size_t, double*> buffers;
+  size_t maxBytes, bytes;
+
+  Workspace(const Workspace&);
+  Workspace& operator=(const Workspace&);
+};
+
+FLOW_THREAD_LOCAL Workspace* tlsWorkspace = NULL;
+
 double* allocImage(int w, int h, int c = 1) {
-  return (double*)malloc(w * h * c * sizeof(double));
+  size_t size = w * h * c * sizeof(double);
+  PROFILE_ALLOC(size);
+  double* pix = tlsWorkspace ? tlsWorkspace->take(size) : NULL;
+  return pix ? pix : (double*)malloc(size);
 }
 
+void freeImage(double* pix, int w, int h, int c = 1) {
+  size_t size = w * h * c * sizeof(double);
+  PROFILE_RELEASE(size);
+  if (!tlsWorkspace || !tlsWorkspace->give(pix, size))
+    free(pix);
+}
+
+// A window onto pixels that someone else owns: w x h pixels of c channels,
+// with rows stride doubles apart. A view of an Img (or of a pyramid level)
+// covers all of it, sub() picks a rectangle out of one without copying.
+// Kernels that take views read and write the pixels in place, so the image
+// has to outlive its views.
+struct ImageView {
+  double* pix;
+  int w, h, c;
+  int stride;
+
+  ImageView() : pix(NULL), w(0), h(0), c(0), stride(0) {}
+  ImageView(const double* p, int iw, int ih, int ic = 1, int istride = 0)
+      : pix(const_cast<double*>(p)), w(iw), h(ih), c(ic),
+        stride(istride ? istride : iw * ic) {}
+
+  double* row(int y) const { return pix + (ptrdiff_t)y * stride; }
+  bool contiguous() const { return stride == w * c; }
+
+  ImageView sub(int x, int y, int sw, int sh) const {
+    return ImageView(row(y) + x * c, sw, sh, c, stride);
+  }
+};
+
+// An image that owns its pixels. Images aren't copied by accident: copies
+// are made with copyFrom(), images are handed over with swap() (or moved,
+// in C++11).
 class Img {
  public:
   int w, h;
@@ -66,45 +449,533 @@ class Img {
       pix(allocImage(w, h, c))
   { }
 
-  Img(const Img& b) {
-    printf("cloning!\n");
-    w = b.w;
-    h = b.h;
-    c = b.c;
-    pix = allocImage(w, h, c);
-    memcpy(pix, b.pix, w * h * c * sizeof(double));
+#if __cplusplus >= 201103L
+  Img(Img&& b) : w(b.w), h(b.h), c(b.c), pix(b.pix) {
+    b.w = b.h = b.c = 0;
+    b.pix = NULL;
+  }
+
+  Img& operator=(Img&& b) {
+    swap(b);
+    return *this;
   }
+#endif
 
   ~Img() {
     if (pix)
-      free(pix);
+      freeImage(pix, w, h, c);
     pix = NULL;
   }
 
   void setSize(int nw, int nh, int nc = 1) {
     if (pix)
-      free(pix);
+      freeImage(pix, w, h, c);
     w = nw;
     h = nh;
     c = nc;
     pix = allocImage(w, h, c);
   }
 
-  void toGray() {
-    if (c == 1) return;
-    double* grayPix = allocImage(w, h);
-    gray64fromRgb64(grayPix, pix, w, h);
-    free(pix);
-    pix = grayPix;
-    c = 1;
+  void swap(Img& b) {
+    std::swap(w, b.w);
+    std::swap(h, b.h);
+    std::swap(c, b.c);
+    std::swap(pix, b.pix);
+  }
+
+  // Makes this a copy of the pixels of src.
+  void copyFrom(const ImageView& src) {
+    setSize(src.w, src.h, src.c);
+    for (int y = 0; y < h; ++y)
+      memcpy(pix + y*w*c, src.row(y), w * c * sizeof(double));
   }
 
+  ImageView view() const { return ImageView(pix, w, h, c); }
+  operator ImageView() const { return view(); }
+
  private:
+  Img(const Img& b);
   Img& operator=(const Img& b);
 };
 
 
-#if 1
+// Minimal PNG encoder, with its own deflate, so that it needs no libraries.
+
+// The table of crc32(). It's built before main() (or when the library is
+// loaded), so that threads never see it half done.
+struct Crc32Table {
+  unsigned int entries[256];
+
+  Crc32Table() {
+    for (unsigned int n = 0; n < 256; ++n) {
+      unsigned int c = n;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      entries[n] = c;
+    }
+  }
+};
+
+const Crc32Table kCrc32Table;
+
+unsigned int crc32(const unsigned char* buf, size_t len,
+    unsigned int crc = 0) {
+  const unsigned int* table = kCrc32Table.entries;
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i)
+    crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+void appendBE32(std::vector<unsigned char>& out, unsigned int v) {
+  out.push_back(v >> 24);
+  out.push_back((v >> 16) & 0xff);
+  out.push_back((v >> 8) & 0xff);
+  out.push_back(v & 0xff);
+}
+
+void appendPngChunk(std::vector<unsigned char>& out, const char* type,
+    const std::vector<unsigned char>& data) {
+  appendBE32(out, data.size());
+  size_t start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  appendBE32(out, crc32(&out[start], out.size() - start));
+}
+
+// Deflate (RFC 1951) for encodePng(): LZ77 matches found with hash chains,
+// coded with a dynamic Huffman code per block. It compresses about like
+// zlib's default level, without the library.
+
+// Writes bits LSB first, like deflate packs them.
+class BitWriter {
+ public:
+  BitWriter(std::vector<unsigned char>& out) : out(out), bits(0), n(0) {}
+
+  void put(unsigned int value, int count) {
+    bits |= (unsigned long)value << n;
+    n += count;
+    while (n >= 8) {
+      out.push_back(bits & 0xff);
+      bits >>= 8;
+      n -= 8;
+    }
+  }
+
+  // Huffman codes go MSB first.
+  void putCode(unsigned int code, int length) {
+    unsigned int reversed = 0;
+    for (int i = 0; i < length; ++i)
+      reversed |= ((code >> i) & 1) << (length - 1 - i);
+    put(reversed, length);
+  }
+
+  void flush() {
+    if (n > 0) out.push_back(bits & 0xff);
+    bits = 0;
+    n = 0;
+  }
+
+ private:
+  std::vector<unsigned char>& out;
+  unsigned long bits;
+  int n;
+};
+
+struct ByFreq {
+  const std::vector<unsigned int>& freq;
+  ByFreq(const std::vector<unsigned int>& f) : freq(f) {}
+  bool operator()(int a, int b) const {
+    return freq[a] < freq[b] || (freq[a] == freq[b] && a < b);
+  }
+};
+
+// Sets lengths to Huffman code lengths of at most maxLength bits for freq.
+// Symbols with frequency 0 get length 0. If the code gets too long, the
+// frequencies are flattened until it fits.
+void huffmanLengths(std::vector<unsigned int> freq, int maxLength,
+    std::vector<int>& lengths) {
+  int n = (int)freq.size();
+  lengths.assign(n, 0);
+  for (;;) {
+    std::vector<int> leaves;
+    for (int i = 0; i < n; ++i)
+      if (freq[i] > 0) leaves.push_back(i);
+    if (leaves.empty()) return;
+    if (leaves.size() == 1) {
+      lengths[leaves[0]] = 1;
+      return;
+    }
+    std::sort(leaves.begin(), leaves.end(), ByFreq(freq));
+
+    // Two queues: the sorted leaves and the merged nodes, which come out in
+    // order of weight too.
+    int numLeaves = (int)leaves.size();
+    std::vector<unsigned long> weight(2 * numLeaves);
+    std::vector<int> parent(2 * numLeaves, -1);
+    for (int i = 0; i < numLeaves; ++i)
+      weight[i] = freq[leaves[i]];
+    int nextLeaf = 0, nextNode = numLeaves, numNodes = numLeaves;
+    while (numNodes < 2 * numLeaves - 1) {
+      int pick[2];
+      for (int k = 0; k < 2; ++k) {
+        if (nextLeaf < numLeaves && (nextNode == numNodes
+                || weight[nextLeaf] <= weight[nextNode]))
+          pick[k] = nextLeaf++;
+        else
+          pick[k] = nextNode++;
+      }
+      weight[numNodes] = weight[pick[0]] + weight[pick[1]];
+      parent[pick[0]] = parent[pick[1]] = numNodes++;
+    }
+    std::vector<int> depth(numNodes, 0);
+    int longest = 0;
+    for (int i = numNodes - 2; i >= 0; --i) {
+      depth[i] = depth[parent[i]] + 1;
+      longest = std::max(longest, depth[i]);
+    }
+    if (longest <= maxLength) {
+      for (int i = 0; i < numLeaves; ++i)
+        lengths[leaves[i]] = depth[i];
+      return;
+    }
+    for (int i = 0; i < n; ++i)
+      if (freq[i] > 0) freq[i] = (freq[i] + 1) / 2;
+  }
+}
+
+// The canonical codes of lengths, see RFC 1951 3.2.2.
+void canonicalCodes(const std::vector<int>& lengths,
+    std::vector<unsigned int>& codes) {
+  int count[16] = { 0 };
+  for (size_t i = 0; i < lengths.size(); ++i)
+    ++count[lengths[i]];
+  count[0] = 0;
+  unsigned int next[16], code = 0;
+  for (int b = 1; b < 16; ++b) {
+    code = (code + count[b - 1]) << 1;
+    next[b] = code;
+  }
+  codes.assign(lengths.size(), 0);
+  for (size_t i = 0; i < lengths.size(); ++i)
+    if (lengths[i]) codes[i] = next[lengths[i]]++;
+}
+
+const int kDeflateLengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+  67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const int kDeflateLengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5,
+  5, 5, 5, 0
+};
+const int kDeflateDistBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+  769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+const int kDeflateDistExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+  11, 11, 12, 12, 13, 13
+};
+
+// A literal (length 0) or a match of length bytes dist bytes back.
+struct DeflateSymbol {
+  unsigned short length, dist;
+  unsigned char literal;
+};
+
+int deflateLengthCode(int length) {
+  int c = 0;
+  while (c < 28 && kDeflateLengthBase[c + 1] <= length) ++c;
+  return c;
+}
+
+int deflateDistCode(int dist) {
+  int c = 0;
+  while (c < 29 && kDeflateDistBase[c + 1] <= dist) ++c;
+  return c;
+}
+
+// Writes symbols as one block with dynamic Huffman codes.
+void writeDeflateBlock(BitWriter& bits, const std::vector<DeflateSymbol>& syms,
+    bool last) {
+  std::vector<unsigned int> litFreq(286, 0), distFreq(30, 0);
+  for (size_t i = 0; i < syms.size(); ++i) {
+    if (syms[i].length == 0) {
+      ++litFreq[syms[i].literal];
+    } else {
+      ++litFreq[257 + deflateLengthCode(syms[i].length)];
+      ++distFreq[deflateDistCode(syms[i].dist)];
+    }
+  }
+  litFreq[256] = 1;
+  // Some decoders don't like an empty distance code.
+  if (std::count(distFreq.begin(), distFreq.end(), 0u) == 30) distFreq[0] = 1;
+
+  std::vector<int> litLengths, distLengths;
+  huffmanLengths(litFreq, 15, litLengths);
+  huffmanLengths(distFreq, 15, distLengths);
+  int numLit = 286, numDist = 30;
+  while (numLit > 257 && litLengths[numLit - 1] == 0) --numLit;
+  while (numDist > 1 && distLengths[numDist - 1] == 0) --numDist;
+
+  // Both code lengths in a row, run-length coded with 16 (repeat the last
+  // 3-6 times), 17 (3-10 zeros) and 18 (11-138 zeros).
+  std::vector<int> all(litLengths.begin(), litLengths.begin() + numLit);
+  all.insert(all.end(), distLengths.begin(), distLengths.begin() + numDist);
+  std::vector<int> clSyms, clExtra;
+  for (size_t i = 0; i < all.size();) {
+    size_t run = 1;
+    while (i + run < all.size() && all[i + run] == all[i]) ++run;
+    if (all[i] == 0 && run >= 3) {
+      run = std::min(run, (size_t)138);
+      clSyms.push_back(run >= 11 ? 18 : 17);
+      clExtra.push_back(run - (run >= 11 ? 11 : 3));
+      i += run;
+    } else if (all[i] != 0 && run >= 4) {
+      clSyms.push_back(all[i]);
+      clExtra.push_back(0);
+      run = std::min(run - 1, (size_t)6);
+      clSyms.push_back(16);
+      clExtra.push_back(run - 3);
+      i += run + 1;
+    } else {
+      clSyms.push_back(all[i]);
+      clExtra.push_back(0);
+      ++i;
+    }
+  }
+  std::vector<unsigned int> clFreq(19, 0);
+  for (size_t i = 0; i < clSyms.size(); ++i)
+    ++clFreq[clSyms[i]];
+  std::vector<int> clLengths;
+  huffmanLengths(clFreq, 7, clLengths);
+  static const int kClOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+  int numCl = 19;
+  while (numCl > 4 && clLengths[kClOrder[numCl - 1]] == 0) --numCl;
+
+  std::vector<unsigned int> litCodes, distCodes, clCodes;
+  canonicalCodes(litLengths, litCodes);
+  canonicalCodes(distLengths, distCodes);
+  canonicalCodes(clLengths, clCodes);
+
+  bits.put(last ? 1 : 0, 1);
+  bits.put(2, 2);  // dynamic Huffman codes
+  bits.put(numLit - 257, 5);
+  bits.put(numDist - 1, 5);
+  bits.put(numCl - 4, 4);
+  for (int i = 0; i < numCl; ++i)
+    bits.put(clLengths[kClOrder[i]], 3);
+  static const int kClExtraBits[3] = { 2, 3, 7 };
+  for (size_t i = 0; i < clSyms.size(); ++i) {
+    bits.putCode(clCodes[clSyms[i]], clLengths[clSyms[i]]);
+    if (clSyms[i] >= 16)
+      bits.put(clExtra[i], kClExtraBits[clSyms[i] - 16]);
+  }
+
+  for (size_t i = 0; i < syms.size(); ++i) {
+    const DeflateSymbol& s = syms[i];
+    if (s.length == 0) {
+      bits.putCode(litCodes[s.literal], litLengths[s.literal]);
+      continue;
+    }
+    int lc = deflateLengthCode(s.length);
+    bits.putCode(litCodes[257 + lc], litLengths[257 + lc]);
+    bits.put(s.length - kDeflateLengthBase[lc], kDeflateLengthExtra[lc]);
+    int dc = deflateDistCode(s.dist);
+    bits.putCode(distCodes[dc], distLengths[dc]);
+    bits.put(s.dist - kDeflateDistBase[dc], kDeflateDistExtra[dc]);
+  }
+  bits.putCode(litCodes[256], litLengths[256]);
+}
+
+// Compresses data to out as a raw deflate stream. Matches are looked for in
+// the last 32k with up to kDeflateChainLength candidates, with one step of
+// lazy matching like zlib.
+const int kDeflateWindow = 1 << 15;
+const int kDeflateChainLength = 64;
+const size_t kDeflateBlockSymbols = 1 << 16;
+const int kDeflateHashBits = 15;
+
+unsigned int deflateHash(const unsigned char* p) {
+  return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << kDeflateHashBits) - 1);
+}
+
+void deflate(std::vector<unsigned char>& out, const unsigned char* data,
+    size_t n) {
+  std::vector<int> head(1 << kDeflateHashBits, -1), prev(kDeflateWindow, -1);
+  BitWriter bits(out);
+  std::vector<DeflateSymbol> syms;
+
+  size_t inserted = 0;  // positions below this are in the chains
+  size_t pos = 0;
+  int pendingLength = 0, pendingDist = 0;
+  while (pos < n) {
+    // Insert every position up to pos.
+    for (; inserted <= pos && inserted + 2 < n; ++inserted) {
+      unsigned int h = deflateHash(data + inserted);
+      prev[inserted & (kDeflateWindow - 1)] = head[h];
+      head[h] = (int)inserted;
+    }
+    int bestLength = 0, bestDist = 0;
+    if (pos + 2 < n) {
+      int maxLength = (int)std::min(n - pos, (size_t)258);
+      int candidate = prev[pos & (kDeflateWindow - 1)];
+      for (int chain = 0; chain < kDeflateChainLength && candidate >= 0
+          && pos - candidate <= (size_t)kDeflateWindow; ++chain) {
+        const unsigned char* a = data + pos;
+        const unsigned char* b = data + candidate;
+        if (b[bestLength] == a[bestLength]) {
+          int length = 0;
+          while (length < maxLength && a[length] == b[length]) ++length;
+          if (length > bestLength) {
+            bestLength = length;
+            bestDist = (int)(pos - candidate);
+            if (length == maxLength) break;
+          }
+        }
+        int next = prev[candidate & (kDeflateWindow - 1)];
+        if (next >= candidate) break;  // overwritten by a newer position
+        candidate = next;
+      }
+      if (bestLength < 3) bestLength = 0;
+    }
+
+    if (pendingLength > 0) {
+      // Take the match found one byte back unless this one is longer.
+      DeflateSymbol s;
+      if (bestLength > pendingLength) {
+        s.length = 0;
+        s.dist = 0;
+        s.literal = data[pos - 1];
+        syms.push_back(s);
+        pendingLength = bestLength;
+        pendingDist = bestDist;
+        ++pos;
+      } else {
+        s.length = pendingLength;
+        s.dist = pendingDist;
+        s.literal = 0;
+        syms.push_back(s);
+        pos += pendingLength - 1;
+        pendingLength = 0;
+      }
+    } else if (bestLength > 0) {
+      pendingLength = bestLength;
+      pendingDist = bestDist;
+      ++pos;
+    } else {
+      DeflateSymbol s;
+      s.length = 0;
+      s.dist = 0;
+      s.literal = data[pos];
+      syms.push_back(s);
+      ++pos;
+    }
+    if (syms.size() >= kDeflateBlockSymbols && pendingLength == 0) {
+      writeDeflateBlock(bits, syms, false);
+      syms.clear();
+    }
+  }
+  if (pendingLength > 0) {
+    DeflateSymbol s;
+    s.length = pendingLength;
+    s.dist = pendingDist;
+    s.literal = 0;
+    syms.push_back(s);
+  }
+  writeDeflateBlock(bits, syms, true);
+  bits.flush();
+}
+
+// Encodes 8 bit pixels with nc channels (1: gray, 3: rgb, 4: rgba), rows
+// stride bytes apart.
+void encodePng(std::vector<unsigned char>& out, const unsigned char* pix,
+    int w, int h, int nc, int stride) {
+  static const unsigned char kSignature[] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+  };
+  static const unsigned char kColorTypes[] = { 0, 0, 0, 2, 6 };
+  out.assign(kSignature, kSignature + 8);
+
+  std::vector<unsigned char> header;
+  appendBE32(header, w);
+  appendBE32(header, h);
+  header.push_back(8);  // bits per channel
+  header.push_back(kColorTypes[nc]);
+  header.push_back(0);  // deflate
+  header.push_back(0);  // adaptive filtering
+  header.push_back(0);  // no interlacing
+  appendPngChunk(out, "IHDR", header);
+
+  // Every row gets the filter (none, sub, up, average or Paeth) whose output
+  // has the smallest sum of absolute values, as signed bytes, which usually
+  // compresses best.
+  int rowBytes = w * nc;
+  std::vector<unsigned char> raw;
+  raw.reserve((rowBytes + 1) * h);
+  std::vector<unsigned char> zero(rowBytes, 0), filtered[5];
+  for (int f = 0; f < 5; ++f)
+    filtered[f].resize(rowBytes);
+  for (int y = 0; y < h; ++y) {
+    const unsigned char* row = pix + y*stride;
+    const unsigned char* up = y > 0 ? pix + (y - 1)*stride : &zero[0];
+    int best = 0;
+    unsigned long bestSum = ULONG_MAX;
+    for (int f = 0; f < 5; ++f) {
+      unsigned long sum = 0;
+      for (int x = 0; x < rowBytes; ++x) {
+        int a = x >= nc ? row[x - nc] : 0;
+        int b = up[x];
+        int c = x >= nc ? up[x - nc] : 0;
+        int predicted = 0;
+        if (f == 1) predicted = a;
+        else if (f == 2) predicted = b;
+        else if (f == 3) predicted = (a + b) / 2;
+        else if (f == 4) {
+          int p = a + b - c;
+          int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+          predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        }
+        unsigned char v = row[x] - predicted;
+        filtered[f][x] = v;
+        sum += v < 128 ? v : 256 - v;
+      }
+      if (sum < bestSum) {
+        bestSum = sum;
+        best = f;
+      }
+    }
+    raw.push_back(best);
+    raw.insert(raw.end(), filtered[best].begin(), filtered[best].end());
+  }
+
+  // zlib stream: header, deflate data, Adler-32 of the uncompressed data.
+  std::vector<unsigned char> z;
+  z.push_back(0x78);
+  z.push_back(0x9c);
+  deflate(z, raw.empty() ? NULL : &raw[0], raw.size());
+  unsigned int s1 = 1, s2 = 0;
+  for (size_t i = 0; i < raw.size();) {
+    // 5552 bytes is the most that can be summed before s2 overflows.
+    size_t end = std::min(raw.size(), i + 5552);
+    for (; i < end; ++i) {
+      s1 += raw[i];
+      s2 += s1;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+  appendBE32(z, (s2 << 16) | s1);
+  appendPngChunk(out, "IDAT", z);
+
+  appendPngChunk(out, "IEND", std::vector<unsigned char>());
+}
+
+
+#ifdef __APPLE__
 // Your own image loading/saving functions in here. I use ImageIO, because it's
 // preinstalled on OS X and works, even if it's a bit wordy.
 // I used OpenCV before, but it seems to be unable to load alpha and didn't
@@ -202,6 +1073,7 @@ void freeImageSource(ImageCollection image_source)
 bool imageFromSource(CGImageSourceRef image_source,
     int index, Img& img, Img* mask = NULL)
 {
+  PROFILE_SCOPE("decode");
   const int n = 3;
   bool result = true;
 
@@ -343,6 +1215,45 @@ cleanup:
   return result;
 }
 
+#else
+// No ImageIO here, so icns files can't be loaded (everything that works on
+// synthetic images still works). Debug images are written with encodePng().
+
+typedef void* ImageCollection;
+
+int getWidth(ImageCollection, int) { return 0; }
+bool trueColor(ImageCollection, int) { return false; }
+ImageCollection loadImageSource(const char*) { return NULL; }
+int getImageCount(ImageCollection) { return 0; }
+void freeImageSource(ImageCollection) {}
+
+bool imageFromSource(ImageCollection, int, Img&, Img* = NULL)
+{
+  return false;
+}
+
+bool LoadImage(const char*, Img&, Img* = NULL)
+{
+  return false;
+}
+
+bool SaveImage(const char* name, const Img& img)
+{
+  int nc = img.c == 1 ? 1 : 3;
+  std::vector<unsigned char> dst(img.w * img.h * nc);
+  for (int i = 0; i < img.w * img.h * nc; ++i)
+    dst[i] = int(255*clamp(img.pix[i], 0.0, 1.0) + 0.5);
+
+  std::vector<unsigned char> png;
+  encodePng(png, &dst[0], img.w, img.h, nc, img.w * nc);
+
+  FILE* f = fopen(name, "wb");
+  if (!f) return false;
+  bool result = fwrite(&png[0], 1, png.size(), f) == png.size();
+  return fclose(f) == 0 && result;
+}
+#endif
+
 std::string format(const char* s, va_list argList)
 {
 #ifdef _MSC_VER
@@ -380,8 +1291,6 @@ bool SaveImage(const Img& img, const char* name, ...)
 
   return SaveImage(str.c_str(), img);
 }
-  
-#endif
 
 
 // Creates a gaussian filter of size w x h. Both must be odd.
@@ -402,87 +1311,346 @@ void gauss(double* dest, int w, int h, double sigma) {
 }
 
 
-// Filters an image with an fw x fw filter.
+// A run of pixels [x0, x1) in row y. The image kernels below optionally take
+// a list of these and then only compute the pixels they cover. Pixels outside
+// of the spans are left untouched.
+struct Span {
+  int y, x0, x1;
+
+  Span(int iy, int ix0, int ix1) : y(iy), x0(ix0), x1(ix1) {}
+};
+typedef std::vector<Span> Spans;
+
+// Filters the pixels [x0, x1) of row y, see filter().
+void filterRun(const ImageView& dst, const ImageView& src,
+    const double* filter, int fw, int y, int x0, int x1) {
+  int w = src.w, h = src.h, nChans = src.c;
+  int r = (fw - 1)/2;
+  bool rowsInside = y - r >= 0 && y + r < h;
+  double* dstRow = dst.row(y);
+  for (int x = x0; x < x1; ++x) {
+    if (rowsInside && x - r >= 0 && x + r < w) {
+      // No clamping needed. Sums in the same order as below.
+      const double* s0 = src.row(y - r) + (x - r)*nChans;
+      for (int c = 0; c < nChans; ++c) {
+        double v = 0.0;
+        const double* f = filter;
+        for (int idy = 0; idy < fw; ++idy) {
+          const double* s = s0 + idy*src.stride + c;
+          for (int idx = 0; idx < fw; ++idx)
+            v += s[idx*nChans] * *f++;
+        }
+        dstRow[x*nChans + c] = v;
+      }
+      continue;
+    }
+    for (int c = 0; c < nChans; ++c) {
+      double v = 0.0;
+      for (int dy = -(fw - 1)/2, idy = 0; idy < fw; ++dy, ++idy) {
+        const double* s = src.row(clamp(y + dy, 0, h-1));
+        for (int dx = -(fw - 1)/2, idx = 0; idx < fw; ++dx, ++idx)
+          v += s[clamp(x + dx, 0, w-1)*nChans + c] * filter[idy*fw + idx];
+      }
+      dstRow[x*nChans + c] = v;
+    }
+  }
+}
+
+// Filters src into dst, which has the same size, with an fw x fw filter.
 // Pixels outside of the error are assumed to have the value of the nearest
 // border pixel.
 // fw must be odd.
-void filter(double* dst, const double* src, int w, int h,
-    double* filter, int fw, int nChans = 1) {
+void filter(const ImageView& dst, const ImageView& src, const double* filter,
+    int fw, const Spans* spans = NULL) {
   assert(fw%2 != 0);
-  for (int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-      for (int c = 0; c < nChans; ++c) {
-        *dst = 0.0;
-        for (int dy = -(fw - 1)/2, idy = 0; idy < fw; ++dy, ++idy) {
-          for (int dx = -(fw - 1)/2, idx = 0; idx < fw; ++dx, ++idx) {
-            *dst +=
-              src[(clamp(y + dy, 0, h-1)*w + clamp(x + dx, 0, w-1))*nChans + c]
-              * filter[idy*fw + idx];
-          }
-        }
-        ++dst;
-      }
+  if (spans) {
+    for (size_t i = 0; i < spans->size(); ++i) {
+      const Span& s = (*spans)[i];
+      filterRun(dst, src, filter, fw, s.y, s.x0, s.x1);
     }
+    return;
   }
+  for (int y = 0; y < src.h; ++y)
+    filterRun(dst, src, filter, fw, y, 0, src.w);
 }
 
-void separableFilter33(double* dst, const double* src, int w, int h,
-    double fx[3], double fy[3], int nChans = 1) {
-  double f[3 * 3];
+void separableKernel33(double f[3 * 3], const double fx[3],
+    const double fy[3]) {
   for (int y = 0; y < 3; ++y)
     for (int x = 0; x < 3; ++x)
       f[y*3 + x] = fy[y] * fx[x];
-  filter(dst, src, w, h, f, 3, nChans);
-}
-
-void calcDx(double* dst, const double* src, int w, int h, int nChans = 1) {
-  double xfilter[] = { -0.5, 0, 0.5 };
-  double yfilter[3]; gauss(yfilter, 3, 1, 0.8);
-  separableFilter33(dst, src, w, h, xfilter, yfilter, nChans);
 }
 
-void calcDy(double* dst, const double* src, int w, int h, int nChans = 1) {
-  double xfilter[3]; gauss(xfilter, 3, 1, 0.8);
-  double yfilter[] = { -0.5, 0, 0.5 };
-  separableFilter33(dst, src, w, h, xfilter, yfilter, nChans);
+void separableFilter33(const ImageView& dst, const ImageView& src,
+    double fx[3], double fy[3], const Spans* spans = NULL) {
+  double f[3 * 3];
+  separableKernel33(f, fx, fy);
+  filter(dst, src, f, 3, spans);
 }
 
-void calcDt(double* dst, const double* src0, const double* src1, int w, int h,
-    int nChans = 1, const double* mask = NULL) {
-  double f[3 * 3]; gauss(f, 3, 3, 1.0);
-
-  Img tmp(w, h, nChans);
-  filter(tmp.pix, src0, w, h, f, 3, nChans);
-  filter(dst, src1, w, h, f, 3, nChans);
-
-  // filter mask as well
-  Img filteredMask;
-  if (mask) {
-    filteredMask.setSize(w, h);
-    filter(filteredMask.pix, mask, w, h, f, 3);
+// Coefficients of Young and van Vliet's recursive Gaussian ("Recursive
+// implementation of the Gaussian filter", 1995): each output is b times the
+// input plus a[0..2] times the three outputs before it, once forwards and once
+// backwards along a line. That's a handful of multiplies per pixel for any
+// sigma, where filter() needs about (6 sigma)^2.
+//
+// Lines are extended by their border samples. Going forwards, that's where
+// the filter starts out anyway. Going backwards, the forward pass would have
+// gone on past the end, so the backward pass starts from where it would be
+// after filtering that extension back (Triggs and Sdika, "Boundary conditions
+// for Young-van Vliet recursive filtering", 2006): the border sample plus
+// m times how far the last three forward outputs are from it.
+struct RecursiveGauss {
+  double b, a[3];
+  double m[3][3];
+
+  RecursiveGauss(double sigma) {
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+        : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double q2 = q*q, q3 = q2*q;
+    double b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+    a[0] = (2.44413*q + 2.85619*q2 + 1.26661*q3) / b0;
+    a[1] = -(1.4281*q2 + 1.26661*q3) / b0;
+    a[2] = 0.422205*q3 / b0;
+    b = 1 - (a[0] + a[1] + a[2]);
+
+    // m by running both passes over an extension of 0s (the differences
+    // to the border sample) that starts with a single forward output of 1,
+    // long enough for the filter to have died down.
+    int n = 60 + (int)(30 * sigma);
+    std::vector<double> w(n + 3), y(n + 3);
+    for (int j = 0; j < 3; ++j) {
+      w[0] = w[1] = w[2] = 0.0;
+      w[2 - j] = 1.0;  // w[2] is the last forward output, w[1] the one before
+      for (int k = 3; k < n + 3; ++k)
+        w[k] = a[0]*w[k - 1] + a[1]*w[k - 2] + a[2]*w[k - 3];
+      y[n] = y[n + 1] = y[n + 2] = 0.0;
+      for (int k = n - 1; k >= 3; --k)
+        y[k] = b*w[k] + a[0]*y[k + 1] + a[1]*y[k + 2] + a[2]*y[k + 3];
+      for (int i = 0; i < 3; ++i)
+        m[i][j] = y[3 + i];
+    }
+  }
+};
 
-    // is premul followed by filtering the same as filtering mask and image
-    // and the premul'ing? -> No. damn. ((x1 + x2) * (a1 + a2) != a1*x1 + a2*x2)
-    //
-    // So the formula below is not 100% correct.
+// Runs g forwards and backwards over lines of n samples, step apart, in
+// place. lanes lines whose samples are next to each other are done at once,
+// so the inner loops are over neighboring doubles and vectorize.
+void recursiveGaussLines(double* p, int n, ptrdiff_t step, int lanes,
+    const RecursiveGauss& g) {
+  const double b = g.b, a0 = g.a[0], a1 = g.a[1], a2 = g.a[2];
+  // The border samples, then where the backward pass starts (see
+  // RecursiveGauss), for all lanes.
+  std::vector<double> border(p + (n - 1)*step, p + (n - 1)*step + lanes);
+  std::vector<double> after(3 * lanes);
+
+  // With the first sample extended, the first output is the first input.
+  for (int k = 1; k < n; ++k) {
+    double* cur = p + k*step;
+    const double* p1 = p + (k - 1)*step;
+    const double* p2 = p + std::max(k - 2, 0)*step;
+    const double* p3 = p + std::max(k - 3, 0)*step;
+    for (int l = 0; l < lanes; ++l)
+      cur[l] = b*cur[l] + a0*p1[l] + a1*p2[l] + a2*p3[l];
   }
 
-  for (int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-      for (int c = 0; c < nChans; ++c) {
-        if (!mask)
-          dst[(y*w + x)*nChans + c] -= tmp.pix[(y*w + x)*nChans + c];
-        // d - (1-a)*d + a*s = a*(s - d) = premul - a*d
-        else
-          dst[(y*w + x)*nChans + c]
-            = filteredMask.pix[y*w + x]*dst[(y*w + x)*nChans + c]
-            - tmp.pix[(y*w + x)*nChans + c];
-      }
+  for (int i = 0; i < 3; ++i) {
+    double* d = &after[i * lanes];
+    for (int l = 0; l < lanes; ++l) d[l] = border[l];
+    for (int j = 0; j < 3; ++j) {
+      const double* w = p + std::max(n - 1 - j, 0)*step;
+      for (int l = 0; l < lanes; ++l)
+        d[l] += g.m[i][j] * (w[l] - border[l]);
     }
   }
+  for (int k = n - 1; k >= 0; --k) {
+    const double* next[3];
+    for (int i = 0; i < 3; ++i)
+      next[i] = k + 1 + i < n ? p + (k + 1 + i)*step
+                              : &after[(k + 1 + i - n) * lanes];
+    double* cur = p + k*step;
+    const double *p1 = next[0], *p2 = next[1], *p3 = next[2];
+    for (int l = 0; l < lanes; ++l)
+      cur[l] = b*cur[l] + a0*p1[l] + a1*p2[l] + a2*p3[l];
+  }
 }
 
-void printMatrix(const double* m, int w, int h, const char* fmt = "%.4f") {
+// Rows the horizontal pass of recursiveGauss() filters at once.
+const int kRecursiveGaussRows = 8;
+
+// Blurs src into dst, which has the same size and may be src, with a
+// Gaussian of sigma, see RecursiveGauss. Like filter(), pixels outside of the
+// image have the value of the nearest border pixel. The approximation is
+// made for sigma >= 0.5; below that, a 3x3 kernel is exact enough.
+void recursiveGauss(const ImageView& dst, const ImageView& src,
+    double sigma) {
+  PROFILE_SCOPE("recursiveGauss");
+  int w = src.w, h = src.h, nc = src.c;
+  if (sigma < 0.5) {
+    double f[3 * 3]; gauss(f, 3, 3, sigma);
+    Img tmp;
+    tmp.copyFrom(src);
+    filter(dst, tmp, f, 3);
+    return;
+  }
+  RecursiveGauss g(sigma);
+
+  // Rows: a block of rows is interleaved into lines, so that pixel x of all
+  // of them is next to each other, filtered and written to dst.
+  const int R = kRecursiveGaussRows;
+  Img lines(w, 1, R * nc);
+  for (int y0 = 0; y0 < h; y0 += R) {
+    int rows = std::min(R, h - y0);
+    for (int r = 0; r < rows; ++r) {
+      const double* s = src.row(y0 + r);
+      for (int x = 0; x < w; ++x)
+        for (int c = 0; c < nc; ++c)
+          lines.pix[(x*R + r)*nc + c] = s[x*nc + c];
+    }
+    recursiveGaussLines(lines.pix, w, R * nc, rows * nc, g);
+    for (int r = 0; r < rows; ++r) {
+      double* d = dst.row(y0 + r);
+      for (int x = 0; x < w; ++x)
+        for (int c = 0; c < nc; ++c)
+          d[x*nc + c] = lines.pix[(x*R + r)*nc + c];
+    }
+  }
+
+  // Columns: all of a row's samples are next to each other already.
+  recursiveGaussLines(dst.pix, h, dst.stride, w * nc, g);
+}
+
+// recursiveGauss() of src into dst, but only the pixels of spans (if given)
+// are written. The whole image is blurred either way.
+void recursiveGauss(const ImageView& dst, const ImageView& src, double sigma,
+    const Spans* spans) {
+  if (!spans) {
+    recursiveGauss(dst, src, sigma);
+    return;
+  }
+  Img blurred(src.w, src.h, src.c);
+  recursiveGauss(blurred, src, sigma);
+  for (size_t i = 0; i < spans->size(); ++i) {
+    const Span& s = (*spans)[i];
+    memcpy(dst.row(s.y) + s.x0 * src.c,
+        blurred.pix + (s.y * src.w + s.x0) * src.c,
+        (s.x1 - s.x0) * src.c * sizeof(double));
+  }
+}
+
+// Central differences of src along x (dim 0) or y into dst, on the pixels of
+// spans or all of them. Pixels outside have the value of the nearest border
+// pixel.
+void centralDiff(const ImageView& dst, const ImageView& src, int dim,
+    const Spans* spans = NULL) {
+  int w = src.w, h = src.h, nc = src.c;
+  size_t numRuns = spans ? spans->size() : h;
+  for (size_t i = 0; i < numRuns; ++i) {
+    int y = spans ? (*spans)[i].y : (int)i;
+    int x0 = spans ? (*spans)[i].x0 : 0;
+    int x1 = spans ? (*spans)[i].x1 : w;
+    double* d = dst.row(y);
+    for (int x = x0; x < x1; ++x) {
+      const double *s0, *s1;
+      if (dim == 0) {
+        s0 = src.row(y) + std::max(x - 1, 0)*nc;
+        s1 = src.row(y) + std::min(x + 1, w - 1)*nc;
+      } else {
+        s0 = src.row(std::max(y - 1, 0)) + x*nc;
+        s1 = src.row(std::min(y + 1, h - 1)) + x*nc;
+      }
+      for (int c = 0; c < nc; ++c)
+        d[x*nc + c] = 0.5 * (s1[c] - s0[c]);
+    }
+  }
+}
+
+// The 3x3 filters of calcDx() and calcDy().
+void dxKernel(double f[3 * 3]) {
+  double xfilter[] = { -0.5, 0, 0.5 };
+  double yfilter[3]; gauss(yfilter, 3, 1, 0.8);
+  separableKernel33(f, xfilter, yfilter);
+}
+
+void dyKernel(double f[3 * 3]) {
+  double xfilter[3]; gauss(xfilter, 3, 1, 0.8);
+  double yfilter[] = { -0.5, 0, 0.5 };
+  separableKernel33(f, xfilter, yfilter);
+}
+
+void calcDx(const ImageView& dst, const ImageView& src,
+    const Spans* spans = NULL) {
+  double f[3 * 3]; dxKernel(f);
+  filter(dst, src, f, 3, spans);
+}
+
+void calcDy(const ImageView& dst, const ImageView& src,
+    const Spans* spans = NULL) {
+  double f[3 * 3]; dyKernel(f);
+  filter(dst, src, f, 3, spans);
+}
+
+// The blur of calcDt(): a 3x3 Gaussian of sigma 1 if sigma is 0, and a
+// recursiveGauss() of sigma otherwise.
+void blurForDt(const ImageView& dst, const ImageView& src,
+    const Spans* spans = NULL, double sigma = 0) {
+  if (sigma > 0) {
+    recursiveGauss(dst, src, sigma, spans);
+    return;
+  }
+  double f[3 * 3]; gauss(f, 3, 3, 1.0);
+  filter(dst, src, f, 3, spans);
+}
+
+// The rest of calcDt(), from its blurred images. dst may be blurred1.
+void blurredDt(const ImageView& dst, const ImageView& blurred0,
+    const ImageView& blurred1, const ImageView& blurredMask,
+    const Spans* spans = NULL) {
+  // is premul followed by filtering the same as filtering mask and image
+  // and the premul'ing? -> No. damn. ((x1 + x2) * (a1 + a2) != a1*x1 + a2*x2)
+  //
+  // So the formula below is not 100% correct.
+  int w = blurred0.w, h = blurred0.h, nChans = blurred0.c;
+  size_t numRuns = spans ? spans->size() : h;
+  for (size_t i = 0; i < numRuns; ++i) {
+    int y = spans ? (*spans)[i].y : (int)i;
+    int x0 = spans ? (*spans)[i].x0 : 0;
+    int x1 = spans ? (*spans)[i].x1 : w;
+    double* d = dst.row(y);
+    const double* b0 = blurred0.row(y);
+    const double* b1 = blurred1.row(y);
+    const double* m = blurredMask.pix ? blurredMask.row(y) : NULL;
+    for (int x = x0; x < x1; ++x) {
+      for (int c = 0; c < nChans; ++c) {
+        if (!m)
+          d[x*nChans + c] = b1[x*nChans + c] - b0[x*nChans + c];
+        // d - (1-a)*d + a*s = a*(s - d) = premul - a*d
+        else
+          d[x*nChans + c] = m[x]*b1[x*nChans + c] - b0[x*nChans + c];
+      }
+    }
+  }
+}
+
+// mask is a one channel image of the same size, or an empty view.
+void calcDt(const ImageView& dst, const ImageView& src0,
+    const ImageView& src1, const ImageView& mask = ImageView(),
+    const Spans* spans = NULL) {
+  int w = src0.w, h = src0.h, nChans = src0.c;
+  Img tmp(w, h, nChans);
+  blurForDt(tmp, src0, spans);
+  blurForDt(dst, src1, spans);
+
+  // filter mask as well
+  Img filteredMask;
+  if (mask.pix) {
+    filteredMask.setSize(w, h);
+    blurForDt(filteredMask, mask, spans);
+  }
+  blurredDt(dst, tmp, dst, filteredMask, spans);
+}
+
+void printMatrix(const double* m, int w, int h, const char* fmt = "%.4f") {
   for (int y = 0; y < h; ++y) {
     for (int x = 0; x < w; ++x) {
       printf(fmt, m[y*w + x]);
@@ -532,40 +1700,61 @@ double sample(const double* src, int w, int h, int nc,
 #endif
 }
 
-// Does an affine map using parameters a thusly:
-//   x' = a[0] + a[1] * x + a[2] * y
-//   y' = a[3] + a[4] * x + a[5] * y
-// Uses an inverse mapping and linear interpolation to fight aliasing
-void interp2(double* dest, const double* src, int w, int h, double a[6],
-    int nc = 1) {
+// Inverts the affine map a of interp2().
+void invertAffine(const double a[6], double aInv[6]) {
   // Found by Cramer's rule applied to homogenous coordinates
   double det = a[1]*a[5] - a[2]*a[4];
-  double aInv[6] = { (a[2]*a[3] - a[0]*a[5])/det,  a[5]/det, -a[2]/det,
-                     (a[0]*a[4] - a[1]*a[3])/det, -a[4]/det,  a[1]/det };
-  for (int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
+  aInv[0] = (a[2]*a[3] - a[0]*a[5])/det;
+  aInv[1] = a[5]/det;
+  aInv[2] = -a[2]/det;
+  aInv[3] = (a[0]*a[4] - a[1]*a[3])/det;
+  aInv[4] = -a[4]/det;
+  aInv[5] = a[1]/det;
+}
 
-      double dx = x - (w - 1)/2.0;
-      double dy = y - (h - 1)/2.0;
+// Maps the pixels [x0, x1) of row y of interp2() into destRow, given the
+// inverse aInv of its map.
+void interp2Run(double* destRow, const double* src, int w, int h,
+    const double aInv[6], int nc, int y, int x0, int x1) {
+  for (int x = x0; x < x1; ++x) {
 
-      double sx = aInv[0] + aInv[1] * dx + aInv[2] * dy;
-      double sy = aInv[3] + aInv[4] * dx + aInv[5] * dy;
+    double dx = x - (w - 1)/2.0;
+    double dy = y - (h - 1)/2.0;
 
-      sx = sx + (w - 1)/2.0;
-      sy = sy + (h - 1)/2.0;
+    double sx = aInv[0] + aInv[1] * dx + aInv[2] * dy;
+    double sy = aInv[3] + aInv[4] * dx + aInv[5] * dy;
 
-      for (int c = 0; c < nc; ++c) {
-        dest[(w*y + x)*nc + c] = sample(src, w, h, nc, sx, sy, c);
-      }
+    sx = sx + (w - 1)/2.0;
+    sy = sy + (h - 1)/2.0;
+
+    for (int c = 0; c < nc; ++c) {
+      destRow[x*nc + c] = sample(src, w, h, nc, sx, sy, c);
     }
   }
 }
 
+// Does an affine map using parameters a thusly:
+//   x' = a[0] + a[1] * x + a[2] * y
+//   y' = a[3] + a[4] * x + a[5] * y
+// Uses an inverse mapping and linear interpolation to fight aliasing
+void interp2(double* dest, const double* src, int w, int h, double a[6],
+    int nc = 1, const Spans* spans = NULL) {
+  double aInv[6];
+  invertAffine(a, aInv);
+  size_t numRuns = spans ? spans->size() : h;
+  for (size_t i = 0; i < numRuns; ++i) {
+    int y = spans ? (*spans)[i].y : (int)i;
+    int x0 = spans ? (*spans)[i].x0 : 0;
+    int x1 = spans ? (*spans)[i].x1 : w;
+    interp2Run(dest + w*y*nc, src, w, h, aInv, nc, y, x0, x1);
+  }
+}
+
 // Uses only translation/scaling
 void interp2Scale(double* dest, const double* src, int w, int h, double a[4],
-    int nc = 1) {
+    int nc = 1, const Spans* spans = NULL) {
   double aFull[] = { a[0], a[1], 0, a[2], 0, a[3] };
-  interp2(dest, src, w, h, aFull, nc);
+  interp2(dest, src, w, h, aFull, nc, spans);
 }
 
 template <class Num>
@@ -603,7 +1792,9 @@ bool gaussJordan(Num* matrix, Num* rhs, int n)
       }
     }
 
-    assert (currPivotRow != -1 && currPivotColumn != -1);
+    // no non-zero pivot left: the matrix is singular (or contains NaNs)
+    if (currPivotRow == -1 || currPivotColumn == -1)
+      return false;
     if(wasColumnUsed[currPivotColumn]) {
       assert(false);
       return false;
@@ -671,12 +1862,459 @@ bool gaussJordan(Num* matrix, Num* rhs, int n)
 
 
 
+// Knobs for pyramidFlow. The defaults do the blind solve the rects in
+// docerator.py were found with.
+struct FlowOptions {
+  // Iterations per pyramid level. Levels up to |coarseMaxWidth| pixels wide
+  // get |coarseIters|, larger ones |fineIters|.
+  // damp 0.8, 30 iters: http client works
+  // damp 0.9, 50 iters: acorn works
+  // damp 0.8, 50 iters: http client works, http works (12 working, only Ff,
+  //                     chaching missing)
+  int fineIters;
+  int coarseIters;
+  int coarseMaxWidth;
+
+  // basicFlow stops once an update is shorter than this.
+  double eps;
+
+  // Levels at least this wide are solved in grayscale, smaller ones in color.
+  // 0 means always gray, INT_MAX never.
+  int grayMinWidth;
+
+  // If > 0, |a| already holds an estimate for this image size (e.g. one
+  // rescaled from another variant of the same icon, see rescaleParams()), and
+  // only the finest |warmLevels| pyramid levels are run, |warmIters| iterations
+  // each.
+  int warmLevels;
+  int warmIters;
+
+  // Only look at the pixels around the app icon's mask, see basicFlow().
+  bool roi;
+
+  // If > 0, levels at least |selectMinWidth| wide only look at the
+  // |selectPixels| pixels with the strongest template gradient, see
+  // selectPixels(). If |selectTile| > 0, the pixels are picked per tile of
+  // that size instead of from the whole level.
+  int selectPixels;
+  int selectTile;
+  int selectMinWidth;
+  bool selectMaskWeight;
+
+  // Size ratio between pyramid levels, see Pyramid.
+  double pyramidStep;
+
+  // Levels at least this wide are solved row by row, see basicFlowStrips().
+  // Doesn't change results. INT_MAX means never.
+  int stripMinWidth;
+
+  // If > 0, pyramids are blurred with recursiveGauss() instead of a 5x5
+  // kernel, and basicFlow() takes the derivatives of a recursiveGauss() of
+  // this sigma instead of those of calcDx(), calcDy() and calcDt(), on
+  // levels at least kSmoothMinWidth wide. Wider blurs than the kernels can
+  // do help on noisy, textured icons, and cost the same as narrow ones.
+  // Levels are then solved one by one with basicFlow(), whose filters are the
+  // only ones that can do that. 0 means the kernels.
+  double smoothSigma;
+
+  // If > 0, the now() by which pyramidFlow() has to be done. It gives each
+  // level the iterations that fit into its share of the time that's left,
+  // and stops with the best estimate so far when the time is up, see
+  // levelBudget(). 0 means no limit.
+  double deadline;
+
+  // Print every iteration and save the intermediate images that
+  // flowtests.py shows.
+  bool debugOutput;
+
+  FlowOptions() : fineIters(50), coarseIters(100), coarseMaxWidth(32),
+      eps(1e-4), grayMinWidth(128), warmLevels(0), warmIters(15), roi(false),
+      selectPixels(0), selectTile(0), selectMinWidth(128),
+      selectMaskWeight(true), pyramidStep(2.0), stripMinWidth(256),
+      smoothSigma(0), deadline(0), debugOutput(true) {}
+};
+
+// What happened during a solve, see pyramidFlow().
+struct FlowStats {
+  int iterations;     // over all levels
+  int levels;         // number of levels solved
+  bool converged;     // the finest level stopped because the update got small
+  double updateNorm;  // length of the last update
+  double residual;    // mean squared dt in the last iteration
+  bool timedOut;      // opts.deadline stopped the solve early
+
+  FlowStats() : iterations(0), levels(0), converged(false), updateNorm(0),
+      residual(0), timedOut(false) {}
+};
+
+// Levels narrower or lower than this keep the 3x3 derivative kernels with
+// FlowOptions::smoothSigma, and pyramid levels made from them the 5x5 kernel.
+// The few pixels of small levels don't have the noise the wider blurs are
+// for, and their estimates drift or diverge with them from about 16x16 on.
+const int kSmoothMinWidth = 64;
+
+// The blur of the derivatives of a w x h level with opts.smoothSigma, 0 for
+// the 3x3 kernels. At most an eighth of the level: blurring any wider
+// flattens the gradients.
+double levelSmoothSigma(const FlowOptions& opts, int w, int h) {
+  if (opts.smoothSigma <= 0 || std::min(w, h) < kSmoothMinWidth) return 0;
+  return std::min(opts.smoothSigma, std::min(w, h) / 8.0);
+}
+
+// The estimate with the smallest residual on the level being solved, which a
+// solve with FlowOptions::deadline falls back to when its time is up.
+struct BestEstimate {
+  double a[4];
+  double residual;
+  bool valid;
+
+  BestEstimate() : residual(0), valid(false) {}
+
+  void update(const double* estimate, double r) {
+    if (valid && r >= residual) return;
+    std::copy(estimate, estimate + 4, a);
+    residual = r;
+    valid = true;
+  }
+};
+
+// The part of a pyramid level that the solver looks at: the bounding box
+// [x0, x1) x [y0, y1) of the non-zero mask pixels and their runs in each row,
+// both grown by some radius.
+struct Roi {
+  int x0, y0, x1, y1;
+  Spans spans;
+  int numPixels;
+
+  Roi() : x0(0), y0(0), x1(0), y1(0), numPixels(0) {}
+};
+
+// Fills roi with the non-zero pixels of mask, dilated by a square of size
+// 2*radius + 1 (so that a filter of that radius centered on any mask pixel
+// only reads pixels inside the roi).
+void computeRoi(Roi& roi, const double* mask, int w, int h, int radius) {
+  std::vector<unsigned char> rows(w * h, 0), grown(w * h, 0);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      if (mask[y*w + x] != 0.0)
+        for (int xx = std::max(x - radius, 0);
+            xx <= std::min(x + radius, w - 1); ++xx)
+          rows[y*w + xx] = 1;
+  for (int y = 0; y < h; ++y)
+    for (int yy = std::max(y - radius, 0);
+        yy <= std::min(y + radius, h - 1); ++yy)
+      for (int x = 0; x < w; ++x)
+        grown[y*w + x] |= rows[yy*w + x];
+
+  roi.x0 = w; roi.y0 = h;
+  roi.x1 = roi.y1 = 0;
+  roi.spans.clear();
+  roi.numPixels = 0;
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w;) {
+      if (!grown[y*w + x]) { ++x; continue; }
+      int x0 = x;
+      while (x < w && grown[y*w + x]) ++x;
+      roi.spans.push_back(Span(y, x0, x));
+      roi.numPixels += x - x0;
+      roi.x0 = std::min(roi.x0, x0);
+      roi.x1 = std::max(roi.x1, x);
+      roi.y0 = std::min(roi.y0, y);
+      roi.y1 = y + 1;
+    }
+  }
+}
+
+struct ByScore {
+  const double* score;
+  ByScore(const double* s) : score(s) {}
+  bool operator()(int a, int b) const { return score[a] > score[b]; }
+};
+
+// Marks (with 1.0) the n pixels in selected that contribute most to the
+// structure tensor, i.e. the ones where the template i0 has the largest
+// gradient (times the mask, if given). Flat pixels are never picked, so there
+// can be fewer. If tile > 0, every tile x tile block gets its share of the n
+// pixels by area (the shares are rounded so that they add up to n), so that
+// the picks are spread over the image instead of clustering on the strongest
+// edge. Returns the number of pixels marked.
+int selectPixels(double* selected, const double* i0, const double* mask,
+    int w, int h, int nc, int n, int tile) {
+  Img dx(w, h, nc), dy(w, h, nc), score(w, h);
+  calcDx(dx, ImageView(i0, w, h, nc));
+  calcDy(dy, ImageView(i0, w, h, nc));
+  for (int i = 0; i < w * h; ++i) {
+    score.pix[i] = 0.0;
+    for (int c = 0; c < nc; ++c)
+      score.pix[i] += dx.pix[i*nc + c]*dx.pix[i*nc + c]
+                    + dy.pix[i*nc + c]*dy.pix[i*nc + c];
+    if (mask)
+      score.pix[i] *= mask[i];
+    selected[i] = 0.0;
+  }
+
+  if (tile <= 0) tile = std::max(w, h);
+  n = std::min(n, w * h);
+
+  // Each tile's quota is its area's share of n, rounded down; the pixels
+  // that are left go to the tiles with the largest remainders.
+  std::vector<int> quota;
+  std::vector<std::pair<double, int> > remainders;
+  int assigned = 0;
+  for (int ty = 0; ty < h; ty += tile) {
+    for (int tx = 0; tx < w; tx += tile) {
+      int area = (std::min(tx + tile, w) - tx) * (std::min(ty + tile, h) - ty);
+      double share = (double)n * area / (w * h);
+      quota.push_back((int)share);
+      assigned += quota.back();
+      remainders.push_back(
+          std::make_pair(-(share - quota.back()), (int)quota.size() - 1));
+    }
+  }
+  std::sort(remainders.begin(), remainders.end());
+  for (int i = 0; i < n - assigned; ++i)
+    ++quota[remainders[i].second];
+
+  std::vector<int> idx;
+  int t = 0, numSelected = 0;
+  for (int ty = 0; ty < h; ty += tile) {
+    for (int tx = 0; tx < w; tx += tile, ++t) {
+      idx.clear();
+      for (int y = ty; y < std::min(ty + tile, h); ++y)
+        for (int x = tx; x < std::min(tx + tile, w); ++x)
+          idx.push_back(y*w + x);
+
+      int k = std::min(quota[t], (int)idx.size());
+      std::nth_element(idx.begin(), idx.begin() + k, idx.end(),
+          ByScore(score.pix));
+      for (int i = 0; i < k; ++i) {
+        if (score.pix[idx[i]] <= 0.0) continue;
+        selected[idx[i]] = 1.0;
+        ++numSelected;
+      }
+    }
+  }
+  return numSelected;
+}
+
+// Adds the pixels [x0, x1) of row y to basicFlow()'s structure tensor, right
+// hand side and sum of squared dt. dx, dy and dt point at pixel x0.
+void accumulateTensorRun(double* structureTensor, double* rhs, double& sse,
+    const double* dx, const double* dy, const double* dt, int w, int h,
+    int nc, int y, int x0, int x1) {
+  const double* fImg[] = { dx, dx, dy, dy };
+  double fPos[] = { 1.0, 0.0, 1.0, 0.0 };
+  fPos[3] = y - (h - 1)/2.0 ;
+  for (int x = x0; x < x1; ++x) {
+    fPos[1] = x - (w - 1)/2.0 ;
+    int p = (x - x0)*nc;
+    for (int c = 0; c < nc; ++c)
+      sse += dt[p + c] * dt[p + c];
+
+    for (int j = 0; j < 4; ++j) {
+      for (int k = 0; k < 4; ++k) {
+        for (int c = 0; c < nc; ++c)
+          structureTensor[j*4 + k] += fImg[j][p + c]
+            * fImg[k][p + c]
+            * fPos[j]
+            * fPos[k];
+      }
+      for (int c = 0; c < nc; ++c)
+        rhs[j] -=
+          fImg[j][p + c]
+          * dt[p + c]
+          * fPos[j];
+    }
+  }
+}
+
+// Solves for one update of basicFlow() and applies it to a. Returns false
+// once the iterations should stop. If best is given, it's updated with a and
+// its residual before the update.
+bool applyFlowUpdate(double* structureTensor, double* rhs, double sse,
+    int numPixels, double* a, const FlowOptions& opts, FlowStats* stats,
+    BestEstimate* best = NULL) {
+  // Solve linear equation
+  //printMatrix(structureTensor, 4, 4); printf("\n");
+  //printMatrix(rhs, 4, 1); printf("\n");
+  bool solved;
+  {
+    PROFILE_SCOPE("solve");
+    solved = gaussJordan(structureTensor, rhs, 4);
+  }
+  double residual = numPixels ? sse / numPixels : 0.0;
+  if (stats)
+    stats->residual = residual;
+  if (best)
+    best->update(a, residual);
+  if (!solved)
+    return false;  // no usable gradients (or diverged), keep the last estimate
+  //printMatrix(rhs, 4, 1); printf("\n");
+
+  double norm = 0.0;
+  for (int j = 0; j < 4; ++j)
+    norm += rhs[j] * rhs[j];
+  if (stats)
+    stats->updateNorm = sqrt(norm);
+  if (sqrt(norm) < opts.eps) {
+    if (stats) stats->converged = true;
+    return false;
+  }
+
+  float damp = 0.8;
+  for (int j = 0; j < 4; ++j)
+    a[j] += damp*rhs[j];
+  return true;
+}
+
+// Whether opts.deadline has passed. If so, a falls back to best.
+bool pastDeadline(const FlowOptions& opts, const BestEstimate& best,
+    double* a, FlowStats* stats) {
+  if (opts.deadline <= 0 || now() < opts.deadline) return false;
+  if (best.valid) {
+    std::copy(best.a, best.a + 4, a);
+    if (stats) stats->residual = best.residual;
+  }
+  if (stats) {
+    stats->timedOut = true;
+    stats->converged = false;
+  }
+  return true;
+}
+
+// Filters the pixels of one row with a 3x3 filter, given the rows above, at
+// and below it (already clamped to the image). Sums like filter().
+void filterRow33(double* dst, const double* const rows[3], int w,
+    const double* filter, int nChans) {
+  for (int x = 0; x < w; ++x) {
+    for (int c = 0; c < nChans; ++c) {
+      double v = 0.0;
+      for (int idy = 0; idy < 3; ++idy) {
+        for (int dx = -1, idx = 0; idx < 3; ++dx, ++idx) {
+          v += rows[idy][clamp(x + dx, 0, w-1)*nChans + c]
+            * filter[idy*3 + idx];
+        }
+      }
+      dst[x*nChans + c] = v;
+    }
+  }
+}
+
+// basicFlow() in one pass over the rows per iteration, for large levels.
+// Warped rows are generated into a ring of three just ahead of the 3x3
+// filters that read them, and each row of dx, dy and dt is summed into the
+// structure tensor right after it's computed. So the working memory is a
+// handful of rows instead of four images of the level's size, and it stays
+// in cache. Gives the same results as basicFlow() without opts.roi and pixel
+// selection.
+void basicFlowStrips(const double* i0, const double* i1, int w, int h,
+    double* a, int nc, int iters, const double* mask,
+    const FlowOptions& opts, FlowStats* stats) {
+  Img ring(w, 3, nc);  // warped row r is in row r%3
+  Img dx(w, 1, nc), dy(w, 1, nc), dt(w, 1, nc), filtered0(w, 1, nc);
+  Img filteredMask(w, 1);
+  const int stride = w * nc;
+
+  double fDx[3 * 3], fDy[3 * 3], fDt[3 * 3];
+  dxKernel(fDx);
+  dyKernel(fDy);
+  gauss(fDt, 3, 3, 1.0);
+
+  BestEstimate best;
+  for (int i = 0; i < iters; ++i) {
+    if (i > 0 && pastDeadline(opts, best, a, stats))
+      return;
+    PROFILE_COUNT("iterations", 1);
+    if (stats) {
+      ++stats->iterations;
+      stats->converged = false;
+    }
+    double aScale[] = { -a[0]/a[1], 1.0/a[1], -a[2]/a[3], 1.0/a[3] };
+    double aFull[] = { aScale[0], aScale[1], 0, aScale[2], 0, aScale[3] };
+    double aInv[6];
+    invertAffine(aFull, aInv);
+
+    double structureTensor[16] = { 0.0 }, rhs[4] = { 0.0 };
+    double sse = 0.0;
+    {
+      PROFILE_SCOPE("strips");
+      int next = 0;  // next row to warp
+      for (int y = 0; y < h; ++y) {
+        int above = std::max(y - 1, 0), below = std::min(y + 1, h - 1);
+        for (; next <= below; ++next)
+          interp2Run(ring.pix + (next%3)*stride, i1, w, h, aInv, nc, next,
+              0, w);
+        const double* warped[] = { ring.pix + (above%3)*stride,
+          ring.pix + (y%3)*stride, ring.pix + (below%3)*stride };
+        filterRow33(dx.pix, warped, w, fDx, nc);
+        filterRow33(dy.pix, warped, w, fDy, nc);
+
+        // like calcDt()
+        const double* src0[] = {
+          i0 + above*stride, i0 + y*stride, i0 + below*stride };
+        filterRow33(filtered0.pix, src0, w, fDt, nc);
+        filterRow33(dt.pix, warped, w, fDt, nc);
+        if (mask) {
+          const double* maskRows[] = {
+            mask + above*w, mask + y*w, mask + below*w };
+          filterRow33(filteredMask.pix, maskRows, w, fDt, 1);
+        }
+        for (int x = 0; x < w; ++x) {
+          for (int c = 0; c < nc; ++c) {
+            if (!mask)
+              dt.pix[x*nc + c] -= filtered0.pix[x*nc + c];
+            else
+              dt.pix[x*nc + c] = filteredMask.pix[x]*dt.pix[x*nc + c]
+                - filtered0.pix[x*nc + c];
+          }
+        }
+
+        accumulateTensorRun(structureTensor, rhs, sse, dx.pix, dy.pix,
+            dt.pix, w, h, nc, y, 0, w);
+      }
+    }
+
+    if (!applyFlowUpdate(structureTensor, rhs, sse, w * h, a, opts, stats,
+            &best))
+      return;
+  }
+}
+
 // Computes the flow from i0 to i1, stores results in a. a must contain a
 // valid close starting value (e.g. { 0, 1, 0, 1 })
+// If opts.roi is set, only the pixels close to the non-zero part of the mask
+// are looked at. This ignores the gradients of i1 that are not covered by i0
+// at all, so it does not only make things faster, it also changes results
+// a bit. opts.selectPixels goes further and only looks at a few strong edges.
+// Levels at least opts.stripMinWidth wide are solved by basicFlowStrips().
 void basicFlow(const double* i0, const double* i1, int w, int h, double* a,
-    int nc, int iters, const double* mask, int index) {
-  // XXX: add ROI
-  const double EPS = 1e-4;
+    int nc, int iters, const double* mask, int index,
+    const FlowOptions& opts = FlowOptions(), FlowStats* stats = NULL) {
+  // The structure tensor is summed over the mask, grown by the radius of the
+  // dt filter (or over the selected pixels). dx and dy are needed there too,
+  // and their filters need one more pixel of the warped image around that.
+  Roi tensorRoi, warpRoi;
+  const Spans* tensorSpans = NULL;
+  const Spans* warpSpans = NULL;
+  if (opts.selectPixels > 0 && w >= opts.selectMinWidth
+      && opts.selectPixels < w * h) {
+    Img selected(w, h);
+    if (selectPixels(selected.pix, i0, opts.selectMaskWeight ? mask : NULL,
+            w, h, nc, opts.selectPixels, opts.selectTile) == 0)
+      fprintf(stderr, "--select found no pixels with a gradient at %dx%d, "
+          "using all of them\n", w, h);
+    computeRoi(tensorRoi, selected.pix, w, h, 0);
+    computeRoi(warpRoi, selected.pix, w, h, 1);
+  } else if (opts.roi && mask) {
+    computeRoi(tensorRoi, mask, w, h, 1);
+    computeRoi(warpRoi, mask, w, h, 2);
+  }
+  if (tensorRoi.numPixels == 0 && !opts.debugOutput
+      && w >= opts.stripMinWidth && opts.smoothSigma <= 0) {
+    basicFlowStrips(i0, i1, w, h, a, nc, iters, mask, opts, stats);
+    return;
+  }
+  double sigma = levelSmoothSigma(opts, w, h);
 
   Img warped(w, h, nc);
 
@@ -684,12 +2322,49 @@ void basicFlow(const double* i0, const double* i1, int w, int h, double* a,
   Img dy(w, h, nc);
   Img dt(w, h, nc);
 
+  if (tensorRoi.numPixels > 0) {
+    tensorSpans = &tensorRoi.spans;
+    // With sigma, the blur of the warped image reaches about 3 sigma past
+    // the spans, so all of it is warped.
+    if (sigma <= 0) {
+      warpSpans = &warpRoi.spans;
+      memset(warped.pix, 0, w * h * nc * sizeof(double));
+    }
+    if (opts.debugOutput)
+      printf("ROI %d,%d - %d,%d, %d spans, %.1f%% of pixels\n",
+        tensorRoi.x0, tensorRoi.y0, tensorRoi.x1, tensorRoi.y1,
+        (int)tensorRoi.spans.size(),
+        100.0 * (warpSpans ? warpRoi.numPixels : w * h) / (w * h));
+  }
+
+  // The parts of calcDt() that don't change between iterations. The warped
+  // image is blurred once per iteration, for all three derivatives with
+  // sigma.
+  Img blurred0(w, h, nc), blurredMask, blurredWarped(w, h, nc);
+  blurForDt(blurred0, ImageView(i0, w, h, nc), tensorSpans, sigma);
+  if (mask) {
+    blurredMask.setSize(w, h);
+    blurForDt(blurredMask, ImageView(mask, w, h), tensorSpans, sigma);
+  }
+
+  BestEstimate best;
   for (int i = 0; i < iters; ++i) {
+    if (i > 0 && pastDeadline(opts, best, a, stats))
+      return;
 
-    printf("Iter %d: %f %f %f %f\n", i, a[0], a[1], a[2], a[3]);
+    if (opts.debugOutput)
+      printf("Iter %d: %f %f %f %f\n", i, a[0], a[1], a[2], a[3]);
 
+    PROFILE_COUNT("iterations", 1);
+    if (stats) {
+      ++stats->iterations;
+      stats->converged = false;
+    }
     double aInv[4] = { -a[0]/a[1], 1.0/a[1], -a[2]/a[3], 1.0/a[3] };
-    interp2Scale(warped.pix, i1, w, h, aInv, nc);
+    {
+      PROFILE_SCOPE("warp");
+      interp2Scale(warped.pix, i1, w, h, aInv, nc, warpSpans);
+    }
 #if 0
     Img warpedMask(w, h);  // mask is always just one channel
     // Turns out applying the mask to the background image confuses the
@@ -713,324 +2388,6888 @@ void basicFlow(const double* i0, const double* i1, int w, int h, double* a,
 #endif
 
 
-    SaveImage(warped, "%d_warped_%03d_%03d.png", index, w, i);
+    if (opts.debugOutput)
+      SaveImage(warped, "%d_warped_%03d_%03d.png", index, w, i);
 
     // XXX: these need to compute norm or rgb vectors
-    calcDx(dx.pix, warped.pix, w, h, nc);
-    calcDy(dy.pix, warped.pix, w, h, nc);
-    calcDt(dt.pix, i0, warped.pix, w, h, nc, mask);
+    {
+      PROFILE_SCOPE("derivatives");
+      if (sigma > 0) {
+        recursiveGauss(blurredWarped, warped, sigma);
+        centralDiff(dx, blurredWarped, 0, tensorSpans);
+        centralDiff(dy, blurredWarped, 1, tensorSpans);
+      } else {
+        calcDx(dx, warped, tensorSpans);
+        calcDy(dy, warped, tensorSpans);
+        blurForDt(blurredWarped, warped, tensorSpans);
+      }
+      blurredDt(dt, blurred0, blurredWarped, blurredMask, tensorSpans);
+    }
 
     // Makes only a difference of 20 seconds when running this on 14 inputs!
     //SaveImage("dx.png", dx);
     //SaveImage("dy.png", dy);
     //SaveImage("dt.png", dt);
 
-    double* fImg[] = { dx.pix, dx.pix, dy.pix, dy.pix };
-    double fPos[] = { 1.0, 0.0, 1.0, 0.0 };
-
     double structureTensor[16] = { 0.0 }, rhs[4] = { 0.0 };
-    for (int y = 0; y < h; ++y) {
-      fPos[3] = y - (h - 1)/2.0 ;
-      for (int x = 0; x < w; ++x) {
-        fPos[1] = x - (w - 1)/2.0 ;
+    double sse = 0.0;
+    int numPixels = 0;
+    {
+      PROFILE_SCOPE("tensor");
+      size_t numRuns = tensorSpans ? tensorSpans->size() : h;
+      for (size_t r = 0; r < numRuns; ++r) {
+        int y = tensorSpans ? (*tensorSpans)[r].y : (int)r;
+        int x0 = tensorSpans ? (*tensorSpans)[r].x0 : 0;
+        int x1 = tensorSpans ? (*tensorSpans)[r].x1 : w;
+        numPixels += x1 - x0;
+        int p = (y*w + x0)*nc;
+        accumulateTensorRun(structureTensor, rhs, sse, dx.pix + p,
+            dy.pix + p, dt.pix + p, w, h, nc, y, x0, x1);
+      }
+    }
+
+    if (!applyFlowUpdate(structureTensor, rhs, sse, numPixels, a, opts,
+            stats, &best))
+      return;
+  }
+}
+
+// Lane-batched basicFlow() for many small problems of the same size. The
+// images of kFlowLanes problems are interleaved like channels: channel c of
+// problem l is channel c*kFlowLanes + l. The innermost loops below run over
+// the lanes, so that each vector instruction advances several problems at
+// the same pixel. Problems that converged, or whose tensor became singular,
+// are masked out and keep their estimate; the iterations stop once all
+// problems are done. Every lane gets the same result as basicFlow() without
+// opts.roi and pixel selection.
+const int kFlowLanes = 8;
+
+struct FlowLanes {
+  int w, h, nc;
+  Img i0, i1, mask;  // nc*kFlowLanes channels, mask kFlowLanes
+  double a[4][kFlowLanes];
+  FlowStats* stats[kFlowLanes];  // may be NULL
+  bool active[kFlowLanes];       // unused lanes are inactive
+};
+
+// filter() for images with many channels. Loops over the channels innermost
+// and sums in the same order as filter().
+void filterChannels(double* dst, const double* src, int w, int h,
+    const double* filter, int fw, int nChans) {
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      double* d = dst + (y*w + x)*nChans;
+      for (int c = 0; c < nChans; ++c)
+        d[c] = 0.0;
+      for (int dy = -(fw - 1)/2, idy = 0; idy < fw; ++dy, ++idy) {
+        for (int dx = -(fw - 1)/2, idx = 0; idx < fw; ++dx, ++idx) {
+          const double* s =
+              src + (clamp(y + dy, 0, h-1)*w + clamp(x + dx, 0, w-1))*nChans;
+          double f = filter[idy*fw + idx];
+          for (int c = 0; c < nChans; ++c)
+            d[c] += s[c] * f;
+        }
+      }
+    }
+  }
+}
+
+// interp2Scale() with every lane's own parameters.
+void interp2ScaleLanes(double* dest, const double* src, int w, int h,
+    const double aInv[4][kFlowLanes], int nc) {
+  const int L = kFlowLanes;
+  double m[6][L];
+  for (int l = 0; l < L; ++l) {
+    double aFull[] = { aInv[0][l], aInv[1][l], 0, aInv[2][l], 0, aInv[3][l] };
+    double mInv[6];
+    invertAffine(aFull, mInv);
+    for (int t = 0; t < 6; ++t) m[t][l] = mInv[t];
+  }
+
+  int i00[L], i01[L], i10[L], i11[L];
+  double fx[L], fy[L];
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      double dx = x - (w - 1)/2.0;
+      double dy = y - (h - 1)/2.0;
+      for (int l = 0; l < L; ++l) {
+        double sx = m[0][l] + m[1][l] * dx + m[2][l] * dy;
+        double sy = m[3][l] + m[4][l] * dx + m[5][l] * dy;
+        sx = sx + (w - 1)/2.0;
+        sy = sy + (h - 1)/2.0;
+
+        // like sample()
+        int x0 = clamp((int)sx, 0, w-1);
+        int x1 = clamp(x0 + 1, 0, w-1);
+        int y0 = clamp((int)sy, 0, h-1);
+        int y1 = clamp(y0 + 1, 0, h-1);
+        fx[l] = sx - (int)sx;
+        fy[l] = sy - (int)sy;
+        i00[l] = (y0*w + x0)*nc*L + l;
+        i01[l] = (y0*w + x1)*nc*L + l;
+        i10[l] = (y1*w + x0)*nc*L + l;
+        i11[l] = (y1*w + x1)*nc*L + l;
+      }
+      double* d = dest + (y*w + x)*nc*L;
+      for (int c = 0; c < nc; ++c) {
+        for (int l = 0; l < L; ++l) {
+          double s0 = lerp(fx[l], src[i00[l] + c*L], src[i01[l] + c*L]);
+          double s1 = lerp(fx[l], src[i10[l] + c*L], src[i11[l] + c*L]);
+          d[c*L + l] = lerp(fy[l], s0, s1);
+        }
+      }
+    }
+  }
+}
+
+void basicFlowLanes(FlowLanes& b, int iters, const FlowOptions& opts) {
+  const int L = kFlowLanes;
+  int w = b.w, h = b.h, nc = b.nc, nChans = nc*L;
+  Img warped(w, h, nChans);
+  Img dx(w, h, nChans);
+  Img dy(w, h, nChans);
+  Img dt(w, h, nChans);
+
+  double fDx[3 * 3], fDy[3 * 3], fDt[3 * 3];
+  dxKernel(fDx);
+  dyKernel(fDy);
+  gauss(fDt, 3, 3, 1.0);
+
+  // The parts of calcDt() that don't change between iterations.
+  Img filtered0(w, h, nChans), filteredMask(w, h, L);
+  filterChannels(filtered0.pix, b.i0.pix, w, h, fDt, 3, nChans);
+  filterChannels(filteredMask.pix, b.mask.pix, w, h, fDt, 3, L);
 
-        for (int j = 0; j < 4; ++j) {
-          for (int k = 0; k < 4; ++k) {
+  for (int i = 0; i < iters; ++i) {
+    int numActive = 0;
+    for (int l = 0; l < L; ++l) {
+      if (!b.active[l]) continue;
+      ++numActive;
+      if (b.stats[l]) {
+        ++b.stats[l]->iterations;
+        b.stats[l]->converged = false;
+      }
+    }
+    if (numActive == 0) break;
+    PROFILE_COUNT("iterations", numActive);
+
+    double aInv[4][L];
+    for (int l = 0; l < L; ++l) {
+      aInv[0][l] = -b.a[0][l]/b.a[1][l];
+      aInv[1][l] = 1.0/b.a[1][l];
+      aInv[2][l] = -b.a[2][l]/b.a[3][l];
+      aInv[3][l] = 1.0/b.a[3][l];
+    }
+    {
+      PROFILE_SCOPE("warp");
+      interp2ScaleLanes(warped.pix, b.i1.pix, w, h, aInv, nc);
+    }
+
+    {
+      PROFILE_SCOPE("derivatives");
+      filterChannels(dx.pix, warped.pix, w, h, fDx, 3, nChans);
+      filterChannels(dy.pix, warped.pix, w, h, fDy, 3, nChans);
+      filterChannels(dt.pix, warped.pix, w, h, fDt, 3, nChans);
+      for (int p = 0; p < w*h; ++p)
+        for (int c = 0; c < nc; ++c)
+          for (int l = 0; l < L; ++l)
+            dt.pix[(p*nc + c)*L + l] = filteredMask.pix[p*L + l]
+                * dt.pix[(p*nc + c)*L + l] - filtered0.pix[(p*nc + c)*L + l];
+    }
+
+    double tensor[16][L], rhs[4][L], sse[L];
+    for (int l = 0; l < L; ++l) {
+      for (int j = 0; j < 16; ++j) tensor[j][l] = 0.0;
+      for (int j = 0; j < 4; ++j) rhs[j][l] = 0.0;
+      sse[l] = 0.0;
+    }
+    {
+      PROFILE_SCOPE("tensor");
+      const double* fImg[] = { dx.pix, dx.pix, dy.pix, dy.pix };
+      double fPos[] = { 1.0, 0.0, 1.0, 0.0 };
+      for (int y = 0; y < h; ++y) {
+        fPos[3] = y - (h - 1)/2.0 ;
+        for (int x = 0; x < w; ++x) {
+          fPos[1] = x - (w - 1)/2.0 ;
+          int base = (y*w + x)*nChans;
+          for (int c = 0; c < nc; ++c)
+            for (int l = 0; l < L; ++l)
+              sse[l] += dt.pix[base + c*L + l] * dt.pix[base + c*L + l];
+
+          for (int j = 0; j < 4; ++j) {
+            for (int k = 0; k < 4; ++k) {
+              for (int c = 0; c < nc; ++c)
+                for (int l = 0; l < L; ++l)
+                  tensor[j*4 + k][l] += fImg[j][base + c*L + l]
+                    * fImg[k][base + c*L + l]
+                    * fPos[j]
+                    * fPos[k];
+            }
             for (int c = 0; c < nc; ++c)
-              structureTensor[j*4 + k] += fImg[j][(y*w + x)*nc + c]
-                * fImg[k][(y*w + x)*nc + c]
-                * fPos[j]
-                * fPos[k];
+              for (int l = 0; l < L; ++l)
+                rhs[j][l] -=
+                  fImg[j][base + c*L + l]
+                  * dt.pix[base + c*L + l]
+                  * fPos[j];
           }
-          for (int c = 0; c < nc; ++c)
-            rhs[j] -=
-              fImg[j][(y*w + x)*nc + c]
-              * dt.pix[(y*w + x)*nc + c]
-              * fPos[j];
         }
       }
     }
 
-    // Solve linear equation
-    //printMatrix(structureTensor, 4, 4); printf("\n");
-    //printMatrix(rhs, 4, 1); printf("\n");
-    gaussJordan(structureTensor, rhs, 4);
-    //printMatrix(rhs, 4, 1); printf("\n");
+    PROFILE_SCOPE("solve");
+    for (int l = 0; l < L; ++l) {
+      if (!b.active[l]) continue;
+      double st[16], r[4];
+      for (int j = 0; j < 16; ++j) st[j] = tensor[j][l];
+      for (int j = 0; j < 4; ++j) r[j] = rhs[j][l];
+      bool solved = gaussJordan(st, r, 4);
+      FlowStats* stats = b.stats[l];
+      if (stats)
+        stats->residual = sse[l] / (w * h);
+      if (!solved) {
+        b.active[l] = false;
+        continue;
+      }
 
-    double norm = 0.0;
-    for (int j = 0; j < 4; ++j)
-      norm += rhs[j] * rhs[j];
-    if (sqrt(norm) < EPS) return;
+      double norm = 0.0;
+      for (int j = 0; j < 4; ++j)
+        norm += r[j] * r[j];
+      if (stats)
+        stats->updateNorm = sqrt(norm);
+      if (sqrt(norm) < opts.eps) {
+        if (stats) stats->converged = true;
+        b.active[l] = false;
+        continue;
+      }
 
-    float damp = 0.8;
-    for (int j = 0; j < 4; ++j)
-      a[j] += damp*rhs[j];
+      float damp = 0.8;
+      for (int j = 0; j < 4; ++j)
+        b.a[j][l] += damp*r[j];
+    }
   }
 }
 
-void downsample2(double* dst, const double* src, int w, int h, int nc = 1) {
+// Halves src into dst, which is src.w/2 x src.h/2.
+void downsample2(const ImageView& dst, const ImageView& src) {
+  int w = src.w, h = src.h, nc = src.c;
   for (int y = 0; y < h/2; ++y) {
+    double* d = dst.row(y);
+    const double* s0 = src.row(2*y);
+    const double* s1 = src.row(2*y + 1);
     for (int x = 0; x < w/2; ++x) {
+      int di = x*nc;
+      int si = 2*x*nc;
       for (int c = 0; c < nc; ++c) {
-        int di = (y*(w/2) + x)*nc;
-        int si = (2*y*w + 2*x)*nc;
-        for (int c = 0; c < nc; ++c) {
-          dst[di + c] = src[si + c];
-          if (x + 1 < w) dst[di + c] += src[si + nc + c];
-          if (y + 1 < h) dst[di + c] += src[si + w*nc + c];
-          if (x + 1 < w && y + 1 < h) dst[di + c] += src[si + (w + 1)*nc + c];
-          dst[di + c] /= 4.0;  // XXX: darkens edge too much
-        }
+        d[di + c] = s0[si + c];
+        if (x + 1 < w) d[di + c] += s0[si + nc + c];
+        if (y + 1 < h) d[di + c] += s1[si + c];
+        if (x + 1 < w && y + 1 < h) d[di + c] += s1[si + nc + c];
+        d[di + c] /= 4.0;  // XXX: darkens edge too much
       }
     }
   }
 }
 
-Img** gaussianPyramid(const double* src, int w, int h,
-    double sigma, int levels, int nc = 1) {
-  Img** pyr = new Img*[levels];
-  pyr[0] = new Img(w, h, nc);
-  memcpy(pyr[0]->pix, src, w * h * nc * sizeof(double));
+// Polyphase resampling between arbitrary sizes. When shrinking, every output
+// pixel is the average of the input pixels it covers, so halving gives the
+// same result as downsample2(). When enlarging, it interpolates linearly.
+// An output pixel's weights only depend on its phase, the fractional part of
+// its position in the input, which repeats every dst / gcd(src, dst) pixels.
+// They are computed once per pair of sizes, see resampleTaps().
+struct ResampleTaps {
+  int period;  // number of phases
+  int taps;    // weights per phase
+  int step;    // input pixels per period
+  std::vector<int> first;       // first input pixel of each phase
+  std::vector<double> weights;  // taps weights per phase
+};
 
-  double f[5 * 5]; gauss(f, 5, 5, sigma);
-  for (int i = 1; i < levels; ++i) {
-    double* tmp = allocImage(w, h, nc);
-    filter(tmp, pyr[i - 1]->pix, w, h, f, 5, nc);//XXX: use "0.0" outside image?
-    pyr[i] = new Img(w/2, h/2, nc);
-    downsample2(pyr[i]->pix, tmp, w, h, nc);
-    free(tmp);
-    w /= 2; h /= 2;
+int gcd(int a, int b) {
+  while (b != 0) {
+    int t = a % b;
+    a = b;
+    b = t;
   }
-  return pyr;
+  return a;
 }
 
-void freePyr(Img** pyr, int levels) {
-  for (int i = 0; i < levels; ++i)
-    delete pyr[i];
-  delete [] pyr;
+void computeResampleTaps(ResampleTaps& t, int src, int dst) {
+  int g = gcd(src, dst);
+  t.period = dst / g;
+  t.step = src / g;
+  double r = src / (double)dst;
+  t.taps = r >= 1.0 ? (int)ceil(r) + 1 : 2;
+  t.first.resize(t.period);
+  t.weights.assign(t.period * t.taps, 0.0);
+  for (int p = 0; p < t.period; ++p) {
+    double* w = &t.weights[p * t.taps];
+    if (r >= 1.0) {
+      // The output pixel covers [p*r, (p + 1)*r) of the input.
+      double x0 = p * r, x1 = (p + 1) * r;
+      t.first[p] = (int)floor(x0);
+      for (int k = 0; k < t.taps; ++k) {
+        double j = t.first[p] + k;
+        double overlap = std::min(x1, j + 1) - std::max(x0, j);
+        w[k] = std::max(overlap, 0.0) / r;
+      }
+    } else {
+      double x = (p + 0.5) * r - 0.5;
+      t.first[p] = (int)floor(x);
+      w[1] = x - t.first[p];
+      w[0] = 1.0 - w[1];
+    }
+  }
 }
 
-void pyramidFlow(const double* i0, const double* i1, int w, int h, double* a,
-    int levels, const double* mask, int index) {
-  Img** pyr0 = gaussianPyramid(i0, w, h, 0.8, levels, 3);
-  Img** pyr1 = gaussianPyramid(i1, w, h, 0.8, levels, 3);
-  Img** pyrMask = gaussianPyramid(mask, w, h, 0.8, levels, 1);
-
-  // transform the larger pyramid levels to grayscale for speed
-  // Still use color in the small pyramid levels. This makes a difference for
-  // the firefox icon for example.
-  for (int i = 0; i < levels; ++i) {
-    if (pyr0[i]->w >= 128)
-      pyr0[i]->toGray();
-    if (pyr1[i]->w >= 128)
-      pyr1[i]->toGray();
+// Returns the cached taps for resampling src pixels to dst pixels.
+const ResampleTaps& resampleTaps(int src, int dst) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static std::map<std::pair<int, int>, ResampleTaps> cache;
+  pthread_mutex_lock(&mutex);
+  std::pair<int, int> key(src, dst);
+  std::map<std::pair<int, int>, ResampleTaps>::iterator it = cache.find(key);
+  if (it == cache.end()) {
+    it = cache.insert(std::make_pair(key, ResampleTaps())).first;
+    computeResampleTaps(it->second, src, dst);
   }
+  pthread_mutex_unlock(&mutex);
+  return it->second;
+}
 
-  //a[0] = 0.0; a[1] = 1.0;
-  //a[2] = 0.0; a[3] = 1.0;
-
-  // Somewhat reasonable first guess for doc icons
-  // 11 successes with this
-  a[0] = 0.0; a[1] = 0.5;
-  a[2] = 0.0; a[3] = 0.5;
-
-for (int i = levels - 1; i >= 0; --i) {
+// First input pixel that output pixel i reads.
+inline int resampleStart(const ResampleTaps& t, int i) {
+  return (i / t.period) * t.step + t.first[i % t.period];
+}
 
-    SaveImage(*pyr0[i], "%d_pyr0_%d.png", index, i);
-    SaveImage(*pyr1[i], "%d_pyr1_%d.png", index, i);
-    SaveImage(*pyrMask[i], "%d_pyrmask_%d.png", index, i);
+// Resamples src to the size of dst, which has the same number of channels.
+// Pixels outside src repeat its border.
+void resample(const ImageView& dst, const ImageView& src) {
+  int dw = dst.w, dh = dst.h, sw = src.w, sh = src.h, nc = src.c;
+  if (sw == 2*dw && sh == 2*dh) {
+    downsample2(dst, src);
+    return;
+  }
+  PROFILE_SCOPE("resample");
+  const ResampleTaps& tx = resampleTaps(sw, dw);
+  const ResampleTaps& ty = resampleTaps(sh, dh);
+
+  // Horizontally into tmp, then vertically into dst.
+  double* tmp = allocImage(dw, sh, nc);
+  for (int y = 0; y < sh; ++y) {
+    const double* srcRow = src.row(y);
+    for (int x = 0; x < dw; ++x) {
+      const double* w = &tx.weights[(x % tx.period) * tx.taps];
+      int start = resampleStart(tx, x);
+      for (int c = 0; c < nc; ++c) {
+        double sum = 0.0;
+        for (int k = 0; k < tx.taps; ++k)
+          if (w[k] != 0.0)
+            sum += w[k] * srcRow[clamp(start + k, 0, sw - 1)*nc + c];
+        tmp[(y*dw + x)*nc + c] = sum;
+      }
+    }
+  }
+  for (int y = 0; y < dh; ++y) {
+    const double* w = &ty.weights[(y % ty.period) * ty.taps];
+    int start = resampleStart(ty, y);
+    double* dstRow = dst.row(y);
+    for (int i = 0; i < dw*nc; ++i)
+      dstRow[i] = 0.0;
+    for (int k = 0; k < ty.taps; ++k) {
+      if (w[k] == 0.0) continue;
+      const double* tmpRow = tmp + clamp(start + k, 0, sh - 1)*dw*nc;
+      for (int i = 0; i < dw*nc; ++i)
+        dstRow[i] += w[k] * tmpRow[i];
+    }
+  }
+  freeImage(tmp, dw, sh, nc);
+}
 
-    a[0] *= 2.0;
-    a[2] *= 2.0;
+// A Gaussian pyramid. Level 0 is base, level i is base's size divided by
+// step^i, rounded; step 2 is the classic pyramid, sqrt(2) one with twice as
+// many levels. sigma is the blur for step 2. Smaller steps are blurred less,
+// by as much as the detail lost between two levels needs. With recursive,
+// the blur of levels at least kSmoothMinWidth wide is a recursiveGauss()
+// instead of a 5x5 kernel. pyr[i] is level i.
+//
+// Levels are built when they're first asked for, each from the one before,
+// so levels that a warm start or a deadline skips cost nothing. Their sizes
+// are known up front (width(), height()). Several threads may ask for levels
+// at the same time.
+class Pyramid {
+ public:
+  // Copies base.
+  Pyramid(const ImageView& base, double sigma, int levels,
+      double step = 2.0, bool recursive = false) {
+    Img* copy = new Img;
+    copy->copyFrom(base);
+    init(copy, sigma, levels, step, recursive);
+  }
 
-    // damp 0.8, 30 iters: http client works
-    // damp 0.9, 50 iters: acorn works
-    // damp 0.8, 50 iters: http client works, http works (12 working, only Ff,
-    //                     chaching missing)
-    int iters = 50;
-    if (pyr0[i]->w <= 32) iters = 100;
+  // Takes ownership of base.
+  Pyramid(Img* base, double sigma, int levels, double step = 2.0,
+      bool recursive = false) {
+    init(base, sigma, levels, step, recursive);
+  }
 
-    printf("Pyr level %d\n", i);
-    basicFlow(pyr0[i]->pix, pyr1[i]->pix, pyr0[i]->w, pyr0[i]->h, a,
-        pyr0[i]->c, iters, pyrMask[i]->pix, index);
+  ~Pyramid() {
+    for (size_t i = 0; i < levels_.size(); ++i) {
+      delete levels_[i].color;
+      delete levels_[i].gray;
+    }
+    pthread_mutex_destroy(&mutex_);
   }
 
-  freePyr(pyr0, levels);
-  freePyr(pyr1, levels);
-  freePyr(pyrMask, levels);
-}
+  int size() const { return (int)levels_.size(); }
+  int width(int i) const { return levels_[i].w; }
+  int height(int i) const { return levels_[i].h; }
+
+  // Level i, built if it wasn't yet. The pointer stays valid as long as the
+  // pyramid.
+  Img* operator[](int i) const {
+    assert(i >= 0 && i < size());
+    pthread_mutex_lock(&mutex_);
+    Level& l = levels_[i];
+    Img* img;
+    if (l.w >= grayMinWidth_ && channels_ > 1) {
+      if (!l.gray) {
+        build(i);
+        l.gray = new Img(l.w, l.h);
+        gray64fromRgb64(l.gray->pix, l.color->pix, l.w, l.h);
+        dropColor(i);
+      }
+      img = l.gray;
+    } else {
+      build(i);
+      l.colorUsed = true;
+      img = l.color;
+    }
+    pthread_mutex_unlock(&mutex_);
+    return img;
+  }
 
+  // From now on, hands out levels that are at least minWidth wide in gray.
+  // Still use color in the small levels, this makes a difference for the
+  // firefox icon for example.
+  void setGrayMinWidth(int minWidth) {
+    pthread_mutex_lock(&mutex_);
+    grayMinWidth_ = std::min(grayMinWidth_, minWidth);
+    pthread_mutex_unlock(&mutex_);
+  }
 
-int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    printf("Expected two arguments\n");
-    return 1;
+  // Bytes of all levels once they're built.
+  size_t bytes() const {
+    size_t n = 0;
+    for (size_t i = 0; i < levels_.size(); ++i) {
+      const Level& l = levels_[i];
+      int c = l.w >= grayMinWidth_ ? 1 : channels_;
+      n += l.w * l.h * c * sizeof(double);
+    }
+    return n;
   }
 
-#if 0  // test all the stuff above
-  double m[5 * 5];
-  gauss(m, 5, 5, 0.8);
-  //printMatrix(m, 5, 5);
-
-  // test solver
-  double mat[] = {
-    0.5, 0.0, 0.0, 0.0,
-    0.0, 1.0, 0.0, 0.0,
-    0.0, 0.0, 1.0, 1.0,
-    0.0, 0.0, 1.0, 0.0,
-    };
-  double rhs[] = { 1.0, 2.0, 3.0, 4.0 };
-  gaussJordan(mat, rhs, 4);
-  printMatrix(rhs, 4, 1);
-
-  Img i0(argv[1]);
-  Img i1(i0.w, i0.h);
-
-  // fixed transform, use and test if basicFlow correctly recovers it.
-  double a[] = {
-    15.0, 0.5,
-    0.0, 0.5
+ private:
+  struct Level {
+    int w, h;
+    Img* color;      // NULL until built, and after a gray level replaced it
+    Img* gray;       // NULL until asked for
+    bool colorUsed;  // color was handed out and has to stay
   };
-  interp2Scale(i1.pix, i0.pix, i0.w, i0.h, a);
 
-  i0.save("in.png");
-  i1.save("out.png");
+  mutable std::vector<Level> levels_;
+  int channels_;
+  int grayMinWidth_;
+  double sigma_;  // of the blur between two levels
+  bool recursive_;
+  double filter_[5 * 5];
+  mutable pthread_mutex_t mutex_;
+
+  void init(Img* base, double sigma, int levels, double step,
+      bool recursive) {
+    pthread_mutex_init(&mutex_, NULL);
+    channels_ = base->c;
+    grayMinWidth_ = INT_MAX;
+    sigma_ = sigma * sqrt((step*step - 1) / 3);
+    recursive_ = recursive;
+    gauss(filter_, 5, 5, sigma_);
+    for (int i = 0; i < levels; ++i) {
+      double scale = pow(step, i);
+      Level l;
+      l.w = std::max((int)floor(base->w / scale + 0.5), 1);
+      l.h = std::max((int)floor(base->h / scale + 0.5), 1);
+      l.color = l.gray = NULL;
+      l.colorUsed = false;
+      levels_.push_back(l);
+    }
+    levels_[0].color = base;
+  }
 
-  // Starting guess
-  a[0] = 0.0; a[1] = 1.0;
-  a[2] = 0.0; a[3] = 1.0;
+  // Builds the color version of level i and the ones before it that are
+  // missing. The color of the level before has to be around still: it's
+  // only dropped once the level after it exists.
+  void build(int i) const {
+    if (levels_[i].color || levels_[i].gray) return;
+    build(i - 1);
+    PROFILE_SCOPE("pyramid");
+    const Img& src = *levels_[i - 1].color;
+    Level& l = levels_[i];
+    Img tmp(src.w, src.h, src.c);
+    if (recursive_ && std::min(src.w, src.h) >= kSmoothMinWidth)
+      recursiveGauss(tmp, src, sigma_);
+    else
+      filter(tmp, src, filter_, 5);//XXX: use "0.0" outside image?
+    l.color = new Img(l.w, l.h, src.c);
+    resample(*l.color, tmp);
+    dropColor(i - 1);
+  }
+
+  // Frees the color version of level i if it has a gray one that's used
+  // instead, nobody holds the color one, and the next level doesn't need it
+  // as its source anymore.
+  void dropColor(int i) const {
+    Level& l = levels_[i];
+    if (!l.gray || !l.color || l.colorUsed) return;
+    if (i + 1 < size() && !levels_[i + 1].color && !levels_[i + 1].gray)
+      return;
+    delete l.color;
+    l.color = NULL;
+  }
+
+  Pyramid(const Pyramid&);
+  Pyramid& operator=(const Pyramid&);
+};
+
+// Converts parameters found for a variant of width fromW to a variant of
+// width toW. Scales are relative to the image size, so only the translations
+// change.
+void rescaleParams(double* a, int fromW, int toW) {
+  a[0] *= toW / (double)fromW;
+  a[2] *= toW / (double)fromW;
+}
+
+// Number of pyramid levels that need to be refined when warm starting a
+// variant of width w from the result of a variant of width refW. Going down
+// in size, the estimate is already better than the finest level can resolve.
+// Going up, the finer levels have to fix the error the magnification adds.
+int warmLevelsFor(int w, int refW, double step = 2.0) {
+  int n = 1;
+  for (double s = refW; s < w - 0.5; s *= step)
+    ++n;
+  return n;
+}
+
+// How much larger level i of pyr is than level i + 1, horizontally (dim 0) or
+// vertically (dim 1). Translations found on level i + 1 are multiplied with
+// this for level i. The coarsest level is taken to be half of a level that
+// doesn't exist.
+double levelRatio(const Pyramid& pyr, int levels, int i, int dim) {
+  if (i + 1 >= levels) return 2.0;
+  return dim == 0 ? pyr.width(i) / (double)pyr.width(i + 1)
+                  : pyr.height(i) / (double)pyr.height(i + 1);
+}
+
+// Sets up pyramidFlow(): makes pyr0 and pyr1 hand out the levels that are
+// solved in gray in gray and prepares a for the coarsest level that is
+// solved, whose index it returns.
+int pyramidFlowStart(Pyramid& pyr0, Pyramid& pyr1, int levels, double* a,
+    const FlowOptions& opts) {
+  // transform the larger pyramid levels to grayscale for speed
+  pyr0.setGrayMinWidth(opts.grayMinWidth);
+  pyr1.setGrayMinWidth(opts.grayMinWidth);
+
+  int first = levels - 1;
+  if (opts.warmLevels > 0) {
+    first = std::min(opts.warmLevels, levels) - 1;
+
+    // the loop below scales the translations up once per level
+    for (int i = 0; i <= first; ++i) {
+      a[0] /= levelRatio(pyr0, levels, i, 0);
+      a[2] /= levelRatio(pyr0, levels, i, 1);
+    }
+  } else {
+    //a[0] = 0.0; a[1] = 1.0;
+    //a[2] = 0.0; a[3] = 1.0;
+
+    // Somewhat reasonable first guess for doc icons
+    // 11 successes with this
+    a[0] = 0.0; a[1] = 0.5;
+    a[2] = 0.0; a[3] = 0.5;
+  }
+  return first;
+}
+
+// Iterations pyramidFlow() spends on level i.
+int levelIters(const Pyramid& pyr0, int i, const FlowOptions& opts) {
+  if (opts.warmLevels > 0) return opts.warmIters;
+  if (pyr0.width(i) <= opts.coarseMaxWidth) return opts.coarseIters;
+  return opts.fineIters;
+}
+
+// The time one iteration of pyramidFlow() takes, fitted to the levels solved
+// so far as a fixed cost plus a cost per pixel (least squares, weighted by
+// iterations). On the small levels that get timed first, the fixed costs
+// (solving, bookkeeping) outweigh the pixels; charging them per pixel made
+// the fine levels look several times as expensive as they are.
+class IterationCost {
+ public:
+  IterationCost() : n(0), sp(0), st(0), spp(0), spt(0) {}
+
+  void add(double pixels, int iters, double seconds) {
+    if (iters <= 0) return;
+    double t = seconds / iters;
+    n += iters;
+    sp += iters * pixels;
+    st += iters * t;
+    spp += iters * pixels * pixels;
+    spt += iters * pixels * t;
+  }
+
+  bool empty() const { return n == 0; }
+
+  // Seconds of one iteration on a level with pixels pixels.
+  double seconds(double pixels) const {
+    double d = n * spp - sp * sp;
+    double perPixel = st / sp, fixed = 0;
+    if (d > 1e-9 * n * spp) {  // levels of more than one size
+      perPixel = std::max((n * spt - sp * st) / d, 0.0);
+      fixed = std::max((st - perPixel * sp) / n, 0.0);
+    }
+    return fixed + perPixel * pixels;
+  }
+
+ private:
+  double n, sp, st, spp, spt;  // sums of iterations, pixels and seconds
+};
+
+// With opts.deadline, the iterations pyramidFlow() can spend on level i, 0 if
+// not even one fits anymore. The time that's left is shared between level i
+// and the finer ones by what they cost with all their iterations, estimated
+// by cost. Coarse levels are cheap and fix the large errors, so they get all
+// of theirs unless time is very short, and since the shares are worked out
+// again for each level, time that a level didn't need because it converged
+// early goes to the finer ones. The finest level gets all of its iterations
+// and is stopped by the deadline itself, so that no time is left unused.
+int levelBudget(const Pyramid& pyr0, int i, const FlowOptions& opts,
+    const IterationCost& cost) {
+  int iters = levelIters(pyr0, i, opts);
+  double left = opts.deadline - now();
+  if (left <= 0) return 0;
+  if (cost.empty()) return iters;  // nothing to time yet
+
+  double pixels = (double)pyr0.width(i) * pyr0.height(i);
+  if (left < cost.seconds(pixels)) return 0;
+  if (i == 0) return iters;
+  double need = 0;
+  for (int j = i; j >= 0; --j)
+    need += levelIters(pyr0, j, opts)
+        * cost.seconds((double)pyr0.width(j) * pyr0.height(j));
+  double share = left / need;
+  if (share >= 1) return iters;
+  return std::max((int)(share * iters), 1);
+}
+
+// Moves a from the coordinates of level i to those of level 0, for solves
+// that stop before they get there.
+void scaleToFinest(const Pyramid& pyr0, int levels, int i, double* a) {
+  for (int j = i - 1; j >= 0; --j) {
+    a[0] *= levelRatio(pyr0, levels, j, 0);
+    a[2] *= levelRatio(pyr0, levels, j, 1);
+  }
+}
+
+// Solves level i of pyramidFlow(), starting from the result of level i + 1,
+// with iters iterations (0: levelIters()).
+void pyramidFlowLevel(const Pyramid& pyr0, const Pyramid& pyr1,
+    const Pyramid& pyrMask, int levels, int i, double* a, int index,
+    const FlowOptions& opts, FlowStats* stats, int iters = 0) {
+  PROFILE_SET_LEVEL(i);
+  PROFILE_SCOPE("level");
+
+  if (opts.debugOutput) {
+    SaveImage(*pyr0[i], "%d_pyr0_%d.png", index, i);
+    SaveImage(*pyr1[i], "%d_pyr1_%d.png", index, i);
+    SaveImage(*pyrMask[i], "%d_pyrmask_%d.png", index, i);
+  }
+
+  a[0] *= levelRatio(pyr0, levels, i, 0);
+  a[2] *= levelRatio(pyr0, levels, i, 1);
+
+  if (opts.debugOutput)
+    printf("Pyr level %d\n", i);
+  // opts.smoothSigma is in pixels of level 0. Coarser levels are blurred by
+  // the pyramid already and only need as much as the 3x3 kernels do.
+  FlowOptions levelOpts = opts;
+  if (opts.smoothSigma > 0)
+    levelOpts.smoothSigma = std::max(
+        opts.smoothSigma * pyr0.width(i) / pyr0.width(0),
+        std::min(opts.smoothSigma, 1.0));
+  const Img& i0 = *pyr0[i];
+  basicFlow(i0.pix, pyr1[i]->pix, i0.w, i0.h, a, i0.c,
+      iters > 0 ? iters : levelIters(pyr0, i, opts), pyrMask[i]->pix, index,
+      levelOpts, stats);
+  if (stats) ++stats->levels;
+}
+
+// Computes the flow between the two color pyramids pyr0 and pyr1, see
+// basicFlow(). Converts the levels of pyr0 and pyr1 that are solved in gray.
+// If opts.deadline stops the solve early, a is the best estimate of the last
+// level that was solved (scaled to level 0), and stats->residual is its
+// residual.
+void pyramidFlow(Pyramid& pyr0, Pyramid& pyr1, const Pyramid& pyrMask,
+    int levels, double* a, int index, const FlowOptions& opts = FlowOptions(),
+    FlowStats* stats = NULL) {
+  FlowStats deadlineStats;
+  if (!stats && opts.deadline > 0) stats = &deadlineStats;
+  if (stats) *stats = FlowStats();
+  int first = pyramidFlowStart(pyr0, pyr1, levels, a, opts);
+  if (opts.deadline <= 0) {
+    for (int i = first; i >= 0; --i)
+      pyramidFlowLevel(pyr0, pyr1, pyrMask, levels, i, a, index, opts, stats);
+    PROFILE_SET_LEVEL(-1);
+    return;
+  }
+
+  IterationCost cost;
+  bool cut = false;
+  for (int i = first; i >= 0; --i) {
+    int iters = levelBudget(pyr0, i, opts, cost);
+    if (iters == 0) {
+      stats->timedOut = true;
+      scaleToFinest(pyr0, levels, i + 1, a);
+      break;
+    }
+    int before = stats->iterations;
+    double start = now();
+    pyramidFlowLevel(pyr0, pyr1, pyrMask, levels, i, a, index, opts, stats,
+        iters);
+    int done = stats->iterations - before;
+    cost.add((double)pyr0.width(i) * pyr0.height(i), done, now() - start);
+    if (stats->timedOut) {
+      scaleToFinest(pyr0, levels, i, a);
+      break;
+    }
+    // A level that needed all of its shortened iterations didn't get to
+    // finish either.
+    if (done == iters && iters < levelIters(pyr0, i, opts)
+        && !stats->converged)
+      cut = true;
+  }
+  if (cut) stats->timedOut = true;
+  PROFILE_SET_LEVEL(-1);
+}
+
+void pyramidFlow(const ImageView& i0, const ImageView& i1,
+    const ImageView& mask, double* a, int levels, int index,
+    const FlowOptions& opts = FlowOptions(), FlowStats* stats = NULL) {
+  double step = opts.pyramidStep;
+  bool recursive = opts.smoothSigma > 0;
+  Pyramid pyr0(i0, 0.8, levels, step, recursive);
+  Pyramid pyr1(i1, 0.8, levels, step, recursive);
+  Pyramid pyrMask(mask, 0.8, levels, step, recursive);
+  pyramidFlow(pyr0, pyr1, pyrMask, levels, a, index, opts, stats);
+}
+
+
+// Number of pyramid levels main() uses for an icon of width w.
+int levelsFor(int w) {
+  int levels = 0;
+  while ((1 << levels) < w) ++levels;
+  //levels -= 4; // smallest size is 32x32 (for Preview.app) (3 successes, few close)
+  levels -= 3; // smallest size is 16x16 (for Terminal.app) (5 successes)
+  if (levels < 1) levels = 1;  // don't ignore 16x16 version
+  return levels;
+}
+
+// Number of levels with the given step that go down to the same size as
+// levelsFor(w) levels with step 2.
+int levelsFor(int w, double step) {
+  int levels = levelsFor(w);
+  if (step == 2.0) return levels;
+  return 1 + (int)floor((levels - 1) * log(2.0) / log(step) + 0.5);
+}
+
+// Synthetic test images, so that the solver can be measured without real
+// icns files.
+
+// Random numbers that are the same on every platform.
+struct Lcg {
+  unsigned int state;
+
+  Lcg(unsigned int seed) : state(seed) {}
+
+  // Returns a number in [0, 1).
+  double next() {
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) / 16777216.0;
+  }
+};
+
+// Draws an app icon of size x size with nc channels: a rounded square with a
+// soft border, filled with a few sine gratings and blobs so that there are
+// edges at every pyramid level. Like imageFromSource(), color is not
+// premultiplied and 0 where the mask is 0.
+void makeSyntheticIcon(Img& icon, Img& mask, int size, int nc,
+    unsigned int seed) {
+  Lcg rnd(seed);
+  icon.setSize(size, size, nc);
+  mask.setSize(size, size);
+
+  double half = 0.35 + 0.1 * rnd.next();  // half width, relative to size
+  double corner = 0.1 + 0.15 * rnd.next();
+
+  double base[3], freq[3][2], phase[3], blob[4][3];
+  for (int c = 0; c < 3; ++c) base[c] = 0.2 + 0.6 * rnd.next();
+  for (int g = 0; g < 3; ++g) {
+    double angle = 2 * M_PI * rnd.next();
+    double cycles = 2 + 10 * rnd.next();  // per icon, independent of size
+    freq[g][0] = 2 * M_PI * cycles * cos(angle);
+    freq[g][1] = 2 * M_PI * cycles * sin(angle);
+    phase[g] = 2 * M_PI * rnd.next();
+  }
+  for (int b = 0; b < 4; ++b) {
+    blob[b][0] = 0.5 + half * (2 * rnd.next() - 1);
+    blob[b][1] = 0.5 + half * (2 * rnd.next() - 1);
+    blob[b][2] = 0.05 + 0.1 * rnd.next();
+  }
+
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      double u = (x + 0.5) / size, v = (y + 0.5) / size;
+
+      // distance to the rounded square's border in pixels, > 0 inside
+      double qx = fabs(u - 0.5) - (half - corner);
+      double qy = fabs(v - 0.5) - (half - corner);
+      double outside = sqrt(std::max(qx, 0.0)*std::max(qx, 0.0)
+                          + std::max(qy, 0.0)*std::max(qy, 0.0))
+                     + std::min(std::max(qx, qy), 0.0);
+      double d = (corner - outside) * size;
+      double m = clamp(d + 0.5, 0.0, 1.0);
+      mask.pix[y*size + x] = m;
+
+      double t = 0.0;
+      for (int g = 0; g < 3; ++g)
+        t += 0.15 * sin(freq[g][0]*u + freq[g][1]*v + phase[g]);
+      for (int b = 0; b < 4; ++b) {
+        double du = u - blob[b][0], dv = v - blob[b][1];
+        t -= 0.3 * exp(-(du*du + dv*dv) / (2*blob[b][2]*blob[b][2]));
+      }
+
+      for (int c = 0; c < nc; ++c) {
+        double val = nc == 1 ? 0.5 + t : base[c] + t * (c + 1) / 2.0;
+        icon.pix[(y*size + x)*nc + c] = m == 0.0 ? 0.0 : clamp(val, 0.0, 1.0);
+      }
+    }
+  }
+}
+
+// Draws a document background (a page with a gradient and "text" lines) and
+// composites icon into it, placed with the transform a (see interp2Scale()).
+void makeSyntheticDoc(Img& doc, const Img& icon, const Img& mask,
+    double a[4]) {
+  int w = icon.w, h = icon.h, nc = icon.c;
+  doc.setSize(w, h, nc);
+  Img warped(w, h, nc), warpedMask(w, h);
+  interp2Scale(warped.pix, icon.pix, w, h, a, nc);
+  interp2Scale(warpedMask.pix, mask.pix, w, h, a);
+
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      double v = (y + 0.5) / h;
+      double bg = 0.95 - 0.15 * v;
+      if ((int)(v * 24) % 2 == 0 && x > w/8 && x < 7*w/8)
+        bg -= 0.2;
+      double m = warpedMask.pix[y*w + x];
+      for (int c = 0; c < nc; ++c)
+        doc.pix[(y*w + x)*nc + c] = m*warped.pix[(y*w + x)*nc + c] + (1 - m)*bg;
+    }
+  }
+}
+
+
+// Micro-benchmarks for all kernels above, see runBenchmarks().
+
+enum BenchKernel {
+  kBenchFilter,
+  kBenchSeparableFilter33,
+  kBenchRecursiveGauss,
+  kBenchCalcDx,
+  kBenchCalcDy,
+  kBenchCalcDt,
+  kBenchInterp2Scale,
+  kBenchDownsample2,
+  kBenchGaussianPyramid,
+  kBenchGaussJordan,
+  kBenchBasicFlowIteration,
+  kBenchBasicFlowLanesIteration,
+  kBenchBasicFlowStripsIteration,
+  kBenchPyramidFlow,
+  kNumBenchKernels
+};
+
+const char* kBenchKernelNames[] = {
+  "filter5x5",
+  "separableFilter33",
+  "recursiveGauss",
+  "calcDx",
+  "calcDy",
+  "calcDt",
+  "interp2Scale",
+  "downsample2",
+  "gaussianPyramid",
+  "gaussJordan",
+  "basicFlowIteration",
+  "basicFlowLanesIteration",
+  "basicFlowStripsIteration",
+  "pyramidFlow",
+};
+
+// Inputs for one image size and channel count.
+struct BenchData {
+  int w, h, nc;
+  Img icon, mask, doc, dst;
+  double f[5 * 5];
+  double fx[3], fy[3];
+  double a[4];
+  FlowLanes lanes;  // kFlowLanes copies of icon, mask and doc
+};
+
+// Bytes a kernel has to read and write at least once per pixel. 0 if that
+// depends on the data (number of iterations).
+double benchBytesPerPixel(int k, int nc) {
+  const double d = sizeof(double);
+  switch (k) {
+    case kBenchFilter:
+    case kBenchSeparableFilter33:
+    case kBenchRecursiveGauss:
+    case kBenchCalcDx:
+    case kBenchCalcDy:
+    case kBenchInterp2Scale:
+      return 2 * nc * d;
+    case kBenchCalcDt:
+      return (3 * nc + 1) * d;
+    case kBenchDownsample2:
+      return 1.25 * nc * d;
+    case kBenchGaussianPyramid:
+      return 2 * nc * d * 4 / 3.0;
+    case kBenchBasicFlowIteration:
+    case kBenchBasicFlowLanesIteration:
+      // warp, dx, dy, dt (see above), then reading dx, dy and dt for the
+      // structure tensor
+      return (2 + 2 + 2 + 3 + 3) * nc * d + d;
+    case kBenchBasicFlowStripsIteration:
+      // only the inputs, the rows in between stay in cache
+      return 2 * nc * d + d;
+    default:
+      return 0;
+  }
+}
+
+void runBenchKernel(int k, BenchData& b) {
+  switch (k) {
+    case kBenchFilter:
+      filter(b.dst, b.doc, b.f, 5);
+      break;
+    case kBenchSeparableFilter33:
+      separableFilter33(b.dst, b.doc, b.fx, b.fy);
+      break;
+    case kBenchRecursiveGauss:
+      recursiveGauss(b.dst, b.doc, 3.0);
+      break;
+    case kBenchCalcDx:
+      calcDx(b.dst, b.doc);
+      break;
+    case kBenchCalcDy:
+      calcDy(b.dst, b.doc);
+      break;
+    case kBenchCalcDt:
+      calcDt(b.dst, b.icon, b.doc, b.mask);
+      break;
+    case kBenchInterp2Scale:
+      interp2Scale(b.dst.pix, b.doc.pix, b.w, b.h, b.a, b.nc);
+      break;
+    case kBenchDownsample2:
+      downsample2(ImageView(b.dst.pix, b.w/2, b.h/2, b.nc), b.doc);
+      break;
+    case kBenchGaussianPyramid: {
+      Pyramid pyr(b.doc, 0.8, levelsFor(b.w));
+      break;
+    }
+    case kBenchGaussJordan: {
+      double m[16] = {
+        4, 1, 0, 1,
+        1, 5, 1, 0,
+        0, 1, 6, 1,
+        1, 0, 1, 7,
+      };
+      double rhs[4] = { 1, 2, 3, 4 };
+      gaussJordan(m, rhs, 4);
+      break;
+    }
+    case kBenchBasicFlowIteration: {
+      FlowOptions opts;
+      opts.debugOutput = false;
+      double a[4] = { 0.0, 0.5, 0.0, 0.5 };
+      basicFlow(b.icon.pix, b.doc.pix, b.w, b.h, a, b.nc, 1, b.mask.pix, 0,
+          opts);
+      break;
+    }
+    case kBenchBasicFlowStripsIteration: {
+      FlowOptions opts;
+      opts.debugOutput = false;
+      opts.stripMinWidth = 0;
+      double a[4] = { 0.0, 0.5, 0.0, 0.5 };
+      basicFlow(b.icon.pix, b.doc.pix, b.w, b.h, a, b.nc, 1, b.mask.pix, 0,
+          opts);
+      break;
+    }
+    case kBenchBasicFlowLanesIteration: {
+      FlowOptions opts;
+      opts.debugOutput = false;
+      for (int l = 0; l < kFlowLanes; ++l) {
+        b.lanes.a[0][l] = b.lanes.a[2][l] = 0.0;
+        b.lanes.a[1][l] = b.lanes.a[3][l] = 0.5;
+        b.lanes.stats[l] = NULL;
+        b.lanes.active[l] = true;
+      }
+      basicFlowLanes(b.lanes, 1, opts);
+      break;
+    }
+    case kBenchPyramidFlow: {
+      FlowOptions opts;
+      opts.debugOutput = false;
+      double a[4];
+      pyramidFlow(b.icon, b.doc, b.mask, a, levelsFor(b.w), 0, opts);
+      break;
+    }
+  }
+}
+
+// Returns the time of one call of kernel k in seconds. Batches are sized to
+// take at least 20ms, and the fastest batch wins, as it's the one least
+// disturbed by the rest of the machine.
+double timeBenchKernel(int k, BenchData& b) {
+  int reps = 1;
+  double elapsed;
+  for (;;) {
+    double start = now();
+    for (int r = 0; r < reps; ++r)
+      runBenchKernel(k, b);
+    elapsed = now() - start;
+    if (elapsed > 0.02 || reps >= (1 << 20)) break;
+    reps *= 2;
+  }
+
+  double best = elapsed / reps;
+  int batches = elapsed > 1.0 ? 0 : 4;
+  for (int i = 0; i < batches; ++i) {
+    double start = now();
+    for (int r = 0; r < reps; ++r)
+      runBenchKernel(k, b);
+    best = std::min(best, (now() - start) / reps);
+  }
+  return best;
+}
+
+// Times every kernel on synthetic icons of all sizes and writes one line per
+// kernel, size and channel count to out, tab-separated:
+//   kernel size channels ns_per_pixel gb_per_s
+// gb_per_s is computed from benchBytesPerPixel() and is 0 where that's
+// unknown. gaussJordan doesn't depend on the image; its ns_per_pixel is the
+// time of one 4x4 solve. basicFlowLanesIteration only runs on the sizes
+// pyramidFlowBatch() uses it for, and counts the pixels of all its lanes.
+void runBenchmarks(FILE* out) {
+  const int sizes[] = { 16, 32, 128, 256, 512, 1024 };
+  const int channels[] = { 1, 3 };
+
+  fprintf(out, "# kernel\tsize\tchannels\tns_per_pixel\tgb_per_s\n");
+  for (size_t si = 0; si < sizeof(sizes)/sizeof(sizes[0]); ++si) {
+    for (size_t ci = 0; ci < sizeof(channels)/sizeof(channels[0]); ++ci) {
+      BenchData b;
+      b.w = b.h = sizes[si];
+      b.nc = channels[ci];
+      makeSyntheticIcon(b.icon, b.mask, b.w, b.nc, 1);
+      b.a[0] = 0.05 * b.w; b.a[1] = 0.5;
+      b.a[2] = -0.03 * b.w; b.a[3] = 0.5;
+      makeSyntheticDoc(b.doc, b.icon, b.mask, b.a);
+      b.dst.setSize(b.w, b.h, b.nc);
+      gauss(b.f, 5, 5, 0.8);
+      gauss(b.fx, 3, 1, 0.8);
+      gauss(b.fy, 1, 3, 0.8);
+
+      bool lanes = b.w <= FlowOptions().coarseMaxWidth;
+      if (lanes) {
+        const int L = kFlowLanes;
+        b.lanes.w = b.w;
+        b.lanes.h = b.h;
+        b.lanes.nc = b.nc;
+        b.lanes.i0.setSize(b.w, b.h, b.nc * L);
+        b.lanes.i1.setSize(b.w, b.h, b.nc * L);
+        b.lanes.mask.setSize(b.w, b.h, L);
+        for (int i = 0; i < b.w * b.h; ++i) {
+          for (int l = 0; l < L; ++l) {
+            for (int c = 0; c < b.nc; ++c) {
+              b.lanes.i0.pix[(i*b.nc + c)*L + l] = b.icon.pix[i*b.nc + c];
+              b.lanes.i1.pix[(i*b.nc + c)*L + l] = b.doc.pix[i*b.nc + c];
+            }
+            b.lanes.mask.pix[i*L + l] = b.mask.pix[i];
+          }
+        }
+      }
+
+      for (int k = 0; k < kNumBenchKernels; ++k) {
+        // pyramidFlow always works on 3 channels, gaussJordan on none.
+        if (k == kBenchPyramidFlow && b.nc != 3) continue;
+        if (k == kBenchGaussJordan && (si != 0 || ci != 0)) continue;
+        if (k == kBenchBasicFlowLanesIteration && !lanes) continue;
+
+        fprintf(stderr, "%s %dx%d/%d\n", kBenchKernelNames[k], b.w, b.h, b.nc);
+        double t = timeBenchKernel(k, b);
+        int pixels = k == kBenchGaussJordan ? 1 : b.w * b.h;
+        if (k == kBenchBasicFlowLanesIteration) pixels *= kFlowLanes;
+        double bytes = benchBytesPerPixel(k, b.nc) * pixels;
+        fprintf(out, "%s\t%d\t%d\t%.3f\t%.3f\n", kBenchKernelNames[k],
+            k == kBenchGaussJordan ? 4 : b.w, b.nc, 1e9 * t / pixels,
+            bytes / t / 1e9);
+        fflush(out);
+      }
+    }
+  }
+}
+
+
+// Ground truth harness: solves synthetic doc icons with known transforms
+// using different solver settings, see runSynthetic().
+
+struct SynthConfig {
+  int levelDelta;  // added to levelsFor()
+  FlowOptions opts;
+};
+
+struct SynthResult {
+  double medianErr, meanErr, maxErr;
+  double successRate;
+  double msPerSolve;
+  bool pareto;
+};
+
+// All combinations of the settings that trade accuracy for speed, and
+// --smooth's blurs.
+void synthConfigs(std::vector<SynthConfig>& configs) {
+  const int levelDeltas[] = { 0, -1 };
+  const int iters[][2] = { { 50, 100 }, { 25, 50 }, { 10, 20 } };
+  const double epss[] = { 1e-4, 1e-3 };
+  const int grays[] = { 128, 0, INT_MAX };
+  const double steps[] = { 2.0, sqrt(2.0) };
+  for (int s = 0; s < 2; ++s)
+    for (int l = 0; l < 2; ++l)
+      for (int i = 0; i < 3; ++i)
+        for (int e = 0; e < 2; ++e)
+          for (int g = 0; g < 3; ++g) {
+            SynthConfig c;
+            c.levelDelta = levelDeltas[l];
+            c.opts.fineIters = iters[i][0];
+            c.opts.coarseIters = iters[i][1];
+            c.opts.eps = epss[e];
+            c.opts.grayMinWidth = grays[g];
+            c.opts.pyramidStep = steps[s];
+            c.opts.debugOutput = false;
+            configs.push_back(c);
+          }
+
+  // --smooth, with the default settings otherwise, and with --roi and
+  // --select, whose spans the blur reaches past.
+  const double sigmas[] = { 0.6, 1.0, 2.0, 4.0 };
+  for (int g = 0; g < 4; ++g) {
+    SynthConfig c;
+    c.levelDelta = 0;
+    c.opts.smoothSigma = sigmas[g];
+    c.opts.debugOutput = false;
+    configs.push_back(c);
+  }
+  for (int r = 0; r < 2; ++r) {
+    SynthConfig c;
+    c.levelDelta = 0;
+    c.opts.smoothSigma = 4.0;
+    c.opts.roi = r == 0;
+    c.opts.selectPixels = r == 1 ? 2000 : 0;
+    c.opts.debugOutput = false;
+    configs.push_back(c);
+  }
+}
+
+// How far off the solver is, in pixels: the larger of the translation error
+// and how far the scale error moves the icon's border.
+double paramError(const double* a, const double* truth, int w) {
+  double dTrans = std::max(fabs(a[0] - truth[0]), fabs(a[2] - truth[2]));
+  double dScale = std::max(fabs(a[1] - truth[1]), fabs(a[3] - truth[3]))
+      * w / 2;
+  return std::max(dTrans, dScale);
+}
+
+// Runs every configuration from synthConfigs() on |trials| synthetic icons
+// per size, each placed with a random doc-icon-like transform, and writes
+// one tab-separated line per configuration to out. A configuration is marked
+// pareto if no other one is both faster and has a lower median error.
+// Solves within a pixel of the truth count as successes.
+void runSynthetic(FILE* out, int trials) {
+  const int sizes[] = { 32, 48, 128, 256 };
+  const int numSizes = sizeof(sizes)/sizeof(sizes[0]);
+
+  std::vector<SynthConfig> configs;
+  synthConfigs(configs);
+  std::vector<SynthResult> results(configs.size());
+
+  for (size_t ci = 0; ci < configs.size(); ++ci) {
+    const SynthConfig& c = configs[ci];
+    std::vector<double> errs;
+    double time = 0.0;
+    for (int si = 0; si < numSizes; ++si) {
+      for (int t = 0; t < trials; ++t) {
+        int w = sizes[si];
+        Lcg rnd(1000 * si + t + 1);
+        double truth[4];
+        truth[1] = 0.4 + 0.25 * rnd.next();
+        truth[3] = truth[1] * (0.95 + 0.1 * rnd.next());
+        truth[0] = w * 0.08 * (2 * rnd.next() - 1);
+        truth[2] = w * 0.08 * (2 * rnd.next() - 1);
+
+        Img icon, mask, doc;
+        makeSyntheticIcon(icon, mask, w, 3, 1000 * si + t + 1);
+        makeSyntheticDoc(doc, icon, mask, truth);
+
+        double a[4];
+        int levels = std::max(
+            levelsFor(w, c.opts.pyramidStep) + c.levelDelta, 1);
+        PROFILE_SET_VARIANT(w);
+        double start = now();
+        pyramidFlow(icon, doc, mask, a, levels, t, c.opts);
+        time += now() - start;
+        errs.push_back(paramError(a, truth, w));
+      }
+    }
+
+    SynthResult& r = results[ci];
+    std::sort(errs.begin(), errs.end());
+    r.medianErr = errs[errs.size() / 2];
+    r.maxErr = errs.back();
+    r.meanErr = 0.0;
+    int successes = 0;
+    for (size_t i = 0; i < errs.size(); ++i) {
+      r.meanErr += errs[i] / errs.size();
+      if (errs[i] < 1.0) ++successes;
+    }
+    r.successRate = successes / (double)errs.size();
+    r.msPerSolve = 1000 * time / errs.size();
+    fprintf(stderr, "config %d/%d: %.3f px, %.1f ms\n", (int)ci + 1,
+        (int)configs.size(), r.medianErr, r.msPerSolve);
+  }
+
+  fprintf(out, "# step\tlevelDelta\tfineIters\tcoarseIters\teps\t"
+      "grayMinWidth\tsmoothSigma\troi\tselect\tmedianErr\tmeanErr\tmaxErr\t"
+      "successRate\tmsPerSolve\tpareto\n");
+  for (size_t ci = 0; ci < configs.size(); ++ci) {
+    SynthResult& r = results[ci];
+    r.pareto = true;
+    for (size_t cj = 0; cj < configs.size(); ++cj) {
+      const SynthResult& o = results[cj];
+      if (o.medianErr <= r.medianErr && o.msPerSolve <= r.msPerSolve
+          && (o.medianErr < r.medianErr || o.msPerSolve < r.msPerSolve))
+        r.pareto = false;
+    }
+
+    const FlowOptions& o = configs[ci].opts;
+    fprintf(out, "%.3f\t%d\t%d\t%d\t%g\t%d\t%g\t%d\t%d\t%.4f\t%.4f\t%.4f\t"
+        "%.3f\t%.2f\t%d\n", o.pyramidStep, configs[ci].levelDelta,
+        o.fineIters, o.coarseIters, o.eps,
+        o.grayMinWidth == INT_MAX ? -1 : o.grayMinWidth, o.smoothSigma,
+        o.roi, o.selectPixels, r.medianErr, r.meanErr, r.maxErr,
+        r.successRate, r.msPerSolve, r.pareto);
+  }
+}
+
+// Worker threads for solving independent problems in parallel. Each worker
+// has its own Workspace.
+class ThreadPool {
+ public:
+  ThreadPool(int numThreads) : fn(NULL), arg(NULL), n(0), next(0),
+      finished(0), quit(false) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&wake, NULL);
+    pthread_cond_init(&done, NULL);
+    for (int i = 0; i < numThreads; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, workerMain, this) == 0)
+        threads.push_back(thread);
+    }
+  }
+
+  ~ThreadPool() {
+    pthread_mutex_lock(&mutex);
+    quit = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&mutex);
+    for (size_t i = 0; i < threads.size(); ++i)
+      pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  int size() const { return threads.size(); }
+
+  // Calls fn(arg, i) for every i in [0, n) on the workers (or on the calling
+  // thread if there are none) and returns when all calls are done.
+  void parallelFor(int count, void (*f)(void*, int), void* a) {
+    if (threads.empty()) {
+      for (int i = 0; i < count; ++i)
+        f(a, i);
+      return;
+    }
+    pthread_mutex_lock(&mutex);
+    fn = f;
+    arg = a;
+    n = count;
+    next = finished = 0;
+    pthread_cond_broadcast(&wake);
+    while (finished < n)
+      pthread_cond_wait(&done, &mutex);
+    n = next = 0;
+    pthread_mutex_unlock(&mutex);
+  }
+
+ private:
+  static void* workerMain(void* self) {
+    ((ThreadPool*)self)->work();
+    return NULL;
+  }
+
+  void work() {
+    Workspace workspace;
+    tlsWorkspace = &workspace;
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+      while (!quit && next >= n)
+        pthread_cond_wait(&wake, &mutex);
+      if (quit) break;
+      int i = next++;
+      pthread_mutex_unlock(&mutex);
+      fn(arg, i);
+      pthread_mutex_lock(&mutex);
+      if (++finished == n)
+        pthread_cond_broadcast(&done);
+    }
+    pthread_mutex_unlock(&mutex);
+    tlsWorkspace = NULL;
+  }
+
+  std::vector<pthread_t> threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake, done;
+  void (*fn)(void*, int);
+  void* arg;
+  int n, next, finished;
+  bool quit;
+
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+};
+
+// Prepares numbered jobs (e.g. decodes icons) on reader threads ahead of the
+// thread that consumes them, so that reading and decoding the next jobs hides
+// behind the work on the current one. Jobs are prepared into a fixed set of
+// slots, which bounds memory: readers wait while all slots are taken, and
+// the consumer gives a job's slot back with release() once it's done with
+// it. Readers claim jobs in order, so the job the consumer waits for always
+// gets a slot. Slots are reused, and so are the buffers a Slot keeps.
+template <class Slot>
+class Prefetcher {
+ public:
+  typedef void (*PrepareFn)(void* arg, int job, Slot& slot);
+
+  // Without readers, jobs are prepared by acquire(), one slot suffices then.
+  Prefetcher(int numJobs, int numReaders, int numSlots, PrepareFn prepare,
+      void* arg) : slotOf(numJobs, -1), ready(numJobs, 0), prepare(prepare),
+      arg(arg), numJobs(numJobs), next(0), quit(false) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&changed, NULL);
+    for (int i = 0; i < std::max(numSlots, 1); ++i) {
+      slots.push_back(new Slot);
+      freeSlots.push_back(i);
+    }
+    for (int i = 0; i < numReaders; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, readerMain, this) == 0)
+        threads.push_back(thread);
+    }
+  }
+
+  // Waits for the jobs that are being prepared, but doesn't start new ones.
+  ~Prefetcher() {
+    pthread_mutex_lock(&mutex);
+    quit = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&mutex);
+    for (size_t i = 0; i < threads.size(); ++i)
+      pthread_join(threads[i], NULL);
+    for (size_t i = 0; i < slots.size(); ++i)
+      delete slots[i];
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  // Returns the slot of job once it's prepared. Jobs have to be acquired in
+  // order.
+  Slot& acquire(int job) {
+    PROFILE_SCOPE("prefetchWait");
+    pthread_mutex_lock(&mutex);
+    if (threads.empty() && next == job && !freeSlots.empty()) {
+      int slot = claim();
+      pthread_mutex_unlock(&mutex);
+      prepare(arg, job, *slots[slot]);
+      pthread_mutex_lock(&mutex);
+      ready[job] = 1;
+    }
+    while (!ready[job])
+      pthread_cond_wait(&changed, &mutex);
+    Slot& slot = *slots[slotOf[job]];
+    pthread_mutex_unlock(&mutex);
+    return slot;
+  }
+
+  // Gives the slot of an acquired job back.
+  void release(int job) {
+    pthread_mutex_lock(&mutex);
+    freeSlots.push_back(slotOf[job]);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&mutex);
+  }
+
+ private:
+  // Takes a free slot for the next job. Needs the mutex.
+  int claim() {
+    int slot = freeSlots.back();
+    freeSlots.pop_back();
+    slotOf[next++] = slot;
+    return slot;
+  }
+
+  static void* readerMain(void* self) {
+    ((Prefetcher*)self)->read();
+    return NULL;
+  }
+
+  void read() {
+    Workspace workspace;
+    tlsWorkspace = &workspace;
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+      while (!quit && next < numJobs && freeSlots.empty())
+        pthread_cond_wait(&changed, &mutex);
+      if (quit || next >= numJobs) break;
+      int job = next;
+      int slot = claim();
+      pthread_mutex_unlock(&mutex);
+      prepare(arg, job, *slots[slot]);
+      pthread_mutex_lock(&mutex);
+      ready[job] = 1;
+      pthread_cond_broadcast(&changed);
+    }
+    pthread_mutex_unlock(&mutex);
+    tlsWorkspace = NULL;
+  }
+
+  std::vector<Slot*> slots;
+  std::vector<int> freeSlots;
+  std::vector<int> slotOf;    // by job
+  std::vector<char> ready;    // by job
+  PrepareFn prepare;
+  void* arg;
+  int numJobs, next;
+  bool quit;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  std::vector<pthread_t> threads;
+
+  Prefetcher(const Prefetcher&);
+  Prefetcher& operator=(const Prefetcher&);
+};
+
+// One problem of pyramidFlowBatch().
+struct FlowProblem {
+  Pyramid* pyr0;
+  Pyramid* pyr1;
+  Pyramid* pyrMask;
+  int levels;
+  double* a;
+  FlowStats* stats;  // may be NULL
+  int next;          // level to solve next, -1 when done
+};
+
+// Up to kFlowLanes problems whose next levels have the same size.
+struct LaneJob {
+  FlowProblem* problems[kFlowLanes];
+  int n;
+};
+
+struct FlowBatch {
+  std::vector<FlowProblem>* problems;
+  std::vector<LaneJob> laneJobs;
+  const FlowOptions* opts;
+};
+
+// Solves the next level of the problems of a LaneJob with basicFlowLanes().
+void runLaneJob(void* arg, int j) {
+  FlowBatch* batch = (FlowBatch*)arg;
+  const LaneJob& job = batch->laneJobs[j];
+  const FlowOptions& opts = *batch->opts;
+  const int L = kFlowLanes;
+  FlowProblem& first = *job.problems[0];
+  int level = first.next;
+  PROFILE_SET_LEVEL(level);
+  PROFILE_SCOPE("lanes");
+
+  FlowLanes b;
+  const Img& firstLevel = *(*first.pyr0)[level];
+  b.w = firstLevel.w;
+  b.h = firstLevel.h;
+  b.nc = firstLevel.c;
+  int numPixels = b.w * b.h, nc = b.nc;
+  b.i0.setSize(b.w, b.h, nc*L);
+  b.i1.setSize(b.w, b.h, nc*L);
+  b.mask.setSize(b.w, b.h, L);
+
+  // Unused lanes get copies of the first problem, but are inactive.
+  for (int l = 0; l < L; ++l) {
+    FlowProblem& p = *job.problems[l < job.n ? l : 0];
+    int i = p.next;
+    const double* i0 = (*p.pyr0)[i]->pix;
+    const double* i1 = (*p.pyr1)[i]->pix;
+    const double* mask = (*p.pyrMask)[i]->pix;
+    for (int px = 0; px < numPixels; ++px) {
+      for (int c = 0; c < nc; ++c) {
+        b.i0.pix[(px*nc + c)*L + l] = i0[px*nc + c];
+        b.i1.pix[(px*nc + c)*L + l] = i1[px*nc + c];
+      }
+      b.mask.pix[px*L + l] = mask[px];
+    }
+    if (l < job.n) {
+      p.a[0] *= levelRatio(*p.pyr0, p.levels, i, 0);
+      p.a[2] *= levelRatio(*p.pyr0, p.levels, i, 1);
+    }
+    for (int t = 0; t < 4; ++t)
+      b.a[t][l] = p.a[t];
+    b.stats[l] = l < job.n ? p.stats : NULL;
+    b.active[l] = l < job.n;
+  }
+
+  basicFlowLanes(b, levelIters(*first.pyr0, level, opts), opts);
+
+  for (int l = 0; l < job.n; ++l) {
+    FlowProblem& p = *job.problems[l];
+    for (int t = 0; t < 4; ++t)
+      p.a[t] = b.a[t][l];
+    if (p.stats) ++p.stats->levels;
+    --p.next;
+  }
+  PROFILE_SET_LEVEL(-1);
+}
+
+// Solves the remaining levels of one problem with pyramidFlowLevel(). Stops
+// early like pyramidFlow() if opts.deadline passes, but without sharing the
+// time between the levels.
+void runFineLevels(void* arg, int j) {
+  FlowBatch* batch = (FlowBatch*)arg;
+  FlowProblem& p = (*batch->problems)[j];
+  const FlowOptions& opts = *batch->opts;
+  FlowStats deadlineStats;
+  FlowStats* stats = p.stats ? p.stats : &deadlineStats;
+  for (; p.next >= 0; --p.next) {
+    if (opts.deadline > 0 && now() >= opts.deadline) {
+      stats->timedOut = true;
+      scaleToFinest(*p.pyr0, p.levels, p.next + 1, p.a);
+      break;
+    }
+    pyramidFlowLevel(*p.pyr0, *p.pyr1, *p.pyrMask, p.levels, p.next, p.a, j,
+        opts, stats);
+    if (stats->timedOut) {
+      scaleToFinest(*p.pyr0, p.levels, p.next, p.a);
+      break;
+    }
+  }
+  p.next = -1;
+  PROFILE_SET_LEVEL(-1);
+}
+
+// Solves several pyramidFlow() problems with the same options, with the same
+// results as solving them one by one. Levels up to opts.coarseMaxWidth wide,
+// which are too small to keep vector units busy, are solved kFlowLanes
+// problems at a time with basicFlowLanes(). Finer levels are solved one
+// problem at a time, as are levels that use opts.selectPixels. Both are
+// spread over pool's threads. Doesn't support opts.roi.
+void pyramidFlowBatch(std::vector<FlowProblem>& problems,
+    const FlowOptions& opts, ThreadPool& pool) {
+  FlowBatch batch;
+  batch.problems = &problems;
+  batch.opts = &opts;
+  for (size_t j = 0; j < problems.size(); ++j) {
+    FlowProblem& p = problems[j];
+    if (p.stats) *p.stats = FlowStats();
+    p.next = pyramidFlowStart(*p.pyr0, *p.pyr1, p.levels, p.a, opts);
+  }
+
+  // Problems whose next level is coarse, by size of that level.
+  typedef std::pair<int, std::pair<int, int> > LevelSize;
+  for (;;) {
+    std::map<LevelSize, std::vector<FlowProblem*> > groups;
+    for (size_t j = 0; j < problems.size(); ++j) {
+      FlowProblem& p = problems[j];
+      if (p.next < 0) continue;
+      int w = p.pyr0->width(p.next);
+      if (w > opts.coarseMaxWidth
+          || (opts.selectPixels > 0 && w >= opts.selectMinWidth)
+          || opts.smoothSigma > 0)
+        continue;
+      const Img& level = *(*p.pyr0)[p.next];
+      groups[std::make_pair(level.w, std::make_pair(level.h, level.c))]
+          .push_back(&p);
+    }
+    if (groups.empty()) break;
+
+    batch.laneJobs.clear();
+    std::map<LevelSize, std::vector<FlowProblem*> >::iterator it;
+    for (it = groups.begin(); it != groups.end(); ++it) {
+      const std::vector<FlowProblem*>& group = it->second;
+      for (size_t k = 0; k < group.size(); k += kFlowLanes) {
+        LaneJob job;
+        job.n = std::min((int)(group.size() - k), kFlowLanes);
+        for (int l = 0; l < job.n; ++l)
+          job.problems[l] = group[k + l];
+        batch.laneJobs.push_back(job);
+      }
+    }
+    pool.parallelFor(batch.laneJobs.size(), runLaneJob, &batch);
+  }
+
+  pool.parallelFor(problems.size(), runFineLevels, &batch);
+}
+
+
+// The C interface from flow.h.
+
+struct flow_context {
+  ThreadPool pool;
+  Workspace workspace;  // for work done on the calling thread
+
+  flow_context(int numThreads) : pool(numThreads) {}
+};
+
+bool validImage(const flow_image* img) {
+  return img && img->data && img->width > 0 && img->height > 0
+      && img->format >= FLOW_RGBA8 && img->format <= FLOW_GRAY_F32;
+}
+
+// Reads pixel (x, y) of img as r, g, b, a in [0, 1]. Formats without alpha
+// are opaque.
+void readPixel(const flow_image& img, int x, int y, double* rgba) {
+  const unsigned char* row = (const unsigned char*)img.data + y * img.stride;
+  const unsigned char* p8 = row + x * (img.format == FLOW_GRAY8 ? 1 : 4);
+  const float* pf = (const float*)row;
+  switch (img.format) {
+    case FLOW_RGBA8:
+      for (int c = 0; c < 4; ++c) rgba[c] = p8[c] / 255.0;
+      break;
+    case FLOW_ARGB8:
+      for (int c = 0; c < 3; ++c) rgba[c] = p8[c + 1] / 255.0;
+      rgba[3] = p8[0] / 255.0;
+      break;
+    case FLOW_GRAY8:
+      rgba[0] = rgba[1] = rgba[2] = p8[0] / 255.0;
+      rgba[3] = 1.0;
+      break;
+    case FLOW_RGBA_F32:
+      for (int c = 0; c < 4; ++c) rgba[c] = pf[4*x + c];
+      break;
+    case FLOW_RGB_F32:
+      for (int c = 0; c < 3; ++c) rgba[c] = pf[3*x + c];
+      rgba[3] = 1.0;
+      break;
+    case FLOW_GRAY_F32:
+      rgba[0] = rgba[1] = rgba[2] = pf[x];
+      rgba[3] = 1.0;
+      break;
+  }
+}
+
+bool hasAlpha(int format) {
+  return format == FLOW_RGBA8 || format == FLOW_ARGB8
+      || format == FLOW_RGBA_F32;
+}
+
+int bytesPerPixel(int format) {
+  switch (format) {
+    case FLOW_GRAY8: return 1;
+    case FLOW_RGBA_F32: return 16;
+    case FLOW_RGB_F32: return 12;
+    case FLOW_GRAY_F32: return 4;
+  }
+  return 4;
+}
+
+// Converts a caller's image straight into the finest pyramid level flow works
+// on, a 3 channel image. If premultiply is set, color is multiplied with alpha
+// (composited onto black). If alpha is given, it's filled with the image's
+// alpha, and color is set to 0 where alpha is 0, like imageFromSource() does.
+void imageFromBuffer(const flow_image& src, Img* color, Img* alpha,
+    bool premultiply) {
+  PROFILE_SCOPE("convert");
+  int w = src.width, h = src.height;
+  color->setSize(w, h, 3);
+  if (alpha) alpha->setSize(w, h);
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      double rgba[4];
+      readPixel(src, x, y, rgba);
+      double scale = premultiply ? rgba[3] : 1.0;
+      if (alpha && rgba[3] == 0.0) scale = 0.0;
+      for (int c = 0; c < 3; ++c)
+        color->pix[(y*w + x)*3 + c] = rgba[c] * scale;
+      if (alpha)
+        alpha->pix[y*w + x] = rgba[3];
+    }
+  }
+}
+
+// The mask is the image's alpha if it has one, its brightness otherwise.
+void maskFromBuffer(const flow_image& src, Img* mask) {
+  PROFILE_SCOPE("convert");
+  int w = src.width, h = src.height;
+  mask->setSize(w, h);
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      double rgba[4];
+      readPixel(src, x, y, rgba);
+      mask->pix[y*w + x] = hasAlpha(src.format) ? rgba[3]
+          : 0.299*rgba[0] + 0.587*rgba[1] + 0.114*rgba[2];
+    }
+  }
+}
+
+FlowOptions flowOptionsFrom(const flow_options& o) {
+  FlowOptions opts;
+  opts.fineIters = o.fine_iters;
+  opts.coarseIters = o.coarse_iters;
+  opts.eps = o.eps;
+  opts.grayMinWidth = o.gray_min_width;
+  opts.roi = o.roi != 0;
+  opts.selectPixels = o.select_pixels;
+  opts.selectTile = o.select_tile;
+  opts.warmLevels = o.warm_levels;
+  opts.pyramidStep = o.pyramid_step > 1.0 ? o.pyramid_step : 2.0;
+  opts.smoothSigma = std::max(o.smooth_sigma, 0.0);
+  opts.debugOutput = false;
+  if (o.budget > 0) opts.deadline = now() + o.budget;
+  return opts;
+}
+
+// The inverse of flowOptionsFrom(), for the fields flow_options has. levels,
+// initial and budget are left 0, as FlowOptions doesn't have them.
+void flowOptionsTo(const FlowOptions& opts, flow_options* o) {
+  memset(o, 0, sizeof(*o));
+  o->fine_iters = opts.fineIters;
+  o->coarse_iters = opts.coarseIters;
+  o->eps = opts.eps;
+  o->gray_min_width = opts.grayMinWidth;
+  o->roi = opts.roi;
+  o->select_pixels = opts.selectPixels;
+  o->select_tile = opts.selectTile;
+  o->warm_levels = opts.warmLevels;
+  o->pyramid_step = opts.pyramidStep;
+  o->smooth_sigma = opts.smoothSigma;
+}
+
+// One flow_align() problem between preparing and finishing it.
+struct BufferProblem {
+  const flow_image* templ;
+  const flow_image* mask;
+  const flow_image* target;
+  const flow_options* options;
+  flow_result* result;
+
+  flow_options defaults;
+  FlowOptions opts;
+  int levels;
+  Pyramid* pyr0;
+  Pyramid* pyr1;
+  Pyramid* pyrMask;
+  FlowStats stats;
+  double start;
+};
+
+// Checks p's arguments and builds its pyramids. Returns false with
+// p.result->status set if the arguments are bad.
+bool prepareBuffers(BufferProblem& p) {
+  flow_result* result = p.result;
+  if (!result) return false;
+  memset(result, 0, sizeof(*result));
+  result->status = FLOW_ERROR_ARGUMENT;
+  if (!validImage(p.templ) || !validImage(p.target)
+      || (p.mask && !validImage(p.mask)))
+    return false;
+  result->status = FLOW_ERROR_SIZE;
+  if (p.templ->width != p.target->width
+      || p.templ->height != p.target->height
+      || (p.mask && (p.mask->width != p.templ->width
+                     || p.mask->height != p.templ->height)))
+    return false;
+
+  p.start = now();
+  if (!p.options) {
+    flow_options_init(&p.defaults);
+    p.options = &p.defaults;
+  }
+  p.opts = flowOptionsFrom(*p.options);
+  p.levels = p.options->levels > 0 ? p.options->levels
+      : levelsFor(std::min(p.templ->width, p.templ->height),
+                  p.opts.pyramidStep);
+
+  Img* base0 = new Img;
+  Img* base1 = new Img;
+  Img* baseMask = new Img;
+  if (p.mask) {
+    maskFromBuffer(*p.mask, baseMask);
+    imageFromBuffer(*p.templ, base0, NULL, false);
+    for (int i = 0; i < base0->w * base0->h; ++i)
+      if (baseMask->pix[i] == 0.0)
+        base0->pix[3*i + 0] = base0->pix[3*i + 1] = base0->pix[3*i + 2] = 0.0;
+  } else {
+    imageFromBuffer(*p.templ, base0, baseMask, false);
+  }
+  imageFromBuffer(*p.target, base1, NULL, true);
+
+  double step = p.opts.pyramidStep;
+  bool recursive = p.opts.smoothSigma > 0;
+  p.pyr0 = new Pyramid(base0, 0.8, p.levels, step, recursive);
+  p.pyr1 = new Pyramid(base1, 0.8, p.levels, step, recursive);
+  p.pyrMask = new Pyramid(baseMask, 0.8, p.levels, step, recursive);
+
+  for (int t = 0; t < 4; ++t) result->a[t] = p.options->initial[t];
+  return true;
+}
+
+// Frees p's pyramids and fills in its result after solving.
+void finishBuffers(BufferProblem& p) {
+  delete p.pyr0;
+  delete p.pyr1;
+  delete p.pyrMask;
+
+  flow_result* result = p.result;
+  result->iterations = p.stats.iterations;
+  result->levels = p.stats.levels;
+  result->converged = p.stats.converged;
+  result->update_norm = p.stats.updateNorm;
+  result->residual = p.stats.residual;
+  result->seconds = now() - p.start;
+  result->timed_out = p.stats.timedOut;
+  result->status = FLOW_OK;
+}
+
+// flow_align() without the workspace handling.
+int alignBuffers(const flow_image* templ, const flow_image* mask,
+    const flow_image* target, const flow_options* options,
+    flow_result* result) {
+  BufferProblem p;
+  p.templ = templ;
+  p.mask = mask;
+  p.target = target;
+  p.options = options;
+  p.result = result;
+  if (!prepareBuffers(p))
+    return result ? result->status : FLOW_ERROR_ARGUMENT;
+  pyramidFlow(*p.pyr0, *p.pyr1, *p.pyrMask, p.levels, result->a, 0, p.opts,
+      &p.stats);
+  finishBuffers(p);
+  return FLOW_OK;
+}
+
+// Installs a workspace for the current thread while in scope.
+class ScopedWorkspace {
+ public:
+  ScopedWorkspace(Workspace* w) : old(tlsWorkspace) { tlsWorkspace = w; }
+  ~ScopedWorkspace() { tlsWorkspace = old; }
+
+ private:
+  Workspace* old;
+};
+
+// flow_align_batch() prepares, solves and frees this many problems per
+// thread at a time, so that the pyramids in memory don't grow with the size
+// of the batch, while the lane-batched solver still gets several problems to
+// put side by side.
+const int kBatchChunkPerThread = 4;
+
+struct BatchJob {
+  std::vector<BufferProblem> problems;
+  std::vector<char> prepared;
+  int first;  // of the chunk being worked on
+};
+
+void prepareBatchJob(void* arg, int i) {
+  BatchJob* job = (BatchJob*)arg;
+  i += job->first;
+  job->prepared[i] = prepareBuffers(job->problems[i]);
+}
+
+void solveBatchJob(void* arg, int i) {
+  BatchJob* job = (BatchJob*)arg;
+  i += job->first;
+  if (!job->prepared[i]) return;
+  BufferProblem& p = job->problems[i];
+  pyramidFlow(*p.pyr0, *p.pyr1, *p.pyrMask, p.levels, p.result->a, i, p.opts,
+      &p.stats);
+}
+
+void finishBatchJob(void* arg, int i) {
+  BatchJob* job = (BatchJob*)arg;
+  i += job->first;
+  if (job->prepared[i])
+    finishBuffers(job->problems[i]);
+}
+
+extern "C" {
+
+flow_context* flow_context_create(int num_threads) {
+  return new flow_context(std::max(num_threads, 0));
+}
+
+void flow_context_destroy(flow_context* context) {
+  delete context;
+}
+
+void flow_options_init(flow_options* options) {
+  flowOptionsTo(FlowOptions(), options);
+}
+
+int flow_align(flow_context* context, const flow_image* templ,
+    const flow_image* mask, const flow_image* target,
+    const flow_options* options, flow_result* result) {
+  if (!context) return FLOW_ERROR_ARGUMENT;
+  ScopedWorkspace workspace(&context->workspace);
+  return alignBuffers(templ, mask, target, options, result);
+}
+
+int flow_align_batch(flow_context* context, int n, const flow_image* templs,
+    const flow_image* masks, const flow_image* targets,
+    const flow_options* options, flow_result* results) {
+  if (!context || n < 0 || (n > 0 && (!templs || !targets || !results)))
+    return FLOW_ERROR_ARGUMENT;
+  ScopedWorkspace workspace(&context->workspace);
+  flow_options defaults;
+  if (!options) {
+    flow_options_init(&defaults);
+    options = &defaults;
+  }
+  // The budget is for the whole batch.
+  FlowOptions opts = flowOptionsFrom(*options);
+  BatchJob job;
+  job.problems.resize(n);
+  job.prepared.resize(n);
+  for (int i = 0; i < n; ++i) {
+    BufferProblem& p = job.problems[i];
+    p.templ = &templs[i];
+    p.mask = masks ? &masks[i] : NULL;
+    p.target = &targets[i];
+    p.options = options;
+    p.result = &results[i];
+  }
+  int chunk = kBatchChunkPerThread * std::max(context->pool.size(), 1);
+  for (job.first = 0; job.first < n; job.first += chunk) {
+    int m = std::min(chunk, n - job.first);
+    context->pool.parallelFor(m, prepareBatchJob, &job);
+    for (int i = job.first; i < job.first + m; ++i)
+      job.problems[i].opts.deadline = opts.deadline;
+
+    // All problems share options, so the lane-batched solver can do the
+    // small levels of several at once. It doesn't support roi or the budget
+    // on the levels it solves.
+    if (m > 1 && !opts.roi) {
+      std::vector<FlowProblem> flowProblems;
+      for (int i = job.first; i < job.first + m; ++i) {
+        if (!job.prepared[i]) continue;
+        BufferProblem& p = job.problems[i];
+        FlowProblem f = { p.pyr0, p.pyr1, p.pyrMask, p.levels, p.result->a,
+                          &p.stats, -1 };
+        flowProblems.push_back(f);
+      }
+      pyramidFlowBatch(flowProblems, opts, context->pool);
+    } else {
+      context->pool.parallelFor(m, solveBatchJob, &job);
+    }
+    context->pool.parallelFor(m, finishBatchJob, &job);
+  }
+  for (int i = 0; i < n; ++i)
+    if (results[i].status != FLOW_OK)
+      return results[i].status;
+  return FLOW_OK;
+}
+
+}  // extern "C"
+
+
+#ifndef FLOW_LIBRARY
+// One doc/app variant pair that main() aligns.
+struct VariantPair {
+  int docIndex;
+  int appIndex;
+  int size;
+
+  // Width of the app variant. If it's not size, the app variant is resampled
+  // to size before alignment.
+  int appSize;
+};
+
+// Collects the true-color doc/app variant pairs of two icon collections. Doc
+// variants are paired with the app variant of the same size, or, if there is
+// none, with the smallest larger one.
+void findVariantPairs(ImageCollection docIcons, ImageCollection appIcons,
+    std::vector<VariantPair>& pairs) {
+  int numDocs = getImageCount(docIcons);
+  int numApps = getImageCount(appIcons);
+  if (numDocs != numApps)
+    printf("Image counts do not match (%d != %d)\n", numDocs, numApps);
+
+  for (int docIndex = 0; docIndex < numDocs; ++docIndex) {
+    int size = getWidth(docIcons, docIndex);
+
+    // The 1-bit variants are useless, the indexed variants not interesting.
+    if (!trueColor(docIcons, docIndex)) {
+      printf("Skipping doc variant %d\n", docIndex);
+      continue;
+    }
+
+    // Some files have several true-color variants of one size.
+    bool seen = false;
+    for (size_t i = 0; i < pairs.size(); ++i)
+      seen = seen || pairs[i].size == size;
+    if (seen) continue;
+
+    int best = -1;
+    for (int appIndex = 0; appIndex < numApps; ++appIndex) {
+      int appSize = getWidth(appIcons, appIndex);
+      if (appSize < size || !trueColor(appIcons, appIndex)) continue;
+      if (best == -1 || appSize < getWidth(appIcons, best))
+        best = appIndex;
+    }
+    if (best == -1) {
+      printf("Skipping doc variant %d, app icon has no variant that large\n",
+          docIndex);
+      continue;
+    }
+
+    VariantPair pair;
+    pair.docIndex = docIndex;
+    pair.appIndex = best;
+    pair.size = size;
+    pair.appSize = getWidth(appIcons, best);
+    pairs.push_back(pair);
+  }
+}
+
+// Returns the index of the pair whose size is closest to refSize, preferring
+// the larger one on ties. If refSize is 0, returns the largest pair.
+int pickReferencePair(const std::vector<VariantPair>& pairs, int refSize) {
+  int best = -1;
+  for (int i = 0; i < (int)pairs.size(); ++i) {
+    if (best == -1) { best = i; continue; }
+    int s = pairs[i].size, bestS = pairs[best].size;
+    if (refSize == 0) {
+      if (s > bestS) best = i;
+    } else {
+      int d = abs(s - refSize), bestD = abs(bestS - refSize);
+      if (d < bestD || (d == bestD && s > bestS)) best = i;
+    }
+  }
+  return best;
+}
+
+typedef std::map<int, std::vector<double> > Rects;
+
+// How alignIconFiles() solves the variant pairs of an icon file pair.
+struct AlignSettings {
+  // -1: solve every variant from scratch. 0: warm start from the largest
+  // variant. > 0: warm start from the variant closest to that size.
+  int warmSize;
+  FlowOptions opts;
+  bool selectReport;  // see --select-report
+  bool verbose;       // print variants and results
+  int prefetch;       // reader threads that decode ahead, see --prefetch
+
+  // If > 0, the seconds each pair of icon files may take, see --budget.
+  double budget;
+
+  AlignSettings()
+      : warmSize(-1), selectReport(false), verbose(true), prefetch(1),
+        budget(0) {}
+};
+
+std::string strprintf(const char* fmt, ...) {
+  char buf[1024];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  return buf;
+}
+
+// Replaces the %d in pattern, a string from the user such as --launcher, with
+// value, and %% with %, without handing pattern to printf. Returns false if
+// pattern has any other % sequence or more than one %d. Sets *found to
+// whether it had a %d.
+bool substituteIndex(const std::string& pattern, int value, std::string* out,
+    bool* found) {
+  out->clear();
+  *found = false;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    if (pattern[i] != '%') {
+      *out += pattern[i];
+      continue;
+    }
+    char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+    if (next == '%') {
+      *out += '%';
+    } else if (next == 'd' && !*found) {
+      *out += strprintf("%d", value);
+      *found = true;
+    } else {
+      return false;
+    }
+    ++i;
+  }
+  return true;
+}
+
+// Decodes the two variants of pair. Fails if one can't be decoded or if their
+// sizes don't match.
+bool decodeVariantPair(ImageCollection docIcons, ImageCollection appIcons,
+    const char* docPath, const char* appPath, const VariantPair& pair,
+    Img& docIcon, Img& appIcon, Img& appIconMask, std::string* error) {
+  int docIndex = pair.docIndex, appIndex = pair.appIndex;
+  if (!imageFromSource(docIcons, docIndex, docIcon)) {
+    *error = strprintf("Failed to load %d %s", docIndex, docPath);
+    return false;
+  }
+
+  if (pair.appSize == pair.size) {
+    if (!imageFromSource(appIcons, appIndex, appIcon, &appIconMask)) {
+      *error = strprintf("Failed to load %d %s", appIndex, appPath);
+      return false;
+    }
+  } else {
+    Img tmp, tmpMask;
+    if (!imageFromSource(appIcons, appIndex, tmp, &tmpMask)) {
+      *error = strprintf("Failed to load %d %s", appIndex, appPath);
+      return false;
+    }
+
+    appIcon.setSize(docIcon.w, docIcon.h, tmp.c);
+    resample(appIcon, tmp);
+    appIconMask.setSize(docIcon.w, docIcon.h);
+    resample(appIconMask, tmpMask);
+  }
+
+  if (docIcon.w != appIcon.w || docIcon.h != appIcon.h) {
+    *error = "Image dimensions do not match";
+    return false;
+  }
+  return true;
+}
+
+// The icon files of one icon file pair. They are only opened once something
+// isn't cached. Prefetch readers hold mutex while they open and decode them.
+struct IconSources {
+  const char* docPath;
+  const char* appPath;
+  ImageCollection docIcons, appIcons;
+  pthread_mutex_t mutex;
+
+  IconSources(const char* doc, const char* app)
+      : docPath(doc), appPath(app), docIcons(NULL), appIcons(NULL) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  ~IconSources() {
+    if (docIcons) freeImageSource(docIcons);
+    if (appIcons) freeImageSource(appIcons);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  bool open(std::string* error) {
+    if (!docIcons) docIcons = loadImageSource(docPath);
+    if (!appIcons) appIcons = loadImageSource(appPath);
+    if (!docIcons || !appIcons) {
+      *error = strprintf("Failed to load %s", !docIcons ? docPath : appPath);
+      return false;
+    }
+    return true;
+  }
+};
+
+// Pyramids of decoded variant pairs, kept by --serve between requests so that
+// icons that are asked for again skip decoding and pyramid building. Keys
+// contain the files' size and modification time, so changed files are decoded
+// again. The pyramids are set to gray before they are added, so several
+// threads can solve with one entry at the same time; their levels are built
+// by whichever thread needs them first.
+class PyramidCache {
+ public:
+  struct Entry {
+    Pyramid* pyr[3];  // app icon, doc icon, app icon mask
+    int levels;
+    size_t bytes;
+    int refs;
+    unsigned long lastUse;
+  };
+
+  PyramidCache(size_t maxBytes) : maxBytes(maxBytes), bytes(0), useCount(0),
+      hits(0), misses(0) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  ~PyramidCache() {
+    std::map<std::string, Entry*>::iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it)
+      destroy(it->second);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  // Returns the entry for key, or NULL. Entries have to be release()d.
+  Entry* acquire(const std::string& key) {
+    pthread_mutex_lock(&mutex);
+    Entry* e = NULL;
+    std::map<std::string, Entry*>::iterator it = entries.find(key);
+    if (it != entries.end()) {
+      e = it->second;
+      ++e->refs;
+      e->lastUse = ++useCount;
+      ++hits;
+    } else {
+      ++misses;
+    }
+    pthread_mutex_unlock(&mutex);
+    return e;
+  }
+
+  // Adds the pyramids under key and returns their acquired entry. If another
+  // thread added key in the meantime, frees them and returns that entry.
+  Entry* insert(const std::string& key, Pyramid* pyr0, Pyramid* pyr1,
+      Pyramid* pyrMask, int levels) {
+    Entry* e = new Entry;
+    e->pyr[0] = pyr0;
+    e->pyr[1] = pyr1;
+    e->pyr[2] = pyrMask;
+    e->levels = levels;
+    e->bytes = 0;
+    for (int p = 0; p < 3; ++p)
+      e->bytes += e->pyr[p]->bytes();
+    e->refs = 1;
+
+    pthread_mutex_lock(&mutex);
+    std::map<std::string, Entry*>::iterator it = entries.find(key);
+    if (it != entries.end()) {
+      destroy(e);
+      e = it->second;
+      ++e->refs;
+    } else {
+      entries[key] = e;
+      bytes += e->bytes;
+      evict();
+    }
+    e->lastUse = ++useCount;
+    pthread_mutex_unlock(&mutex);
+    return e;
+  }
+
+  void release(Entry* e) {
+    pthread_mutex_lock(&mutex);
+    --e->refs;
+    evict();
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // The variant pairs of an icon file pair.
+  bool findPairs(const std::string& key, std::vector<VariantPair>& result) {
+    pthread_mutex_lock(&mutex);
+    std::map<std::string, std::vector<VariantPair> >::iterator it =
+        pairs.find(key);
+    bool found = it != pairs.end();
+    if (found) result = it->second;
+    pthread_mutex_unlock(&mutex);
+    return found;
+  }
+
+  void addPairs(const std::string& key, const std::vector<VariantPair>& p) {
+    pthread_mutex_lock(&mutex);
+    pairs[key] = p;
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void getStats(long* numHits, long* numMisses, size_t* numBytes) {
+    pthread_mutex_lock(&mutex);
+    *numHits = hits;
+    *numMisses = misses;
+    *numBytes = bytes;
+    pthread_mutex_unlock(&mutex);
+  }
+
+ private:
+  // Drops the least recently used entries that aren't in use until the cache
+  // fits into maxBytes again. Needs the mutex.
+  void evict() {
+    while (bytes > maxBytes) {
+      std::map<std::string, Entry*>::iterator it, oldest = entries.end();
+      for (it = entries.begin(); it != entries.end(); ++it)
+        if (it->second->refs == 0 && (oldest == entries.end()
+            || it->second->lastUse < oldest->second->lastUse))
+          oldest = it;
+      if (oldest == entries.end()) return;
+      bytes -= oldest->second->bytes;
+      destroy(oldest->second);
+      entries.erase(oldest);
+    }
+  }
+
+  static void destroy(Entry* e) {
+    for (int p = 0; p < 3; ++p)
+      delete e->pyr[p];
+    delete e;
+  }
+
+  pthread_mutex_t mutex;
+  std::map<std::string, Entry*> entries;
+  std::map<std::string, std::vector<VariantPair> > pairs;
+  size_t maxBytes, bytes;
+  unsigned long useCount;
+  long hits, misses;
+
+  PyramidCache(const PyramidCache&);
+  PyramidCache& operator=(const PyramidCache&);
+};
+
+// Identifies the current contents of the file at path for cache keys.
+std::string fileKey(const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return path;
+  return strprintf("%s|%ld|%ld", path, (long)st.st_size, (long)st.st_mtime);
+}
+
+typedef unsigned long long Hash;
+
+// 64 bit FNV-1a. Pass the previous result as h to hash several buffers.
+Hash fnv1a(const void* data, size_t n, Hash h = 14695981039346656037ULL) {
+  const unsigned char* p = (const unsigned char*)data;
+  for (size_t i = 0; i < n; ++i)
+    h = (h ^ p[i]) * 1099511628211ULL;
+  return h;
+}
+
+// Width of the variant an icns chunk belongs to, or 0 for chunks flow doesn't
+// align (1 bit and indexed variants, table of contents, ...).
+int icnsChunkWidth(const unsigned char* type) {
+  static const struct { char type[5]; int width; } kTypes[] = {
+    { "is32", 16 }, { "s8mk", 16 }, { "icp4", 16 }, { "ic04", 16 },
+    { "il32", 32 }, { "l8mk", 32 }, { "icp5", 32 }, { "ic05", 32 },
+    { "ic11", 32 }, { "ih32", 48 }, { "h8mk", 48 }, { "icp6", 64 },
+    { "ic12", 64 }, { "it32", 128 }, { "t8mk", 128 }, { "ic07", 128 },
+    { "ic08", 256 }, { "ic13", 256 }, { "ic09", 512 }, { "ic14", 512 },
+    { "ic10", 1024 },
+  };
+  for (size_t i = 0; i < sizeof(kTypes) / sizeof(kTypes[0]); ++i)
+    if (memcmp(type, kTypes[i].type, 4) == 0)
+      return kTypes[i].width;
+  return 0;
+}
+
+// Hashes of the pixel data of an icon file's variants, by width, so that
+// editing one variant of an icon only invalidates that variant's results.
+// For files that aren't icns, every variant gets the hash of the whole file.
+class VariantHashes {
+ public:
+  VariantHashes() : fileHash(0) {}
+
+  bool load(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+    std::vector<unsigned char> data;
+    unsigned char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      data.insert(data.end(), buf, buf + n);
+    fclose(f);
+
+    fileHash = data.empty() ? fnv1a(NULL, 0) : fnv1a(&data[0], data.size());
+    if (data.size() < 8 || memcmp(&data[0], "icns", 4) != 0)
+      return true;
+    for (size_t pos = 8; pos + 8 <= data.size();) {
+      const unsigned char* p = &data[pos];
+      size_t len = p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+      if (len < 8 || pos + len > data.size()) break;
+      int width = icnsChunkWidth(p);
+      if (width > 0) {
+        std::map<int, Hash>::iterator it = hashes.find(width);
+        hashes[width] = it == hashes.end() ? fnv1a(p, len)
+            : fnv1a(p, len, it->second);
+      }
+      pos += len;
+    }
+    return true;
+  }
+
+  Hash get(int width) const {
+    std::map<int, Hash>::const_iterator it = hashes.find(width);
+    if (it != hashes.end()) return it->second;
+    return fnv1a(&width, sizeof(width), fileHash);
+  }
+
+ private:
+  std::map<int, Hash> hashes;
+  Hash fileHash;
+};
+
+// Rects found in earlier runs, so that variants that didn't change aren't
+// solved again, see --results. The file starts with kMagic, followed by
+// records that are only ever appended; the last record for a key wins.
+// Records are in host byte order and appended with a single write() under an
+// flock(), so several flow processes can share a file. Records with a bad
+// checksum (from a write that was cut short) are skipped.
+class ResultCache {
+ public:
+  struct Key {
+    Hash doc, app;  // VariantHashes of the two variants
+    Hash config;    // solver settings, see resultKey()
+
+    bool operator<(const Key& b) const {
+      if (doc != b.doc) return doc < b.doc;
+      if (app != b.app) return app < b.app;
+      return config < b.config;
+    }
+  };
+
+  ResultCache() : fd(-1) { pthread_mutex_init(&mutex, NULL); }
+
+  ~ResultCache() {
+    if (fd >= 0) close(fd);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  // Opens or creates the file at path and reads its records.
+  bool open(const char* path) {
+    fd = ::open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return false;
+    flock(fd, LOCK_EX);
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size == 0) {
+      ok = write(fd, kMagic, sizeof(kMagic)) == sizeof(kMagic);
+    } else if (ok) {
+      char magic[sizeof(kMagic)];
+      ok = pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+          && memcmp(magic, kMagic, sizeof(magic)) == 0;
+      Record r;
+      off_t pos = sizeof(kMagic);
+      for (; ok && pos + (off_t)sizeof(r) <= st.st_size; pos += sizeof(r))
+        if (pread(fd, &r, sizeof(r), pos) == sizeof(r) && r.crc == crc(r))
+          records[r.key] = r;
+
+      // Pad a record that was cut short, so the next one starts where
+      // readers expect it.
+      if (ok && pos < st.st_size) {
+        std::vector<char> zeros(pos + sizeof(r) - st.st_size);
+        ok = write(fd, &zeros[0], zeros.size()) == (ssize_t)zeros.size();
+      }
+    }
+    flock(fd, LOCK_UN);
+    if (!ok) {
+      close(fd);
+      fd = -1;
+    }
+    return ok;
+  }
+
+  bool find(const Key& key, double* a) {
+    pthread_mutex_lock(&mutex);
+    std::map<Key, Record>::iterator it = records.find(key);
+    bool found = it != records.end();
+    if (found) {
+      for (int t = 0; t < 4; ++t) a[t] = it->second.a[t];
+    }
+    pthread_mutex_unlock(&mutex);
+    return found;
+  }
+
+  void add(const Key& key, const double* a) {
+    Record r;
+    memset(&r, 0, sizeof(r));
+    r.key = key;
+    for (int t = 0; t < 4; ++t) r.a[t] = a[t];
+    r.crc = crc(r);
+
+    pthread_mutex_lock(&mutex);
+    records[key] = r;
+    if (fd >= 0) {
+      flock(fd, LOCK_EX);
+      if (write(fd, &r, sizeof(r)) != sizeof(r))
+        printf("Failed to write to the result cache\n");
+      flock(fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+ private:
+  struct Record {
+    Key key;
+    double a[4];
+    unsigned int crc;
+    unsigned int unused;
+  };
+
+  static unsigned int crc(const Record& r) {
+    return crc32((const unsigned char*)&r, offsetof(Record, crc));
+  }
+
+  static const char kMagic[8];
+
+  int fd;
+  std::map<Key, Record> records;
+  pthread_mutex_t mutex;
+
+  ResultCache(const ResultCache&);
+  ResultCache& operator=(const ResultCache&);
+};
+
+const char ResultCache::kMagic[8] = { 'f', 'l', 'o', 'w', 'r', 'c', '0', '1' };
+
+// Bump when a solver change changes results, so that results cached by older
+// builds aren't used.
+const int kResultVersion = 1;
+
+// The key under which the result for pair is cached. Everything that changes
+// the result goes into it. With --warm, that includes the reference pair's
+// pixels, since all other pairs start from its result.
+ResultCache::Key resultKey(const VariantHashes& docHashes,
+    const VariantHashes& appHashes, const VariantPair& pair,
+    const AlignSettings& settings, const ResultCache::Key* ref) {
+  const FlowOptions& o = settings.opts;
+  std::string config = strprintf(
+      "%d %d %d %d %.17g %d %d %d %d %d %d %d %d %d %.17g", kResultVersion,
+      pair.size, pair.appSize, o.fineIters, o.eps, o.coarseIters,
+      o.coarseMaxWidth, o.grayMinWidth, o.warmIters, o.roi, o.selectPixels,
+      o.selectTile, o.selectMinWidth, o.selectMaskWeight, o.pyramidStep);
+  config += strprintf(" %d", settings.warmSize);
+  if (o.smoothSigma > 0)
+    config += strprintf(" smooth %.17g", o.smoothSigma);
+
+  ResultCache::Key key;
+  key.doc = docHashes.get(pair.size);
+  key.app = appHashes.get(pair.appSize);
+  key.config = fnv1a(config.data(), config.size());
+  if (ref)
+    key.config = fnv1a(ref, sizeof(*ref), key.config);
+  return key;
+}
+
+// A decoded variant pair and its pyramids, see prepareVariantPair().
+struct PreparedPair {
+  Img docIcon, appIcon, appIconMask;  // unused if the pyramids were cached
+  Pyramid* pyr[3];                    // app icon, doc icon, app icon mask
+  int levels;
+  PyramidCache* cache;
+  PyramidCache::Entry* entry;         // set if the pyramids belong to cache
+  std::string error;                  // set if decoding failed
+
+  PreparedPair() : levels(0), cache(NULL), entry(NULL) {
+    pyr[0] = pyr[1] = pyr[2] = NULL;
+  }
+
+  ~PreparedPair() { clear(); }
+
+  // Frees or releases the pyramids. The images are kept for reuse.
+  void clear() {
+    if (entry) {
+      cache->release(entry);
+    } else if (pyr[0]) {
+      for (int p = 0; p < 3; ++p)
+        delete pyr[p];
+    }
+    entry = NULL;
+    pyr[0] = pyr[1] = pyr[2] = NULL;
+    error.clear();
+  }
+
+ private:
+  PreparedPair(const PreparedPair&);
+  PreparedPair& operator=(const PreparedPair&);
+};
+
+// Builds the finest count levels of prepared's pyramids, in gray where
+// pyramidFlow() solves in gray.
+void buildPreparedLevels(PreparedPair& prepared, const FlowOptions& opts,
+    int count) {
+  if (count <= 0 || !prepared.pyr[0]) return;
+  PROFILE_SCOPE("pyramid");
+  prepared.pyr[0]->setGrayMinWidth(opts.grayMinWidth);
+  prepared.pyr[1]->setGrayMinWidth(opts.grayMinWidth);
+  count = std::min(count, prepared.levels);
+  for (int i = 0; i < count; ++i)
+    for (int p = 0; p < 3; ++p)
+      (*prepared.pyr[p])[i];
+}
+
+// Decodes one variant pair of alignIcons() and builds its pyramids, or takes
+// them from cache if it's given (and adds them to it otherwise). Levels are
+// built on first use, except for the finest buildLevels ones, which are
+// built here. Sets prepared.error if that fails.
+void prepareVariantPair(IconSources& sources, const VariantPair& pair,
+    const std::string& pairsKey, const FlowOptions& opts, PyramidCache* cache,
+    int buildLevels, PreparedPair& prepared) {
+  PROFILE_SET_VARIANT(pair.size);
+  PROFILE_SCOPE("prepare");
+  int docIndex = pair.docIndex;
+  int levels = levelsFor(pair.size, opts.pyramidStep);
+  prepared.clear();
+  prepared.levels = levels;
+
+  std::string key;
+  if (cache) {
+    key = pairsKey + strprintf("\n%d %d %d %d %.17g %d", docIndex,
+        pair.appIndex, levels, opts.grayMinWidth, opts.pyramidStep,
+        opts.smoothSigma > 0);
+    prepared.cache = cache;
+    prepared.entry = cache->acquire(key);
+    if (prepared.entry) {
+      for (int p = 0; p < 3; ++p)
+        prepared.pyr[p] = prepared.entry->pyr[p];
+      prepared.docIcon.setSize(0, 0);
+      buildPreparedLevels(prepared, opts, buildLevels);
+      return;
+    }
+  }
+
+  Img& docIcon = prepared.docIcon;
+  Img& appIcon = prepared.appIcon;
+  Img& appIconMask = prepared.appIconMask;
+  pthread_mutex_lock(&sources.mutex);
+  bool decoded = sources.open(&prepared.error)
+      && decodeVariantPair(sources.docIcons, sources.appIcons,
+          sources.docPath, sources.appPath, pair, docIcon, appIcon,
+          appIconMask, &prepared.error);
+  pthread_mutex_unlock(&sources.mutex);
+  if (!decoded) return;
+
+  //double f[5 * 5]; gauss(f, 5, 5, 0.8);
+  //filter(i0.pix, i1.pix, i0.w, i0.h, f, 5, n);
+
+  if (opts.debugOutput) {
+    SaveImage(docIcon, "%d_in.png", docIndex);
+    SaveImage(appIconMask, "%d_out_mask.png", docIndex);
+    SaveImage(appIcon, "%d_out.png", docIndex);
+  }
+
+  double step = opts.pyramidStep;
+  bool recursive = opts.smoothSigma > 0;
+  Pyramid* pyr0 = new Pyramid(appIcon, 0.8, levels, step, recursive);
+  Pyramid* pyr1 = new Pyramid(docIcon, 0.8, levels, step, recursive);
+  Pyramid* pyrMask = new Pyramid(appIconMask, 0.8, levels, step, recursive);
+
+  if (cache) {
+    pyr0->setGrayMinWidth(opts.grayMinWidth);
+    pyr1->setGrayMinWidth(opts.grayMinWidth);
+    prepared.entry = cache->insert(key, pyr0, pyr1, pyrMask, levels);
+    for (int p = 0; p < 3; ++p)
+      prepared.pyr[p] = prepared.entry->pyr[p];
+  } else {
+    prepared.pyr[0] = pyr0;
+    prepared.pyr[1] = pyr1;
+    prepared.pyr[2] = pyrMask;
+  }
+  buildPreparedLevels(prepared, opts, buildLevels);
+}
+
+// Solves a prepared variant pair. a holds the start estimate if
+// opts.warmLevels > 0.
+void solvePreparedPair(PreparedPair& prepared, const VariantPair& pair,
+    const AlignSettings& settings, const FlowOptions& opts, double* a) {
+  int docIndex = pair.docIndex;
+  Pyramid& pyr0 = *prepared.pyr[0];
+  Pyramid& pyr1 = *prepared.pyr[1];
+  const Pyramid& pyrMask = *prepared.pyr[2];
+  int levels = prepared.levels;
+  int w = pyr0[0]->w;
+  bool decoded = !prepared.entry;
+
+  if (settings.verbose && decoded)
+    printf("%dx%d\n", w, pyr0[0]->h);
+
+  double aStart[4];
+  for (int t = 0; t < 4; ++t) aStart[t] = a[t];
+
+  clock_t start = clock();
+  pyramidFlow(pyr0, pyr1, pyrMask, levels, a, docIndex, opts);
+  double selectTime = (clock() - start) / (double)CLOCKS_PER_SEC;
+
+  if (settings.selectReport && opts.selectPixels > 0) {
+    FlowOptions fullOpts = opts;
+    fullOpts.selectPixels = 0;
+    double aFull[4];
+    for (int t = 0; t < 4; ++t) aFull[t] = aStart[t];
+    start = clock();
+    pyramidFlow(pyr0, pyr1, pyrMask, levels, aFull, docIndex, fullOpts);
+    double fullTime = (clock() - start) / (double)CLOCKS_PER_SEC;
+
+    // Compare in pixels: translations directly, scales by how far they
+    // move the icon's border.
+    double dTrans = std::max(fabs(a[0] - aFull[0]), fabs(a[2] - aFull[2]));
+    double dScale = std::max(fabs(a[1] - aFull[1]), fabs(a[3] - aFull[3]))
+        * w / 2;
+    printf("Select report %d: n %d, tile %d, translation off by %.3f px, "
+        "scale by %.3f px, %.2fs vs %.2fs\n", w, opts.selectPixels,
+        opts.selectTile, dTrans, dScale, selectTime, fullTime);
+  }
+
+  if (opts.debugOutput && decoded) {
+    Img& docIcon = prepared.docIcon;
+    interp2Scale(docIcon.pix, prepared.appIcon.pix, docIcon.w, docIcon.h, a,
+        3);
+    SaveImage(docIcon, "%d_out_estimated.png", docIndex);
+  }
+}
+
+// One pair of icon files for alignIconFiles(), and what came out of it.
+struct IconFilePair {
+  const char* docPath;
+  const char* appPath;
+  Rects rects;        // by size
+  std::string error;  // set if a file can't be read
+
+  IconFilePair(const char* doc, const char* app) : docPath(doc), appPath(app)
+  {}
+};
+
+// What alignIconFiles() does with one IconFilePair, worked out before any
+// variant is decoded.
+struct IconPlan {
+  IconSources sources;
+  std::string pairsKey;
+  std::vector<VariantPair> pairs;
+  std::vector<int> order;  // solve order, with --warm the reference first
+  int ref;                 // index of the reference pair, or -1
+  std::vector<ResultCache::Key> keys;  // by position in order
+  std::vector<char> found;             // by position, results had it
+  std::vector<double> foundA;          // 4 values per position
+
+  IconPlan(const char* doc, const char* app) : sources(doc, app), ref(-1) {}
+};
+
+// The deadline for solving the variant pair at position p of plan's order
+// when the whole file pair has to be done by deadline: the time that's left
+// is shared by the number of pixels of the variants still to solve. Variants
+// smaller than 64x64 count as that large, as their time goes to the fixed
+// costs of the solve more than to pixels.
+double variantDeadline(const IconPlan& plan, size_t p, double deadline) {
+  double pixels = 0, rest = 0;
+  for (size_t q = p; q < plan.order.size(); ++q) {
+    int size = std::max(plan.pairs[plan.order[q]].size, 64);
+    if (q == p) pixels = (double)size * size;
+    if (!plan.found[q]) rest += (double)size * size;
+  }
+  double t = now();
+  if (t >= deadline) return t;
+  return t + (deadline - t) * pixels / rest;
+}
+
+struct PlannedJobs {
+  std::vector<IconPlan*> plans;
+  std::vector<std::pair<int, int> > jobs;  // plan, position in its order
+  const AlignSettings* settings;
+  PyramidCache* cache;
+};
+
+// Decodes and prepares a job of PlannedJobs. On the reader threads, it also
+// builds the pyramid levels that alignIconFiles() will solve: all of them, or
+// only the warm ones when the variant starts from the reference variant's or,
+// with a budget, the previous variant's result.
+void prepareJob(void* arg, int job, PreparedPair& prepared) {
+  PlannedJobs* p = (PlannedJobs*)arg;
+  const AlignSettings& settings = *p->settings;
+  IconPlan& plan = *p->plans[p->jobs[job].first];
+  int pos = p->jobs[job].second;
+  const VariantPair& pair = plan.pairs[plan.order[pos]];
+  const FlowOptions& opts = settings.opts;
+
+  int buildLevels = 0;
+  if (settings.prefetch > 0) {
+    buildLevels = levelsFor(pair.size, opts.pyramidStep);
+    int fromW = 0;
+    if (plan.ref != -1 && pos > 0)
+      fromW = plan.pairs[plan.ref].size;
+    else if (settings.budget > 0 && pos > 0)
+      fromW = plan.pairs[plan.order[pos - 1]].size;
+    if (fromW > 0)
+      buildLevels = std::min(buildLevels,
+          warmLevelsFor(pair.size, fromW, opts.pyramidStep));
+  }
+  prepareVariantPair(plan.sources, pair, plan.pairsKey, opts, p->cache,
+      buildLevels, prepared);
+}
+
+struct SmallerPair {
+  const std::vector<VariantPair>& pairs;
+  SmallerPair(const std::vector<VariantPair>& p) : pairs(p) {}
+  bool operator()(int i, int j) const { return pairs[i].size < pairs[j].size; }
+};
+
+// Finds the variant pairs of an IconFilePair, their solve order and which of
+// them are in results. Returns false and sets file.error if a file can't be
+// read.
+bool planIconFiles(IconFilePair& file, IconPlan& plan,
+    const AlignSettings& settings, PyramidCache* cache,
+    ResultCache* results) {
+  if (cache)
+    plan.pairsKey = fileKey(file.docPath) + "\n" + fileKey(file.appPath);
+  if (!cache || !cache->findPairs(plan.pairsKey, plan.pairs)) {
+    if (!plan.sources.open(&file.error)) return false;
+    findVariantPairs(plan.sources.docIcons, plan.sources.appIcons,
+        plan.pairs);
+    if (cache) cache->addPairs(plan.pairsKey, plan.pairs);
+  }
+
+  VariantHashes docHashes, appHashes;
+  if (results
+      && (!docHashes.load(file.docPath) || !appHashes.load(file.appPath))) {
+    file.error = strprintf("Failed to read %s or %s", file.docPath,
+        file.appPath);
+    return false;
+  }
+
+  plan.ref = settings.warmSize >= 0
+      ? pickReferencePair(plan.pairs, settings.warmSize) : -1;
+  if (plan.ref != -1) plan.order.push_back(plan.ref);
+  for (int i = 0; i < (int)plan.pairs.size(); ++i)
+    if (i != plan.ref) plan.order.push_back(i);
+  // With a budget, small variants go first, and the others start from their
+  // results, see alignIconFiles().
+  if (settings.budget > 0 && plan.ref == -1)
+    std::stable_sort(plan.order.begin(), plan.order.end(),
+        SmallerPair(plan.pairs));
+
+  plan.keys.resize(plan.order.size());
+  plan.found.resize(plan.order.size(), 0);
+  plan.foundA.resize(4 * plan.order.size());
+  if (results) {
+    for (size_t p = 0; p < plan.order.size(); ++p) {
+      plan.keys[p] = resultKey(docHashes, appHashes, plan.pairs[plan.order[p]],
+          settings, plan.ref != -1 && p > 0 ? &plan.keys[0] : NULL);
+      plan.found[p] = results->find(plan.keys[p], &plan.foundA[4 * p]);
+    }
+  }
+  return true;
+}
+
+// Finds the rects of every variant pair of every file pair. Pyramids are
+// taken from and added to cache, results from and to results, if they are
+// given. With settings.prefetch > 0, that many reader threads decode the
+// variants and build their pyramids ahead of the solves, for all file pairs,
+// into at most settings.prefetch + 1 sets of buffers. Returns false if any
+// file pair failed, see IconFilePair::error.
+//
+// With settings.budget, each file pair has that many seconds from when its
+// first variant is solved. Each variant gets a share of the time that's
+// left by its size, see FlowOptions::deadline. Without settings.warmSize,
+// the variants are solved from small to large, and each one only refines the
+// result of the one before, so that the large variants have a good estimate
+// to fall back to if their time runs out. Results found with a budget aren't
+// added to results.
+//
+// Debug images are named by variant only, so they're only written for a
+// single file pair, and then without prefetching so that they all come from
+// the solving thread.
+bool alignIconFiles(std::vector<IconFilePair>& files,
+    const AlignSettings& requested, PyramidCache* cache,
+    ResultCache* results) {
+  AlignSettings settings = requested;
+  if (settings.opts.debugOutput) {
+    if (files.size() > 1)
+      settings.opts.debugOutput = false;
+    else
+      settings.prefetch = 0;
+  }
+  PlannedJobs planned;
+  planned.settings = &settings;
+  planned.cache = cache;
+  for (size_t f = 0; f < files.size(); ++f) {
+    IconPlan* plan = new IconPlan(files[f].docPath, files[f].appPath);
+    planned.plans.push_back(plan);
+    if (!planIconFiles(files[f], *plan, settings, cache, results)) continue;
+    for (size_t p = 0; p < plan->order.size(); ++p)
+      if (!plan->found[p])
+        planned.jobs.push_back(std::make_pair((int)f, (int)p));
+  }
+
+  bool ok = true;
+  {
+    Prefetcher<PreparedPair> prefetcher(planned.jobs.size(),
+        settings.prefetch, settings.prefetch + 1, prepareJob, &planned);
+    int job = 0;
+    for (size_t f = 0; f < files.size(); ++f) {
+      IconFilePair& file = files[f];
+      IconPlan& plan = *planned.plans[f];
+      if (!file.error.empty()) {
+        ok = false;
+        continue;
+      }
+
+      double refA[4] = { 0, 0, 0, 0 };
+      int refW = 0;
+      double deadline = settings.budget > 0 ? now() + settings.budget : 0;
+      double prevA[4] = { 0, 0, 0, 0 };
+      int prevW = 0;
+      for (size_t p = 0; p < plan.order.size(); ++p) {
+        const VariantPair& pair = plan.pairs[plan.order[p]];
+        PROFILE_SET_VARIANT(pair.size);
+        PROFILE_SCOPE("variant");
+
+        if (settings.verbose && file.error.empty())
+          printf("Collection index %d\n", pair.docIndex);
+
+        double a[4] = { 0, 0, 0, 0 };
+        FlowOptions opts = settings.opts;
+        if (refW > 0) {
+          for (int t = 0; t < 4; ++t) a[t] = refA[t];
+          rescaleParams(a, refW, pair.size);
+          opts.warmLevels = warmLevelsFor(pair.size, refW, opts.pyramidStep);
+        } else if (deadline > 0 && prevW > 0) {
+          for (int t = 0; t < 4; ++t) a[t] = prevA[t];
+          rescaleParams(a, prevW, pair.size);
+          opts.warmLevels = warmLevelsFor(pair.size, prevW, opts.pyramidStep);
+        }
+
+        if (plan.found[p]) {
+          PROFILE_COUNT("resultCacheHits", 1);
+          std::copy(&plan.foundA[4 * p], &plan.foundA[4 * p] + 4, a);
+        } else {
+          // After an error, the file's remaining jobs are only drained.
+          PreparedPair& prepared = prefetcher.acquire(job);
+          if (file.error.empty() && !prepared.error.empty())
+            file.error = prepared.error;
+          if (file.error.empty()) {
+            if (deadline > 0)
+              opts.deadline = variantDeadline(plan, p, deadline);
+            solvePreparedPair(prepared, pair, settings, opts, a);
+            if (results && deadline == 0) results->add(plan.keys[p], a);
+          }
+          prepared.clear();
+          prefetcher.release(job++);
+        }
+        if (!file.error.empty()) continue;
+
+        if (plan.order[p] == plan.ref) {
+          for (int t = 0; t < 4; ++t) refA[t] = a[t];
+          refW = pair.size;
+        }
+        for (int t = 0; t < 4; ++t) prevA[t] = a[t];
+        prevW = pair.size;
+
+        if (settings.verbose)
+          printMatrix(a, 4, 1);
+
+        for (int t = 0; t < 4; ++t)
+          file.rects[pair.size].push_back(a[t]);
+      }
+      if (!file.error.empty()) {
+        file.rects.clear();
+        ok = false;
+      }
+    }
+  }
+
+  for (size_t f = 0; f < planned.plans.size(); ++f)
+    delete planned.plans[f];
+  return ok;
+}
+
+// alignIconFiles() for one pair of icon files.
+bool alignIcons(const char* docPath, const char* appPath,
+    const AlignSettings& settings, Rects& rects, PyramidCache* cache,
+    ResultCache* results, std::string* error) {
+  std::vector<IconFilePair> files(1, IconFilePair(docPath, appPath));
+  bool ok = alignIconFiles(files, settings, cache, results);
+  rects.insert(files[0].rects.begin(), files[0].rects.end());
+  if (!ok) *error = files[0].error;
+  return ok;
+}
+
+// --serve: a daemon that keeps its worker threads, their workspaces and the
+// pyramids of decoded icons around between requests, so that docerator can
+// ask for many icons without paying for process startup and decoding each
+// time.
+//
+// Clients connect to a Unix-domain socket that only its owner can use, and
+// send frames: a 4 byte big-endian length, followed by that many bytes of
+// '\0'-separated fields. Every request starts with a command and an id that
+// is sent back with the reply, so clients can send several requests without
+// waiting. Replies come in the order requests finish. Requests:
+//
+//   icns <id> <docicon.icns> <appicon.icns> [<budget ms>]
+//     -> <id> ok [<size> <x offset> <x scale> <y offset> <y scale>]...
+//   shm <id> <name> <width> <height> <format> <stride> <templ offset>
+//       <mask offset or -1> <target offset> [<budget ms>]
+//     -> <id> ok <x offset> <x scale> <y offset> <y scale> <iterations>
+//        <residual>
+//   stats <id>
+//     -> <id> ok <requests> <cache hits> <cache misses> <cached bytes>
+//
+// shm images are in the POSIX shared memory object name (see shm_open()) at
+// the given byte offsets, in the formats from flow.h. They are aligned like
+// flow_align() does it, with the daemon's options like icns requests. A
+// budget overrides --budget for the request; when it's up, the reply has the
+// best estimates found so far. Failed requests are answered with <id> error
+// <message>.
+
+const unsigned int kMaxFrameSize = 1 << 16;
+
+bool readFully(int fd, void* buf, size_t n) {
+  char* p = (char*)buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+bool writeFully(int fd, const void* buf, size_t n) {
+  const char* p = (const char*)buf;
+  while (n > 0) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+bool readFrame(int fd, std::vector<std::string>& fields) {
+  unsigned char header[4];
+  if (!readFully(fd, header, 4)) return false;
+  unsigned int size = header[0] << 24 | header[1] << 16 | header[2] << 8
+      | header[3];
+  if (size > kMaxFrameSize) return false;
+  std::string payload(size, '\0');
+  if (size > 0 && !readFully(fd, &payload[0], size)) return false;
+
+  fields.clear();
+  size_t start = 0;
+  for (;;) {
+    size_t end = payload.find('\0', start);
+    fields.push_back(payload.substr(start, end - start));
+    if (end == std::string::npos) break;
+    start = end + 1;
+  }
+  return true;
+}
+
+bool writeFrame(int fd, const std::vector<std::string>& fields) {
+  std::string payload;
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (i > 0) payload += '\0';
+    payload += fields[i];
+  }
+  unsigned char header[4] = {
+    (unsigned char)(payload.size() >> 24),
+    (unsigned char)(payload.size() >> 16),
+    (unsigned char)(payload.size() >> 8),
+    (unsigned char)payload.size()
+  };
+  return writeFully(fd, header, 4)
+      && writeFully(fd, payload.data(), payload.size());
+}
+
+// Adds rects to a reply as <size> <x offset> <x scale> <y offset> <y scale>
+// fields, see "icns" above.
+void appendRects(std::vector<std::string>& reply, const Rects& rects) {
+  for (Rects::const_iterator it = rects.begin(); it != rects.end(); ++it) {
+    reply.push_back(strprintf("%d", it->first));
+    for (int t = 0; t < 4; ++t)
+      reply.push_back(strprintf("%.17g", it->second[t]));
+  }
+}
+
+// A client connection. Its reader thread and every request from it that
+// hasn't been answered yet hold a reference.
+struct Connection {
+  int fd;
+  int refs;
+  pthread_mutex_t mutex;  // for refs, replies and writing
+
+  // Replies that wait to be written. One worker at a time writes them, see
+  // send().
+  std::deque<std::vector<std::string> > replies;
+  bool writing;
+  bool broken;  // a write failed, the client is gone
+
+  Connection(int fd) : fd(fd), refs(1), writing(false), broken(false) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  ~Connection() {
+    close(fd);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  void retain() {
+    pthread_mutex_lock(&mutex);
+    ++refs;
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void release() {
+    pthread_mutex_lock(&mutex);
+    bool last = --refs == 0;
+    pthread_mutex_unlock(&mutex);
+    if (last) delete this;
+  }
+
+  // Queues a reply. If no other worker is writing replies to this
+  // connection, this one writes them (outside the lock) until the queue is
+  // empty; otherwise it returns right away, so that a client that stops
+  // reading holds up at most one worker instead of all that answer it.
+  void send(const std::vector<std::string>& fields) {
+    pthread_mutex_lock(&mutex);
+    if (broken) {  // nobody needs the reply
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    replies.push_back(fields);
+    if (writing) {
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    writing = true;
+    std::vector<std::string> reply;
+    while (!replies.empty() && !broken) {
+      reply.swap(replies.front());
+      replies.pop_front();
+      pthread_mutex_unlock(&mutex);
+      bool ok = writeFrame(fd, reply);
+      pthread_mutex_lock(&mutex);
+      if (!ok) {
+        broken = true;
+        replies.clear();
+      }
+    }
+    writing = false;
+    pthread_mutex_unlock(&mutex);
+  }
+};
+
+struct ServeRequest {
+  Connection* conn;
+  std::vector<std::string> fields;
+};
+
+// Requests that wait for a worker. push() blocks while the queue is full, so
+// clients that send faster than the workers solve stop being read.
+class RequestQueue {
+ public:
+  RequestQueue(size_t capacity) : capacity(capacity), total(0) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&notEmpty, NULL);
+    pthread_cond_init(&notFull, NULL);
+  }
+
+  ~RequestQueue() {
+    pthread_cond_destroy(&notFull);
+    pthread_cond_destroy(&notEmpty);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  void push(const ServeRequest& r) {
+    pthread_mutex_lock(&mutex);
+    while (requests.size() >= capacity)
+      pthread_cond_wait(&notFull, &mutex);
+    requests.push_back(r);
+    ++total;
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  ServeRequest pop() {
+    pthread_mutex_lock(&mutex);
+    while (requests.empty())
+      pthread_cond_wait(&notEmpty, &mutex);
+    ServeRequest r = requests.front();
+    requests.pop_front();
+    pthread_cond_signal(&notFull);
+    pthread_mutex_unlock(&mutex);
+    return r;
+  }
+
+  // Number of requests pushed so far.
+  long count() {
+    pthread_mutex_lock(&mutex);
+    long n = total;
+    pthread_mutex_unlock(&mutex);
+    return n;
+  }
+
+ private:
+  std::deque<ServeRequest> requests;
+  size_t capacity;
+  long total;
+  pthread_mutex_t mutex;
+  pthread_cond_t notEmpty, notFull;
+
+  RequestQueue(const RequestQueue&);
+  RequestQueue& operator=(const RequestQueue&);
+};
+
+struct Server {
+  AlignSettings settings;
+  PyramidCache cache;
+  ResultCache* results;  // see --results, or NULL
+  RequestQueue queue;
+
+  Server(const AlignSettings& s, size_t cacheBytes, ResultCache* results,
+      int queueSize)
+      : settings(s), cache(cacheBytes), results(results),
+        queue(std::max(queueSize, 1)) {
+    // Requests are solved in parallel already, so each decodes its own.
+    settings.prefetch = 0;
+    // No iterations on stdout and no debug images, whose names would clash
+    // between requests.
+    settings.verbose = false;
+    settings.opts.debugOutput = false;
+  }
+};
+
+// Handles "shm" requests, see above.
+bool alignShm(const std::vector<std::string>& fields,
+    const AlignSettings& settings, std::vector<std::string>& reply,
+    std::string* error) {
+  if (fields.size() != 10 && fields.size() != 11) {
+    *error = "shm needs 8 or 9 arguments";
+    return false;
+  }
+  int w = atoi(fields[3].c_str());
+  int h = atoi(fields[4].c_str());
+  int format = atoi(fields[5].c_str());
+  int stride = atoi(fields[6].c_str());
+  long offsets[3];
+  for (int i = 0; i < 3; ++i)
+    offsets[i] = atol(fields[7 + i].c_str());
+
+  int fd = shm_open(fields[2].c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    *error = "Failed to open shared memory " + fields[2];
+    return false;
+  }
+  struct stat st;
+  void* base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    *error = "Failed to map shared memory " + fields[2];
+    return false;
+  }
+
+  flow_image images[3];
+  bool ok = w > 0 && h > 0 && stride >= w * bytesPerPixel(format);
+  for (int i = 0; i < 3 && ok; ++i) {
+    images[i].data = offsets[i] < 0 ? NULL : (const char*)base + offsets[i];
+    images[i].width = w;
+    images[i].height = h;
+    images[i].stride = stride;
+    images[i].format = format;
+    if (offsets[i] >= 0 && offsets[i] + (long)stride * h > (long)st.st_size)
+      ok = false;
+  }
+  if (!ok || offsets[0] < 0 || offsets[2] < 0) {
+    munmap(base, st.st_size);
+    *error = "Images don't fit into shared memory " + fields[2];
+    return false;
+  }
+
+  // The daemon's settings, like "icns" requests.
+  flow_options options;
+  flowOptionsTo(settings.opts, &options);
+  options.budget = fields.size() == 11 ? atof(fields[10].c_str()) / 1000
+      : settings.budget;
+  flow_result result;
+  alignBuffers(&images[0], images[1].data ? &images[1] : NULL, &images[2],
+      &options, &result);
+  munmap(base, st.st_size);
+  if (result.status != FLOW_OK) {
+    *error = strprintf("flow_align failed: %d", result.status);
+    return false;
+  }
+
+  for (int t = 0; t < 4; ++t)
+    reply.push_back(strprintf("%.17g", result.a[t]));
+  reply.push_back(strprintf("%d", result.iterations));
+  reply.push_back(strprintf("%.17g", result.residual));
+  return true;
+}
+
+void handleRequest(Server* server, const std::vector<std::string>& fields,
+    std::vector<std::string>& reply) {
+  reply.push_back(fields.size() > 1 ? fields[1] : "");
+  reply.push_back("ok");
+  std::string command = fields[0];
+  std::string error;
+  bool ok = true;
+
+  if (command == "icns" && (fields.size() == 4 || fields.size() == 5)) {
+    AlignSettings settings = server->settings;
+    if (fields.size() == 5)
+      settings.budget = atof(fields[4].c_str()) / 1000;
+    Rects rects;
+    ok = alignIcons(fields[2].c_str(), fields[3].c_str(), settings,
+        rects, &server->cache, server->results, &error);
+    if (ok)
+      appendRects(reply, rects);
+  } else if (command == "shm") {
+    ok = alignShm(fields, server->settings, reply, &error);
+  } else if (command == "stats" && fields.size() == 2) {
+    long hits, misses;
+    size_t bytes;
+    server->cache.getStats(&hits, &misses, &bytes);
+    reply.push_back(strprintf("%ld", server->queue.count()));
+    reply.push_back(strprintf("%ld", hits));
+    reply.push_back(strprintf("%ld", misses));
+    reply.push_back(strprintf("%lu", (unsigned long)bytes));
+  } else {
+    ok = false;
+    error = "Unknown request " + command;
+  }
+
+  if (!ok) {
+    reply.resize(1);
+    reply.push_back("error");
+    reply.push_back(error);
+  }
+}
+
+void serveWorker(void* arg, int) {
+  Server* server = (Server*)arg;
+  for (;;) {
+    ServeRequest r = server->queue.pop();
+    std::vector<std::string> reply;
+    handleRequest(server, r.fields, reply);
+    r.conn->send(reply);
+    r.conn->release();
+  }
+}
+
+struct ConnectionThread {
+  Server* server;
+  Connection* conn;
+};
+
+void* readConnection(void* arg) {
+  ConnectionThread* t = (ConnectionThread*)arg;
+  ServeRequest r;
+  r.conn = t->conn;
+  while (readFrame(t->conn->fd, r.fields)) {
+    t->conn->retain();
+    t->server->queue.push(r);
+  }
+  t->conn->release();
+  delete t;
+  return NULL;
+}
+
+void* acceptConnections(void* arg) {
+  std::pair<Server*, int>* listener = (std::pair<Server*, int>*)arg;
+  for (;;) {
+    int fd = accept(listener->second, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+        perror("accept");
+      continue;
+    }
+    ConnectionThread* t = new ConnectionThread;
+    t->server = listener->first;
+    t->conn = new Connection(fd);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, readConnection, t) != 0) {
+      t->conn->release();
+      delete t;
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+char gSocketPath[sizeof(((sockaddr_un*)0)->sun_path)];
+
+void removeSocketAndExit(int) {
+  unlink(gSocketPath);
+  _exit(0);
+}
+
+// Runs the --serve daemon until it gets SIGINT or SIGTERM.
+int serve(const char* path, const AlignSettings& settings, int numThreads,
+    int queueSize, size_t cacheBytes, ResultCache* results) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("Socket path %s is too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || probe < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  // A socket file nobody listens on is left over from a daemon that died.
+  // The probe gets its own socket: one that tried to connect can't be bound.
+  bool taken = connect(probe, (sockaddr*)&addr, sizeof(addr)) == 0;
+  close(probe);
+  if (taken) {
+    printf("Another flow is serving on %s\n", path);
+    return 1;
+  }
+  unlink(path);
+
+  mode_t oldMask = umask(077);
+  int bound = bind(fd, (sockaddr*)&addr, sizeof(addr));
+  umask(oldMask);
+  if (bound != 0 || listen(fd, SOMAXCONN) != 0) {
+    perror(path);
+    return 1;
+  }
+
+  strcpy(gSocketPath, path);
+  signal(SIGINT, removeSocketAndExit);
+  signal(SIGTERM, removeSocketAndExit);
+  signal(SIGPIPE, SIG_IGN);
+
+  Server server(settings, cacheBytes, results, queueSize);
+  ThreadPool pool(numThreads);
+  std::pair<Server*, int> listener(&server, fd);
+  pthread_t acceptThread;
+  if (pthread_create(&acceptThread, NULL, acceptConnections, &listener)
+      != 0) {
+    unlink(path);
+    return 1;
+  }
+  printf("Serving on %s with %d threads\n", path, std::max(pool.size(), 1));
+  fflush(stdout);
+
+  // The workers never return.
+  pool.parallelFor(std::max(pool.size(), 1), serveWorker, &server);
+  return 0;
+}
+
+// Prints rects like docerator.py has them.
+void printRects(FILE* out, const Rects& rects) {
+  fprintf(out, "\nrects = {\n");
+  for (Rects::const_iterator it = rects.begin(); it != rects.end(); ++it) {
+    fprintf(out, "    %3d: (", it->first);
+    for (int t = 0; t < 4; ++t)
+      fprintf(out, "%8.4f%s", it->second[t], t == 3 ? "" : ", ");
+    fprintf(out, "),\n");
+  }
+  fprintf(out, "}\n");
+}
+
+// --shard: runs a manifest of icon pairs on several worker processes, so that
+// a corpus run isn't limited to one process's threads (or one machine, with
+// a --launcher), and an icon that crashes the solver only loses its own
+// result instead of the whole run.
+//
+// The coordinator sends each worker up to kShardWindow "icns" requests at a
+// time over a pipe, in the frames the daemon uses (see serve()), and the
+// worker answers them in order, like the daemon. If a worker dies, the oldest
+// request it hadn't answered is the one that killed it: that pair is retried
+// once on a fresh worker and reported as failed if it crashes that one too.
+// The other requests go back to the queue. Every pair is solved on its own
+// with the same settings, so the merged output doesn't depend on the number of
+// workers or on which worker solved what.
+
+const int kShardWindow = 2;     // requests in flight per worker
+const int kShardRetries = 1;    // times a pair that crashed a worker is retried
+const int kShardStartups = 3;   // times a worker may die before answering
+                                // anything before it's given up on
+
+// Reads a manifest: one "docicon.icns<tab>appicon.icns" pair per line. Blank
+// lines and lines starting with # are skipped.
+bool readManifest(const char* path,
+    std::vector<std::pair<std::string, std::string> >& pairs,
+    std::string* error) {
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    *error = strprintf("Failed to open %s", path);
+    return false;
+  }
+  char line[4096];
+  for (int n = 1; fgets(line, sizeof(line), f); ++n) {
+    std::string s(line);
+    while (!s.empty() && (s[s.size() - 1] == '\n' || s[s.size() - 1] == '\r'))
+      s.erase(s.size() - 1);
+    if (s.empty() || s[0] == '#') continue;
+    size_t tab = s.find('\t');
+    if (tab == std::string::npos) {
+      *error = strprintf("%s:%d doesn't have two tab-separated paths", path,
+          n);
+      fclose(f);
+      return false;
+    }
+    pairs.push_back(std::make_pair(s.substr(0, tab), s.substr(tab + 1)));
+  }
+  fclose(f);
+  return true;
+}
+
+// The worker side of --shard: answers "icns" requests from inFd on outFd until
+// inFd is closed.
+void runShardWorker(int inFd, int outFd, const AlignSettings& settings,
+    ResultCache* results) {
+  std::vector<std::string> fields;
+  while (readFrame(inFd, fields)) {
+    std::vector<std::string> reply(1, fields[0]);
+    Rects rects;
+    std::string error;
+    bool ok = fields.size() == 4 && fields[0] == "icns";
+    if (ok) {
+      reply[0] = fields[1];
+      ok = alignIcons(fields[2].c_str(), fields[3].c_str(), settings, rects,
+          NULL, results, &error);
+    } else {
+      error = "Unknown request " + fields[0];
+    }
+    reply.push_back(ok ? "ok" : "error");
+    if (ok)
+      appendRects(reply, rects);
+    else
+      reply.push_back(error);
+    if (!writeFrame(outFd, reply)) break;
+  }
+}
+
+// A worker process and the requests it hasn't answered yet, oldest first.
+struct ShardWorker {
+  pid_t pid;
+  int toFd, fromFd;
+  std::deque<int> inFlight;
+  int answered;  // since it was started
+  int startups;  // deaths in a row without answering anything
+
+  ShardWorker() : pid(-1), toFd(-1), fromFd(-1), answered(0), startups(0) {}
+};
+
+struct ShardResult {
+  bool done;
+  int crashes;
+  Rects rects;
+  std::string error;
+
+  ShardResult() : done(false), crashes(0) {}
+};
+
+// Quotes s for /bin/sh.
+std::string shellQuote(const std::string& s) {
+  std::string quoted = "'";
+  for (size_t i = 0; i < s.size(); ++i)
+    quoted += s[i] == '\'' ? std::string("'\\''") : std::string(1, s[i]);
+  return quoted + "'";
+}
+
+// Starts worker index of workers. Without a launcher, the worker is a fork of
+// this process, which opens the result cache at resultsPath (if given) for
+// itself: flock()s of a shared descriptor wouldn't keep the workers apart.
+// Otherwise it's |launcher workerCommand| run by /bin/sh, with %d in
+// launcher replaced by index (e.g. "ssh build%d").
+bool startShardWorker(std::vector<ShardWorker>& workers, int index,
+    const char* launcher, const std::string& workerCommand,
+    const AlignSettings& settings, const char* resultsPath) {
+  ShardWorker& w = workers[index];
+  int toWorker[2], fromWorker[2];
+  if (pipe(toWorker) != 0) return false;
+  if (pipe(fromWorker) != 0) {
+    close(toWorker[0]);
+    close(toWorker[1]);
+    return false;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(toWorker[0]);
+    close(toWorker[1]);
+    close(fromWorker[0]);
+    close(fromWorker[1]);
+    return false;
+  }
+  if (pid == 0) {
+    // Other workers only see their pipes close if this one doesn't hold them.
+    for (size_t i = 0; i < workers.size(); ++i) {
+      if (workers[i].toFd >= 0) close(workers[i].toFd);
+      if (workers[i].fromFd >= 0) close(workers[i].fromFd);
+    }
+    close(toWorker[1]);
+    close(fromWorker[0]);
+    if (!launcher) {
+      dup2(2, 1);  // keep stray output out of the coordinator's results
+      ResultCache results;
+      if (resultsPath && !results.open(resultsPath)) {
+        fprintf(stderr, "Failed to open result cache %s\n", resultsPath);
+        _exit(1);
+      }
+      runShardWorker(toWorker[0], fromWorker[1], settings,
+          resultsPath ? &results : NULL);
+      _exit(0);
+    }
+    dup2(toWorker[0], 0);
+    dup2(fromWorker[1], 1);
+    close(toWorker[0]);
+    close(fromWorker[1]);
+    // main() checked that launcher substitutes.
+    std::string command;
+    bool found;
+    substituteIndex(launcher, index, &command, &found);
+    command += " " + workerCommand;
+    execl("/bin/sh", "sh", "-c", command.c_str(), (char*)NULL);
+    _exit(127);
+  }
+  close(toWorker[0]);
+  close(fromWorker[1]);
+  w.pid = pid;
+  w.toFd = toWorker[1];
+  w.fromFd = fromWorker[0];
+  w.answered = 0;
+  return true;
+}
+
+// Closes a dead (or finished) worker's pipes and reaps it. Returns a
+// description of how it ended.
+std::string stopShardWorker(ShardWorker& w) {
+  close(w.toFd);
+  close(w.fromFd);
+  w.toFd = w.fromFd = -1;
+  int status = 0;
+  while (waitpid(w.pid, &status, 0) < 0 && errno == EINTR) {}
+  w.pid = -1;
+  if (WIFSIGNALED(status))
+    return strprintf("killed by signal %d", WTERMSIG(status));
+  return strprintf("exited with status %d", WEXITSTATUS(status));
+}
+
+// The --shard mode: aligns pairs (from a manifest or --discover) on
+// numWorkers worker processes and prints their rects in order, like main()
+// does for several pairs, to outPath (or stdout). Workers look up and add
+// rects in the result cache at resultsPath, if it's given.
+int runShards(const std::vector<std::pair<std::string, std::string> >& pairs,
+    int numWorkers, const char* launcher, const std::string& workerCommand,
+    const char* outPath, const AlignSettings& settings,
+    const char* resultsPath) {
+  double start = now();
+  FILE* out = outPath ? fopen(outPath, "w") : stdout;
+  if (!out) {
+    printf("Failed to write %s\n", outPath);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  int n = (int)pairs.size();
+  std::vector<ShardResult> results(n);
+  std::deque<int> pending;
+  for (int i = 0; i < n; ++i)
+    pending.push_back(i);
+  numWorkers = std::max(std::min(numWorkers, n), 1);
+  std::vector<ShardWorker> workers(numWorkers);
+  for (int i = 0; i < numWorkers; ++i)
+    if (!startShardWorker(workers, i, launcher, workerCommand, settings,
+            resultsPath))
+      perror("fork");
+
+  int done = 0, restarts = 0;
+  std::vector<pollfd> fds;
+  std::vector<int> polled;
+  while (done < n) {
+    fds.clear();
+    polled.clear();
+    for (int i = 0; i < numWorkers; ++i) {
+      ShardWorker& w = workers[i];
+      if (w.pid < 0) continue;
+      while ((int)w.inFlight.size() < kShardWindow && !pending.empty()) {
+        int job = pending.front();
+        pending.pop_front();
+        w.inFlight.push_back(job);
+        std::vector<std::string> request;
+        request.push_back("icns");
+        request.push_back(strprintf("%d", job));
+        request.push_back(pairs[job].first);
+        request.push_back(pairs[job].second);
+        // A worker that died is noticed when its pipe closes, below.
+        if (!writeFrame(w.toFd, request)) break;
+      }
+      pollfd p = { w.fromFd, POLLIN, 0 };
+      fds.push_back(p);
+      polled.push_back(i);
+    }
+    if (fds.empty()) {
+      for (int job = 0; job < n; ++job) {
+        if (results[job].done) continue;
+        results[job].done = true;
+        results[job].error = "No workers left";
+        ++done;
+      }
+      break;
+    }
+    {
+      PROFILE_SCOPE("shardWait");
+      if (poll(&fds[0], fds.size(), -1) < 0 && errno != EINTR) {
+        perror("poll");
+        return 1;
+      }
+    }
+
+    for (size_t p = 0; p < fds.size(); ++p) {
+      if (!fds[p].revents) continue;
+      ShardWorker& w = workers[polled[p]];
+      std::vector<std::string> reply;
+      if (readFrame(w.fromFd, reply) && reply.size() >= 2 && !w.inFlight.empty()
+          && atoi(reply[0].c_str()) == w.inFlight.front()) {
+        ShardResult& r = results[w.inFlight.front()];
+        w.inFlight.pop_front();
+        ++w.answered;
+        w.startups = 0;
+        r.done = true;
+        ++done;
+        if (reply[1] != "ok") {
+          r.error = reply.size() > 2 ? reply[2] : "Failed";
+          continue;
+        }
+        for (size_t f = 2; f + 5 <= reply.size(); f += 5)
+          for (int t = 0; t < 4; ++t)
+            r.rects[atoi(reply[f].c_str())].push_back(
+                strtod(reply[f + 1 + t].c_str(), NULL));
+        continue;
+      }
+
+      // The worker died (or garbled its reply): blame its oldest request
+      // and requeue the others.
+      std::string how = stopShardWorker(w);
+      if (!w.inFlight.empty()) {
+        int job = w.inFlight.front();
+        w.inFlight.pop_front();
+        ShardResult& r = results[job];
+        if (++r.crashes > kShardRetries) {
+          r.done = true;
+          r.error = "Worker " + how;
+          ++done;
+          fprintf(stderr, "%s %s: worker %s, skipping\n",
+              pairs[job].first.c_str(), pairs[job].second.c_str(),
+              how.c_str());
+        } else {
+          w.inFlight.push_front(job);
+        }
+      }
+      while (!w.inFlight.empty()) {
+        pending.push_front(w.inFlight.back());
+        w.inFlight.pop_back();
+      }
+      if (w.answered == 0 && ++w.startups >= kShardStartups) {
+        fprintf(stderr, "Worker %d %s %d times, giving up on it\n",
+            polled[p], how.c_str(), w.startups);
+        continue;
+      }
+      if (done < n) {
+        ++restarts;
+        if (!startShardWorker(workers, polled[p], launcher, workerCommand,
+                settings, resultsPath))
+          perror("fork");
+      }
+    }
+  }
+  for (int i = 0; i < numWorkers; ++i)
+    if (workers[i].pid >= 0)
+      stopShardWorker(workers[i]);
+
+  int failed = 0;
+  for (int i = 0; i < n; ++i) {
+    fprintf(out, "\n%s %s\n", pairs[i].first.c_str(), pairs[i].second.c_str());
+    if (!results[i].error.empty()) {
+      fprintf(out, "%s\n", results[i].error.c_str());
+      ++failed;
+      continue;
+    }
+    printRects(out, results[i].rects);
+  }
+  if (outPath && fclose(out) != 0) {
+    printf("Failed to write %s\n", outPath);
+    return 1;
+  }
+  fprintf(stderr, "%d pairs, %d failed, %d workers, %d restarts, %.2fs\n", n,
+      failed, numWorkers, restarts, now() - start);
+  return failed ? 1 : 0;
+}
+
+// --discover: finds the icon pairs of every app bundle below a directory, so
+// that a whole Applications folder can be aligned with one command instead of
+// a hand-written manifest. An app's icon is its Info.plist's CFBundleIconFile,
+// its document icons are the CFBundleTypeIconFile of its
+// CFBundleDocumentTypes, both in Contents/Resources and with .icns appended if
+// they have no extension, like Launch Services resolves them. Every document
+// icon is paired with the app icon.
+//
+// Directories are read level by level, each level's directories in parallel,
+// and the bundles' plists are read and parsed in parallel too, so that the
+// crawl is limited by the disk's latency rather than by one thread waiting on
+// it.
+
+// Reads the file at path into data.
+bool readFileBytes(const char* path, std::vector<unsigned char>& data) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+  unsigned char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    data.insert(data.end(), buf, buf + n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+// Appends code point c to s as UTF-8.
+void appendUtf8(std::string& s, unsigned int c) {
+  if (c < 0x80) {
+    s += (char)c;
+  } else if (c < 0x800) {
+    s += (char)(0xc0 | c >> 6);
+    s += (char)(0x80 | (c & 0x3f));
+  } else if (c < 0x10000) {
+    s += (char)(0xe0 | c >> 12);
+    s += (char)(0x80 | (c >> 6 & 0x3f));
+    s += (char)(0x80 | (c & 0x3f));
+  } else {
+    s += (char)(0xf0 | c >> 18);
+    s += (char)(0x80 | (c >> 12 & 0x3f));
+    s += (char)(0x80 | (c >> 6 & 0x3f));
+    s += (char)(0x80 | (c & 0x3f));
+  }
+}
+
+// A property list, XML or binary ("bplist00"), as far as --discover needs it:
+// strings, arrays and dicts. Everything else (numbers, dates, data, ...) is
+// kept as a node of type kOther. Nodes are referred to by index; node 0 is
+// the top object.
+class Plist {
+ public:
+  enum Type { kOther, kString, kArray, kDict };
+
+  bool parse(const std::vector<unsigned char>& data, std::string* error) {
+    nodes.clear();
+    if (data.size() >= 8 && memcmp(&data[0], "bplist00", 8) == 0) {
+      if (parseBinary(data)) return true;
+      *error = "Invalid binary plist";
+      return false;
+    }
+    const char* p = data.empty() ? "" : (const char*)&data[0];
+    xml = p;
+    xmlEnd = p + data.size();
+    std::string name;
+    bool closing, empty;
+    // Skip the <?xml?> declaration, the doctype and <plist>.
+    while (nextTag(name, &closing, &empty) && name == "plist") {}
+    if (!name.empty() && !closing && parseXmlValue(name, empty, 0) == 0)
+      return true;
+    *error = "Invalid XML plist";
+    return false;
+  }
+
+  Type type(int n) const { return nodes[n].type; }
+  const std::string& string(int n) const { return nodes[n].string; }
+  int size(int n) const { return (int)nodes[n].items.size(); }
+  int item(int n, int i) const { return nodes[n].items[i]; }
+
+  // The value of key in dict node n, or -1.
+  int get(int n, const char* key) const {
+    if (n < 0 || nodes[n].type != kDict) return -1;
+    const std::vector<int>& items = nodes[n].items;
+    for (size_t i = 0; i + 1 < items.size(); i += 2)
+      if (nodes[items[i]].string == key) return items[i + 1];
+    return -1;
+  }
+
+  // The string value of key in dict node n, or "".
+  std::string getString(int n, const char* key) const {
+    int v = get(n, key);
+    return v >= 0 && nodes[v].type == kString ? nodes[v].string : "";
+  }
+
+ private:
+  struct Node {
+    Type type;
+    std::string string;
+    std::vector<int> items;  // dicts: key, value, key, value, ...
+  };
+
+  // Nesting deeper than this, or more nodes (binary plists can refer to an
+  // object many times), are treated as an invalid file; real Info.plists are
+  // a few levels deep and have a few hundred values.
+  static const int kMaxDepth = 64;
+  static const size_t kMaxNodes = 1 << 20;
+
+  int addNode(Type type) {
+    nodes.push_back(Node());
+    nodes.back().type = type;
+    return (int)nodes.size() - 1;
+  }
+
+  // Finds the next element tag in the XML and sets name to its name, or to
+  // "" at the end or on errors. Text, comments, <?...?> and <!...> are
+  // skipped.
+  bool nextTag(std::string& name, bool* closing, bool* empty) {
+    name.clear();
+    while (xml < xmlEnd) {
+      const char* lt = (const char*)memchr(xml, '<', xmlEnd - xml);
+      if (!lt) break;
+      if (xmlEnd - lt >= 4 && memcmp(lt, "<!--", 4) == 0) {
+        const char* e = findText(lt + 4, "-->");
+        if (!e) break;
+        xml = e + 3;
+        continue;
+      }
+      const char* gt = (const char*)memchr(lt, '>', xmlEnd - lt);
+      if (!gt) break;
+      xml = gt + 1;
+      if (lt[1] == '?' || lt[1] == '!') continue;
+      *closing = lt[1] == '/';
+      *empty = gt[-1] == '/';
+      const char* b = lt + 1 + *closing;
+      const char* e = b;
+      while (e < gt && *e != ' ' && *e != '\t' && *e != '\n' && *e != '\r'
+          && *e != '/')
+        ++e;
+      name.assign(b, e);
+      return !name.empty();
+    }
+    xml = xmlEnd;
+    return false;
+  }
+
+  const char* findText(const char* p, const char* s) const {
+    size_t n = strlen(s);
+    for (; p + n <= xmlEnd; ++p)
+      if (memcmp(p, s, n) == 0) return p;
+    return NULL;
+  }
+
+  // Reads the text up to the next tag, with entities decoded, into s.
+  void readXmlText(std::string& s) {
+    s.clear();
+    while (xml < xmlEnd && *xml != '<') {
+      if (*xml != '&') {
+        s += *xml++;
+        continue;
+      }
+      const char* semi = (const char*)memchr(xml, ';', xmlEnd - xml);
+      if (!semi) {
+        s += *xml++;
+        continue;
+      }
+      std::string entity(xml + 1, semi);
+      if (entity == "amp") s += '&';
+      else if (entity == "lt") s += '<';
+      else if (entity == "gt") s += '>';
+      else if (entity == "quot") s += '"';
+      else if (entity == "apos") s += '\'';
+      else if (entity.size() > 1 && entity[0] == '#')
+        appendUtf8(s, (unsigned int)strtoul(
+            entity.c_str() + 1 + (entity[1] == 'x'), NULL,
+            entity[1] == 'x' ? 16 : 10));
+      else
+        s.append(xml, semi + 1);
+      xml = semi + 1;
+    }
+  }
+
+  // Parses the value whose start tag name was just read. Returns its node,
+  // or -1 on errors.
+  int parseXmlValue(const std::string& name, bool empty, int depth) {
+    if (depth > kMaxDepth) return -1;
+    std::string child;
+    bool closing, childEmpty;
+    if (name == "dict" || name == "array") {
+      int n = addNode(name == "dict" ? kDict : kArray);
+      if (empty) return n;
+      std::vector<int> items;
+      while (nextTag(child, &closing, &childEmpty) && !closing) {
+        int item = parseXmlValue(child, childEmpty, depth + 1);
+        if (item < 0) return -1;
+        items.push_back(item);
+      }
+      if (child != name) return -1;
+      if (name == "dict" && items.size() % 2 != 0) return -1;
+      nodes[n].items.swap(items);
+      return n;
+    }
+    int n = addNode(name == "string" || name == "key" ? kString : kOther);
+    if (empty) return n;
+    if (nodes[n].type == kString) readXmlText(nodes[n].string);
+    // Values other than strings have no elements inside, so the next tag
+    // closes this one.
+    if (!nextTag(child, &closing, &childEmpty) || !closing || child != name)
+      return -1;
+    return n;
+  }
+
+  // Binary plists: objects, then a table of their offsets, then a 32 byte
+  // trailer with the sizes of offsets and object references, the number of
+  // objects, the top object and where the offset table is. All big-endian.
+  bool parseBinary(const std::vector<unsigned char>& data) {
+    if (data.size() < 8 + 32) return false;
+    const unsigned char* t = &data[data.size() - 32];
+    offsetSize = t[6];
+    refSize = t[7];
+    unsigned long long numObjects = readBE(t + 8, 8);
+    unsigned long long top = readBE(t + 16, 8);
+    unsigned long long tableOffset = readBE(t + 24, 8);
+    if (offsetSize < 1 || offsetSize > 8 || refSize < 1 || refSize > 8
+        || top >= numObjects || tableOffset >= data.size() - 32
+        || numObjects > (data.size() - 32 - tableOffset) / offsetSize)
+      return false;
+    bplist = &data;
+    offsets.resize(numObjects);
+    for (unsigned long long i = 0; i < numObjects; ++i) {
+      offsets[i] = readBE(&data[tableOffset + i * offsetSize], offsetSize);
+      if (offsets[i] < 8 || offsets[i] >= tableOffset) return false;
+    }
+    return parseObject(top, 0) == 0;
+  }
+
+  static unsigned long long readBE(const unsigned char* p, int n) {
+    unsigned long long v = 0;
+    for (int i = 0; i < n; ++i)
+      v = v << 8 | p[i];
+    return v;
+  }
+
+  // Reads the length of the object at pos with marker byte m: the marker's low
+  // nibble, or an integer object after it if that is 0xf. Advances pos past
+  // it. Returns false if it doesn't fit in the file.
+  bool objectLength(int m, size_t* pos, unsigned long long* length) const {
+    const std::vector<unsigned char>& d = *bplist;
+    *length = m & 0xf;
+    if (*length != 0xf) return true;
+    if (*pos >= d.size() || (d[*pos] & 0xf0) != 0x10) return false;
+    int bytes = 1 << (d[*pos] & 0xf);
+    if (bytes > 8 || *pos + 1 + bytes > d.size()) return false;
+    *length = readBE(&d[*pos + 1], bytes);
+    *pos += 1 + bytes;
+    return true;
+  }
+
+  int parseObject(unsigned long long index, int depth) {
+    if (index >= offsets.size() || depth > kMaxDepth
+        || nodes.size() >= kMaxNodes)
+      return -1;
+    const std::vector<unsigned char>& d = *bplist;
+    size_t pos = offsets[index];
+    int m = d[pos++];
+    unsigned long long length;
+    switch (m >> 4) {
+      case 0x5:    // ASCII string
+      case 0x6: {  // UTF-16BE string
+        if (!objectLength(m, &pos, &length)) return -1;
+        unsigned long long bytes = (m >> 4) == 0x5 ? length : length * 2;
+        if (length > d.size() || bytes > d.size() - pos) return -1;
+        int n = addNode(kString);
+        std::string& s = nodes[n].string;
+        if ((m >> 4) == 0x5) {
+          s.assign(d.begin() + pos, d.begin() + pos + bytes);
+          return n;
+        }
+        for (unsigned long long i = 0; i < length; ++i) {
+          unsigned int c = d[pos + 2 * i] << 8 | d[pos + 2 * i + 1];
+          if (c >= 0xd800 && c < 0xdc00 && i + 1 < length) {
+            unsigned int low = d[pos + 2 * i + 2] << 8 | d[pos + 2 * i + 3];
+            if (low >= 0xdc00 && low < 0xe000) {
+              c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+              ++i;
+            }
+          }
+          appendUtf8(s, c);
+        }
+        return n;
+      }
+      case 0xa:    // array
+      case 0xc:    // set
+      case 0xd: {  // dict: all key references, then all value references
+        if (!objectLength(m, &pos, &length)) return -1;
+        unsigned long long refs = (m >> 4) == 0xd ? length * 2 : length;
+        if (length > d.size() || refs * refSize > d.size() - pos) return -1;
+        int n = addNode((m >> 4) == 0xd ? kDict : kArray);
+        std::vector<int> items(refs);
+        for (unsigned long long i = 0; i < refs; ++i) {
+          // Dict items go key, value, key, value, ... like in XML plists.
+          unsigned long long slot =
+              (m >> 4) == 0xd ? (i % 2) * length + i / 2 : i;
+          unsigned long long ref = readBE(&d[pos + slot * refSize], refSize);
+          items[i] = parseObject(ref, depth + 1);
+          if (items[i] < 0) return -1;
+        }
+        nodes[n].items.swap(items);
+        return n;
+      }
+      default:
+        return addNode(kOther);
+    }
+  }
+
+  std::vector<Node> nodes;
+  const char* xml;
+  const char* xmlEnd;
+  const std::vector<unsigned char>* bplist;
+  std::vector<unsigned long long> offsets;
+  int offsetSize, refSize;
+};
+
+// An app bundle found by --discover, and its icon files.
+struct DiscoveredApp {
+  std::string path;
+  std::string appIcon;               // "" if it has none
+  std::vector<std::string> docIcons;
+  std::string error;                 // why the bundle was skipped
+};
+
+// The directories of one level of a --discover crawl, what was found in them
+// and the directories of the next level.
+struct DiscoverLevel {
+  const std::vector<std::string>* dirs;
+  std::vector<std::vector<std::string> > subdirs;  // by dir
+  std::vector<std::vector<std::string> > apps;     // by dir
+};
+
+bool hasSuffix(const std::string& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Lists directory i of the level. Hidden entries are skipped, and symlinks
+// aren't followed so that links can't make the crawl go in circles. Bundles
+// aren't looked into, apps inside apps are helpers that have no document
+// types of their own.
+void discoverDirJob(void* arg, int i) {
+  PROFILE_SCOPE("discoverDir");
+  DiscoverLevel& level = *(DiscoverLevel*)arg;
+  const std::string& path = (*level.dirs)[i];
+  DIR* dir = opendir(path.c_str());
+  if (!dir) return;
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') continue;
+    std::string child = path + (hasSuffix(path, "/") ? "" : "/")
+        + entry->d_name;
+    bool isDir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      isDir = lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    if (!isDir) continue;
+    if (hasSuffix(child, ".app"))
+      level.apps[i].push_back(child);
+    else
+      level.subdirs[i].push_back(child);
+  }
+  closedir(dir);
+}
+
+// The path of the icon file name in the resources of the bundle at appPath,
+// or "" if there is no such file.
+std::string bundleIconPath(const std::string& appPath,
+    const std::string& name) {
+  if (name.empty()) return "";
+  std::string path = appPath + "/Contents/Resources/" + name;
+  size_t slash = name.rfind('/');
+  if (name.find('.', slash == std::string::npos ? 0 : slash) ==
+      std::string::npos)
+    path += ".icns";
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) ? path : "";
+}
+
+// Reads the Info.plist of app i and finds its icon files.
+void discoverAppJob(void* arg, int i) {
+  PROFILE_SCOPE("discoverApp");
+  DiscoveredApp& app = (*(std::vector<DiscoveredApp>*)arg)[i];
+  std::string plistPath = app.path + "/Contents/Info.plist";
+  std::vector<unsigned char> data;
+  Plist plist;
+  if (!readFileBytes(plistPath.c_str(), data)) {
+    app.error = "no Contents/Info.plist";
+    return;
+  }
+  if (!plist.parse(data, &app.error)) return;
+  std::string name = plist.getString(0, "CFBundleIconFile");
+  app.appIcon = bundleIconPath(app.path, name);
+  if (app.appIcon.empty()) {
+    app.error = name.empty() ? "no CFBundleIconFile"
+        : "CFBundleIconFile " + name + " not found";
+    return;
+  }
+  int types = plist.get(0, "CFBundleDocumentTypes");
+  if (types >= 0 && plist.type(types) == Plist::kArray) {
+    for (int t = 0; t < plist.size(types); ++t) {
+      std::string doc = bundleIconPath(app.path,
+          plist.getString(plist.item(types, t), "CFBundleTypeIconFile"));
+      // Types that show the app icon aren't document icons.
+      if (doc.empty() || doc == app.appIcon
+          || std::find(app.docIcons.begin(), app.docIcons.end(), doc)
+              != app.docIcons.end())
+        continue;
+      app.docIcons.push_back(doc);
+    }
+  }
+  if (app.docIcons.empty()) app.error = "no document icons";
+}
+
+// Finds the app bundles below root and their icon pairs, docicon first like
+// in manifests, in the order of the bundles' paths. Bundles without pairs
+// are reported on stderr if verbose.
+void discoverIconPairs(const char* root, int numThreads,
+    std::vector<std::pair<std::string, std::string> >& pairs, bool verbose) {
+  double start = now();
+  ThreadPool pool(numThreads);
+  std::vector<DiscoveredApp> apps;
+  std::vector<std::string> dirs(1, root);
+  int numDirs = 0;
+  if (hasSuffix(dirs[0], ".app")) {
+    apps.push_back(DiscoveredApp());
+    apps.back().path = dirs[0];
+    dirs.clear();
+  }
+  while (!dirs.empty()) {
+    DiscoverLevel level;
+    level.dirs = &dirs;
+    level.subdirs.resize(dirs.size());
+    level.apps.resize(dirs.size());
+    pool.parallelFor(dirs.size(), discoverDirJob, &level);
+    numDirs += dirs.size();
+    std::vector<std::string> next;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+      next.insert(next.end(), level.subdirs[i].begin(),
+          level.subdirs[i].end());
+      for (size_t a = 0; a < level.apps[i].size(); ++a) {
+        apps.push_back(DiscoveredApp());
+        apps.back().path = level.apps[i][a];
+      }
+    }
+    dirs.swap(next);
+  }
+  pool.parallelFor(apps.size(), discoverAppJob, &apps);
+
+  std::vector<std::pair<std::string, int> > order;
+  for (size_t i = 0; i < apps.size(); ++i)
+    order.push_back(std::make_pair(apps[i].path, (int)i));
+  std::sort(order.begin(), order.end());
+  int skipped = 0;
+  for (size_t o = 0; o < order.size(); ++o) {
+    const DiscoveredApp& app = apps[order[o].second];
+    for (size_t d = 0; d < app.docIcons.size(); ++d)
+      pairs.push_back(std::make_pair(app.docIcons[d], app.appIcon));
+    if (app.error.empty()) continue;
+    ++skipped;
+    if (verbose)
+      fprintf(stderr, "%s: %s, skipping\n", app.path.c_str(),
+          app.error.c_str());
+  }
+  fprintf(stderr, "%d directories, %d apps (%d without pairs), %d pairs, "
+      "%.2fs\n", numDirs, (int)apps.size(), skipped, (int)pairs.size(),
+      now() - start);
+}
+
+// --render: makes document icons like docerator.py's BackgroundRenderer, but
+// for many app icons at once: every size variant of a background icon with
+// an app icon drawn into the rect flow found for that size (or docerator's
+// default rects). Images are RGBA with premultiplied alpha, so drawing is
+// source-over blending, and app icons are scaled by averaging the pixels each
+// output pixel covers, with partially covered pixels at the rect's border.
+// Icons are rendered in parallel, one per thread at a time.
+
+// The rects docerator.py uses for its default background, found by running
+// flow on Preview's icons (16 was set by hand).
+const int kDefaultRectSizes[] = { 16, 32, 128, 256, 512 };
+const double kDefaultRects[][4] = {
+  { 0.0, 0.5, -1.0, 0.5 },
+  { -0.2781, 0.5893, -2.2293, 0.5714 },
+  { 1.1774, 0.5682, -0.8246, 0.5680 },
+  { 0.5917, 0.5649, -1.8994, 0.5650 },
+  { 0.6870, 0.5653, -4.2814, 0.5654 },
+};
+
+// The variants of an icon file by size, RGBA and premultiplied.
+struct RgbaVariants {
+  std::map<int, Img*> bySize;
+
+  ~RgbaVariants() {
+    for (std::map<int, Img*>::iterator it = bySize.begin();
+        it != bySize.end(); ++it)
+      delete it->second;
+  }
+};
+
+// Loads the square true color variants of the icon file at path. Of several
+// with the same size, the first one is used.
+bool loadRgbaVariants(const char* path, RgbaVariants& variants,
+    std::string* error) {
+  PROFILE_SCOPE("loadVariants");
+  ImageCollection source = loadImageSource(path);
+  if (!source) {
+    *error = strprintf("Failed to load %s", path);
+    return false;
+  }
+  int count = getImageCount(source);
+  for (int i = 0; i < count; ++i) {
+    int s = getWidth(source, i);
+    if (!trueColor(source, i) || variants.bySize.count(s)) continue;
+    Img color, mask;
+    if (!imageFromSource(source, i, color, &mask) || color.w != s
+        || color.h != s) continue;
+    Img* rgba = new Img(s, s, 4);
+    for (int p = 0; p < s * s; ++p) {
+      double alpha = mask.pix[p];
+      for (int c = 0; c < 3; ++c)
+        rgba->pix[p*4 + c] = color.pix[p*3 + c] * alpha;
+      rgba->pix[p*4 + 3] = alpha;
+    }
+    variants.bySize[s] = rgba;
+  }
+  freeImageSource(source);
+  if (variants.bySize.empty()) {
+    *error = strprintf("%s has no true color variants", path);
+    return false;
+  }
+  return true;
+}
+
+// Splits the generic document icon into a ground layer (the page, where the
+// app icon is drawn on) and a shadow layer that goes on top of it, like
+// splitGenericDocumentIcon() in docerator.py: opaque gray pixels become white
+// page and a black shadow as dark as they were.
+void splitBackground(const Img& bg, Img& ground, Img& shadow) {
+  int s = bg.w;
+  ground.setSize(s, s, 4);
+  shadow.setSize(s, s, 4);
+  for (int p = 0; p < s * s; ++p) {
+    const double* b = bg.pix + p*4;
+    double* g = ground.pix + p*4;
+    double* sh = shadow.pix + p*4;
+    if (b[3] < 1.0 - 0.5 / 255) {
+      std::copy(b, b + 4, g);
+      std::fill(sh, sh + 4, 0.0);
+    } else {
+      std::fill(g, g + 4, 1.0);
+      sh[0] = sh[1] = sh[2] = 0.0;
+      sh[3] = 1.0 - b[0];
+    }
+  }
+
+  // Some pixels of the fold are white on the smallest variants.
+  static const int kWhite16[][2] = {
+    { 10, 2 }, { 10, 3 }, { 11, 3 }, { 10, 4 }, { 11, 4 }, { 12, 4 }
+  };
+  static const int kWhite32[][2] = {
+    { 21, 4 }, { 21, 5 }, { 22, 5 }, { 21, 6 }, { 22, 6 }, { 23, 6 }
+  };
+  if (s == 16 || s == 32) {
+    const int (*white)[2] = s == 16 ? kWhite16 : kWhite32;
+    for (int i = 0; i < 6; ++i)
+      std::fill(shadow.pix + (white[i][1]*s + white[i][0])*4,
+          shadow.pix + (white[i][1]*s + white[i][0])*4 + 4, 1.0);
+  }
+}
+
+// Draws src over dst, both premultiplied and the same size.
+void compositeOver(Img& dst, const Img& src) {
+  double* d = dst.pix;
+  const double* s = src.pix;
+  for (int p = 0; p < dst.w * dst.h; ++p, d += 4, s += 4) {
+    double keep = 1.0 - s[3];
+    for (int c = 0; c < 4; ++c)
+      d[c] = s[c] + d[c] * keep;
+  }
+}
+
+// Weights of the src input pixels for the output pixels that a span of
+// length len starting at x0 covers, when src pixels are stretched over it.
+// Pixels that the span only partly covers get weights that add up to less
+// than 1, so that the border is antialiased.
+struct RenderTaps {
+  int first;                    // first output pixel
+  std::vector<int> start;       // first input pixel per output pixel
+  std::vector<int> count;       // input pixels per output pixel
+  std::vector<double> weights;  // maxCount per output pixel
+  int maxCount;
+};
+
+void computeRenderTaps(RenderTaps& t, int src, double x0, double len,
+    int dst) {
+  double r = src / len;  // input pixels per output pixel
+  t.first = std::max((int)floor(x0), 0);
+  int end = std::min((int)ceil(x0 + len), dst);
+  int n = std::max(end - t.first, 0);
+  t.maxCount = r >= 1.0 ? (int)ceil(r) + 1 : 2;
+  t.start.assign(n, 0);
+  t.count.assign(n, 0);
+  t.weights.assign(n * t.maxCount, 0.0);
+  for (int i = 0; i < n; ++i) {
+    int x = t.first + i;
+    double* w = &t.weights[i * t.maxCount];
+    // The part of output pixel x the span covers, in input pixels.
+    double u0 = (std::max((double)x, x0) - x0) * r;
+    double u1 = (std::min(x + 1.0, x0 + len) - x0) * r;
+    if (r >= 1.0) {
+      // Average of the input pixels the output pixel covers.
+      t.start[i] = clamp((int)floor(u0), 0, src - 1);
+      for (int k = 0; k < t.maxCount; ++k) {
+        int j = t.start[i] + k;
+        if (j >= src) break;
+        w[k] = std::max(std::min(u1, j + 1.0) - std::max(u0, (double)j), 0.0)
+            / r;
+        t.count[i] = k + 1;
+      }
+    } else {
+      // Linear interpolation at the output pixel's center, times how much
+      // of it the span covers.
+      double u = (x + 0.5 - x0) * r - 0.5;
+      int j = (int)floor(u);
+      double f = u - j, coverage = u1 - u0 > 0.0 ? (u1 - u0) / r : 0.0;
+      t.start[i] = clamp(j, 0, src - 1);
+      int j1 = clamp(j + 1, 0, src - 1);
+      w[0] = (j1 == t.start[i] ? 1.0 : 1.0 - f) * coverage;
+      w[1] = j1 == t.start[i] ? 0.0 : f * coverage;
+      t.count[i] = 2;
+    }
+  }
+}
+
+// Draws icon (square, premultiplied) over canvas, stretched to the rect at
+// (x0, y0) of size w x h.
+void drawScaled(Img& canvas, const Img& icon, double x0, double y0, double w,
+    double h) {
+  PROFILE_SCOPE("drawScaled");
+  RenderTaps tx, ty;
+  computeRenderTaps(tx, icon.w, x0, w, canvas.w);
+  computeRenderTaps(ty, icon.h, y0, h, canvas.h);
+  int nx = (int)tx.start.size(), ny = (int)ty.start.size();
+  if (nx == 0 || ny == 0) return;
+
+  // Horizontally into rows, then vertically, blending each output pixel.
+  Img rows(nx, icon.h, 4);
+  for (int y = 0; y < icon.h; ++y) {
+    const double* src = icon.pix + y * icon.w * 4;
+    double* dst = rows.pix + y * nx * 4;
+    for (int i = 0; i < nx; ++i) {
+      const double* wt = &tx.weights[i * tx.maxCount];
+      const double* s = src + tx.start[i] * 4;
+      double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+      for (int k = 0; k < tx.count[i]; ++k, s += 4)
+        for (int c = 0; c < 4; ++c)
+          sum[c] += wt[k] * s[c];
+      std::copy(sum, sum + 4, dst + i * 4);
+    }
+  }
+  std::vector<double> line(nx * 4);
+  for (int j = 0; j < ny; ++j) {
+    const double* wt = &ty.weights[j * ty.maxCount];
+    std::fill(line.begin(), line.end(), 0.0);
+    for (int k = 0; k < ty.count[j]; ++k) {
+      const double* r = rows.pix + (ty.start[j] + k) * nx * 4;
+      for (int i = 0; i < nx * 4; ++i)
+        line[i] += wt[k] * r[i];
+    }
+    double* d = canvas.pix + ((ty.first + j) * canvas.w + tx.first) * 4;
+    for (int i = 0; i < nx; ++i, d += 4) {
+      const double* s = &line[i * 4];
+      double keep = 1.0 - s[3];
+      for (int c = 0; c < 4; ++c)
+        d[c] = s[c] + d[c] * keep;
+    }
+  }
+}
+
+// Converts a premultiplied RGBA image to 8 bit RGBA that isn't.
+void rgbaToBytes(std::vector<unsigned char>& out, const Img& img) {
+  out.resize(img.w * img.h * 4);
+  for (int p = 0; p < img.w * img.h; ++p) {
+    const double* s = img.pix + p*4;
+    double alpha = clamp(s[3], 0.0, 1.0);
+    for (int c = 0; c < 3; ++c)
+      out[p*4 + c] = alpha > 0.0
+          ? (int)(255 * clamp(s[c] / alpha, 0.0, 1.0) + 0.5) : 0;
+    out[p*4 + 3] = (int)(255 * alpha + 0.5);
+  }
+}
+
+// Writes a premultiplied RGBA image as a PNG.
+bool saveRgbaPng(const char* path, const Img& img) {
+  std::vector<unsigned char> rgba, png;
+  rgbaToBytes(rgba, img);
+  encodePng(png, &rgba[0], img.w, img.h, 4, img.w * 4);
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+  bool ok = fwrite(&png[0], 1, png.size(), f) == png.size();
+  return fclose(f) == 0 && ok;
+}
+
+// icns files, so that icons can be written without makeicns and IconFamily:
+// an 'icns' header with the file's length, followed by elements that each
+// have a type, their length including that 8 byte header, and data, all
+// big-endian. Sizes up to 128 are RGB, each channel run-length encoded, and
+// an 8 bit mask; larger ones are PNG files.
+struct IcnsType {
+  int size;
+  const char* color;
+  const char* mask;  // NULL: color is a PNG with alpha
+};
+
+const IcnsType kIcnsTypes[] = {
+  { 16, "is32", "s8mk" },
+  { 32, "il32", "l8mk" },
+  { 48, "ih32", "h8mk" },
+  { 128, "it32", "t8mk" },
+  { 256, "ic08", NULL },
+  { 512, "ic09", NULL },
+  { 1024, "ic10", NULL },
+};
+
+void appendIcnsElement(std::vector<unsigned char>& out, const char* type,
+    const std::vector<unsigned char>& data) {
+  out.insert(out.end(), type, type + 4);
+  appendBE32(out, data.size() + 8);
+  out.insert(out.end(), data.begin(), data.end());
+}
+
+// Run-length encodes n bytes that are stride apart: 0x80 + k - 3 followed by
+// a byte means k (3 to 130) times that byte, k - 1 (0 to 127) followed by k
+// bytes means those bytes.
+void packIcnsChannel(std::vector<unsigned char>& out, const unsigned char* src,
+    int n, int stride) {
+  int i = 0;
+  while (i < n) {
+    int run = 1;
+    while (i + run < n && run < 130
+        && src[(i + run) * stride] == src[i * stride])
+      ++run;
+    if (run >= 3) {
+      out.push_back(0x80 + run - 3);
+      out.push_back(src[i * stride]);
+      i += run;
+      continue;
+    }
+    // Literal bytes up to the next run of 3.
+    int count = 0;
+    while (i + count < n && count < 128) {
+      if (i + count + 2 < n
+          && src[(i + count) * stride] == src[(i + count + 1) * stride]
+          && src[(i + count) * stride] == src[(i + count + 2) * stride])
+        break;
+      ++count;
+    }
+    out.push_back(count - 1);
+    for (int k = 0; k < count; ++k)
+      out.push_back(src[(i + k) * stride]);
+    i += count;
+  }
+}
+
+// Appends the elements for the premultiplied RGBA image rgba to out. Returns
+// false if icns has no type for its size.
+bool encodeIcnsVariant(std::vector<unsigned char>& out, const Img& rgba) {
+  PROFILE_SCOPE("encodeIcns");
+  const IcnsType* type = NULL;
+  for (size_t i = 0; i < sizeof(kIcnsTypes) / sizeof(kIcnsTypes[0]); ++i)
+    if (kIcnsTypes[i].size == rgba.w && rgba.w == rgba.h)
+      type = &kIcnsTypes[i];
+  if (!type) return false;
+
+  std::vector<unsigned char> bytes, data;
+  rgbaToBytes(bytes, rgba);
+  int n = rgba.w * rgba.h;
+  if (!type->mask) {
+    encodePng(data, &bytes[0], rgba.w, rgba.h, 4, rgba.w * 4);
+    appendIcnsElement(out, type->color, data);
+    return true;
+  }
+  if (rgba.w == 128)
+    data.assign(4, 0);  // it32 data starts with 4 zero bytes
+  for (int c = 0; c < 3; ++c)
+    packIcnsChannel(data, &bytes[c], n, 4);
+  appendIcnsElement(out, type->color, data);
+  data.resize(n);
+  for (int p = 0; p < n; ++p)
+    data[p] = bytes[p*4 + 3];
+  appendIcnsElement(out, type->mask, data);
+  return true;
+}
+
+// Writes the encoded variants (see encodeIcnsVariant()) as an icns file, with
+// one write.
+bool writeIcns(const char* path,
+    const std::vector<std::vector<unsigned char> >& variants) {
+  std::vector<unsigned char> file;
+  size_t size = 8;
+  for (size_t i = 0; i < variants.size(); ++i)
+    size += variants[i].size();
+  file.reserve(size);
+  const char magic[] = "icns";
+  file.insert(file.end(), magic, magic + 4);
+  appendBE32(file, size);
+  for (size_t i = 0; i < variants.size(); ++i)
+    file.insert(file.end(), variants[i].begin(), variants[i].end());
+
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+  bool ok = fwrite(&file[0], 1, file.size(), f) == file.size();
+  return fclose(f) == 0 && ok;
+}
+
+// One document icon of a --render run: appPath drawn on the background, to
+// outPattern (with %d for the size), or to one icns file if it ends in .icns.
+// If docPath is set, the rects are found by aligning appPath to it instead of
+// taken from the defaults.
+struct RenderJob {
+  std::string appPath, outPattern, docPath;
+  bool icns;
+  Rects rects;
+  RgbaVariants* app;  // while the job's chunk is rendered
+
+  // Per background variant: whether it was rendered, the encoded icns
+  // elements and errors.
+  std::vector<char> rendered;
+  std::vector<std::vector<unsigned char> > encoded;
+  std::vector<std::string> errors;
+  std::string error;
+
+  RenderJob() : icns(false), app(NULL) {}
+};
+
+// Icons are rendered in chunks of a few per thread. For each chunk, the app
+// icons are loaded (and their rects solved) in parallel, then all their
+// variants are drawn and encoded in parallel, then the icns files are
+// written.
+const int kRenderChunkPerThread = 4;
+
+struct RenderBatch {
+  RgbaVariants ground;   // by size
+  RgbaVariants shadow;   // by size, empty unless the background is split
+  std::vector<int> sizes;
+  Rects defaultRects;
+  const AlignSettings* settings;
+  std::vector<RenderJob>* jobs;
+  int first;             // job of the chunk's first icon
+};
+
+// The rect for size s: the one for s, or the one for the nearest size,
+// rescaled.
+bool rectForSize(const Rects& rects, int s, double* a) {
+  Rects::const_iterator best = rects.end();
+  for (Rects::const_iterator it = rects.begin(); it != rects.end(); ++it)
+    if (best == rects.end() || abs(it->first - s) < abs(best->first - s))
+      best = it;
+  if (best == rects.end()) return false;
+  std::copy(best->second.begin(), best->second.begin() + 4, a);
+  rescaleParams(a, best->first, s);
+  return true;
+}
+
+// Loads the app icon of job first + i and finds its rects.
+void renderLoadJob(void* arg, int i) {
+  RenderBatch& batch = *(RenderBatch*)arg;
+  RenderJob& job = (*batch.jobs)[batch.first + i];
+  if (!job.error.empty()) return;
+  if (job.docPath.empty())
+    job.rects = batch.defaultRects;
+  else if (!alignIcons(job.docPath.c_str(), job.appPath.c_str(),
+          *batch.settings, job.rects, NULL, NULL, &job.error))
+    return;
+  job.app = new RgbaVariants;
+  if (!loadRgbaVariants(job.appPath.c_str(), *job.app, &job.error)) {
+    delete job.app;
+    job.app = NULL;
+  }
+}
+
+// Draws variant t % sizes of job first + t / sizes, and saves or encodes it.
+void renderVariantJob(void* arg, int t) {
+  PROFILE_SCOPE("renderVariant");
+  RenderBatch& batch = *(RenderBatch*)arg;
+  int numSizes = (int)batch.sizes.size();
+  RenderJob& job = (*batch.jobs)[batch.first + t / numSizes];
+  int v = t % numSizes, s = batch.sizes[v];
+  double a[4];
+  if (!job.app || !rectForSize(job.rects, s, a)) return;
+  double w = s * a[1], h = s * a[3];
+
+  // The smallest app icon variant that doesn't need to be enlarged.
+  const RgbaVariants& app = *job.app;
+  const Img* icon = app.bySize.rbegin()->second;
+  std::map<int, Img*>::const_iterator it;
+  for (it = app.bySize.begin(); it != app.bySize.end(); ++it) {
+    if (it->first >= std::max(w, h)) {
+      icon = it->second;
+      break;
+    }
+  }
+
+  Img canvas(s, s, 4);
+  const Img& ground = *batch.ground.bySize.find(s)->second;
+  std::copy(ground.pix, ground.pix + s * s * 4, canvas.pix);
+  drawScaled(canvas, *icon, (s - w) / 2 + a[0], (s - h) / 2 + a[2], w, h);
+  std::map<int, Img*>::const_iterator shadow = batch.shadow.bySize.find(s);
+  if (shadow != batch.shadow.bySize.end())
+    compositeOver(canvas, *shadow->second);
+
+  if (job.icns) {
+    // Sizes icns has no type for are left out.
+    job.rendered[v] = encodeIcnsVariant(job.encoded[v], canvas);
+    return;
+  }
+  // renderDocIcons() checked that the pattern substitutes.
+  std::string path;
+  bool found;
+  substituteIndex(job.outPattern, s, &path, &found);
+  if (!saveRgbaPng(path.c_str(), canvas))
+    job.errors[v] = "Failed to write " + path;
+  else
+    job.rendered[v] = 1;
+}
+
+// Writes the icns file of job first + i and frees its app icon.
+void renderWriteJob(void* arg, int i) {
+  RenderBatch& batch = *(RenderBatch*)arg;
+  RenderJob& job = (*batch.jobs)[batch.first + i];
+  delete job.app;
+  job.app = NULL;
+  for (size_t v = 0; v < job.errors.size() && job.error.empty(); ++v)
+    job.error = job.errors[v];
+  if (job.icns && job.error.empty() && !writeIcns(job.outPattern.c_str(),
+          job.encoded))
+    job.error = "Failed to write " + job.outPattern;
+  std::vector<std::vector<unsigned char> >().swap(job.encoded);
+}
+
+// The --render mode: draws the app icons of the manifest at manifestPath onto
+// every variant of the background icon at bgPath. Manifest lines are
+// "appicon.icns<tab>out%d.png" or "appicon.icns<tab>out.icns", optionally
+// followed by "<tab>docicon.icns" to find the rects by aligning the app icon
+// to that document icon; all other lines use docerator.py's default rects.
+// If split, the background is split like docerator.py does it with the
+// generic document icon, so that its shadow goes over the app icon.
+int renderDocIcons(const char* bgPath, const char* manifestPath, bool split,
+    int numThreads, const AlignSettings& settings) {
+  double start = now();
+  std::vector<std::pair<std::string, std::string> > lines;
+  std::string error;
+  RenderBatch batch;
+  if (!readManifest(manifestPath, lines, &error)
+      || !loadRgbaVariants(bgPath, batch.ground, &error)) {
+    printf("%s, exiting.\n", error.c_str());
+    return 1;
+  }
+  std::map<int, Img*>::iterator it;
+  for (it = batch.ground.bySize.begin(); it != batch.ground.bySize.end();
+      ++it) {
+    batch.sizes.push_back(it->first);
+    if (!split) continue;
+    Img* ground = new Img, *shadow = new Img;
+    splitBackground(*it->second, *ground, *shadow);
+    delete it->second;
+    it->second = ground;
+    batch.shadow.bySize[it->first] = shadow;
+  }
+  for (int i = 0; i < 5; ++i)
+    batch.defaultRects[kDefaultRectSizes[i]].assign(kDefaultRects[i],
+        kDefaultRects[i] + 4);
+
+  std::vector<RenderJob> jobs(lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    RenderJob& job = jobs[i];
+    job.appPath = lines[i].first;
+    job.outPattern = lines[i].second;
+    size_t tab = job.outPattern.find('\t');
+    if (tab != std::string::npos) {
+      job.docPath = job.outPattern.substr(tab + 1);
+      job.outPattern.erase(tab);
+    }
+    job.icns = job.outPattern.size() > 5
+        && job.outPattern.compare(job.outPattern.size() - 5, 5, ".icns") == 0;
+    std::string path;
+    bool found;
+    if (!job.icns && (!substituteIndex(job.outPattern, 0, &path, &found)
+                      || !found))
+      job.error = "Output path " + job.outPattern
+          + " needs one %d for the size and no other % but %%";
+  }
+  AlignSettings quiet = settings;
+  quiet.verbose = false;
+  quiet.opts.debugOutput = false;
+  quiet.prefetch = 0;  // icons are already loaded in parallel
+  batch.settings = &quiet;
+  batch.jobs = &jobs;
+
+  ThreadPool pool(numThreads);
+  int chunk = kRenderChunkPerThread * std::max(pool.size(), 1);
+  int numSizes = (int)batch.sizes.size();
+  for (batch.first = 0; batch.first < (int)jobs.size(); batch.first += chunk) {
+    int n = std::min(chunk, (int)jobs.size() - batch.first);
+    for (int i = 0; i < n; ++i) {
+      RenderJob& job = jobs[batch.first + i];
+      job.rendered.assign(numSizes, 0);
+      job.encoded.assign(numSizes, std::vector<unsigned char>());
+      job.errors.assign(numSizes, std::string());
+    }
+    pool.parallelFor(n, renderLoadJob, &batch);
+    pool.parallelFor(n * numSizes, renderVariantJob, &batch);
+    pool.parallelFor(n, renderWriteJob, &batch);
+  }
+
+  int failed = 0, variants = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    for (size_t v = 0; v < jobs[i].rendered.size(); ++v)
+      variants += jobs[i].rendered[v];
+    if (jobs[i].error.empty()) continue;
+    printf("%s: %s\n", jobs[i].appPath.c_str(), jobs[i].error.c_str());
+    ++failed;
+  }
+  printf("%d icons (%d failed), %d variants in %.2fs\n", (int)jobs.size(),
+      failed, variants, now() - start);
+  return failed ? 1 : 0;
+}
+
+// Out-of-core solving for images too large to keep in memory as doubles,
+// e.g. 16k x 16k scans. Pyramid levels live in temporary files as tiles of
+// floats, which are only mapped while a TileCache keeps them. See
+// solveTiled().
+
+const int kTileSize = 256;
+
+class TiledImage;
+
+// Maps tiles of TiledImages into memory. Tiles that aren't in use stay
+// mapped until the mapped tiles exceed maxBytes, and are then unmapped least
+// recently used first. As the tiles are backed by files, unmapping never
+// writes anything that would have to be read back from elsewhere.
+class TileCache {
+ public:
+  TileCache(size_t maxBytes) : maxBytes(maxBytes), bytes(0), peakBytes(0) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  ~TileCache() {
+    std::map<Key, Entry>::iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it)
+      munmap(it->second.pix, it->second.bytes);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  // Returns tile t of img, which has to be release()d. Exits if it can't be
+  // mapped.
+  float* acquire(const TiledImage* img, int t);
+  void release(const TiledImage* img, int t);
+
+  // Unmaps all tiles of img, none of which may be in use.
+  void drop(const TiledImage* img);
+
+  size_t getPeakBytes() {
+    pthread_mutex_lock(&mutex);
+    size_t peak = peakBytes;
+    pthread_mutex_unlock(&mutex);
+    return peak;
+  }
+
+ private:
+  typedef std::pair<const TiledImage*, int> Key;
+  struct Entry {
+    float* pix;
+    size_t bytes;
+    int refs;
+    std::list<Key>::iterator unused;  // position in unused if refs == 0
+  };
+
+  // Unmaps unused tiles until the cache fits into maxBytes again. Needs the
+  // mutex.
+  void evict() {
+    while (bytes > maxBytes && !unused.empty()) {
+      std::map<Key, Entry>::iterator it = entries.find(unused.front());
+      munmap(it->second.pix, it->second.bytes);
+      bytes -= it->second.bytes;
+      entries.erase(it);
+      unused.pop_front();
+    }
+  }
+
+  pthread_mutex_t mutex;
+  std::map<Key, Entry> entries;
+  std::list<Key> unused;  // least recently used first
+  size_t maxBytes, bytes, peakBytes;
+
+  TileCache(const TileCache&);
+  TileCache& operator=(const TileCache&);
+};
+
+// A single-channel image of floats in an unlinked temporary file (in
+// $TMPDIR or /tmp). It's stored tile by tile, so that every tile is one
+// page aligned block that can be mapped by itself. Edge tiles are padded to
+// the full tile size.
+class TiledImage {
+ public:
+  TiledImage(TileCache* cache, int w, int h) : w(w), h(h),
+      tilesX((w + kTileSize - 1) / kTileSize),
+      tilesY((h + kTileSize - 1) / kTileSize),
+      tileBytes(kTileSize * kTileSize * sizeof(float)), cache(cache) {
+    const char* dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp")
+        + "/flowtilesXXXXXX";
+    fd = mkstemp(&path[0]);
+    if (fd < 0) return;
+    unlink(path.c_str());
+    if (ftruncate(fd, (off_t)tileBytes * tilesX * tilesY) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  ~TiledImage() {
+    cache->drop(this);
+    if (fd >= 0) close(fd);
+  }
+
+  bool ok() const { return fd >= 0; }
+  int numTiles() const { return tilesX * tilesY; }
+
+  // Copies the pixels [x0, x1) x [y0, y1) into dst, which has rows of
+  // x1 - x0 pixels. Pixels outside of the image get the value of the nearest
+  // border pixel, like in filter().
+  void read(double* dst, int x0, int y0, int x1, int y1) const {
+    int dw = x1 - x0;
+    int tx0 = clamp(x0, 0, w - 1) / kTileSize;
+    int tx1 = clamp(x1 - 1, 0, w - 1) / kTileSize;
+    int ty0 = clamp(y0, 0, h - 1) / kTileSize;
+    int ty1 = clamp(y1 - 1, 0, h - 1) / kTileSize;
+    for (int ty = ty0; ty <= ty1; ++ty) {
+      // The rows of dst that come from this row of tiles.
+      int ry0 = ty == 0 ? y0 : std::max(y0, ty * kTileSize);
+      int ry1 = ty == tilesY - 1 ? y1 : std::min(y1, (ty + 1) * kTileSize);
+      for (int tx = tx0; tx <= tx1; ++tx) {
+        int rx0 = tx == 0 ? x0 : std::max(x0, tx * kTileSize);
+        int rx1 = tx == tilesX - 1 ? x1 : std::min(x1, (tx + 1) * kTileSize);
+        const float* tile = cache->acquire(this, ty * tilesX + tx);
+        for (int y = ry0; y < ry1; ++y) {
+          const float* row =
+              tile + (clamp(y, 0, h - 1) - ty * kTileSize) * kTileSize;
+          double* d = dst + (y - y0) * dw;
+          for (int x = rx0; x < rx1; ++x)
+            d[x - x0] = row[clamp(x, 0, w - 1) - tx * kTileSize];
+        }
+        cache->release(this, ty * tilesX + tx);
+      }
+    }
+  }
+
+  // Stores tile t from src, which has rows of kTileSize pixels.
+  void write(int t, const double* src) {
+    float* tile = cache->acquire(this, t);
+    for (int i = 0; i < kTileSize * kTileSize; ++i)
+      tile[i] = (float)src[i];
+    cache->release(this, t);
+  }
+
+  const int w, h, tilesX, tilesY;
+  const size_t tileBytes;
+  int fd;
+  TileCache* const cache;
+
+ private:
+  TiledImage(const TiledImage&);
+  TiledImage& operator=(const TiledImage&);
+};
+
+float* TileCache::acquire(const TiledImage* img, int t) {
+  Key key(img, t);
+  pthread_mutex_lock(&mutex);
+  std::map<Key, Entry>::iterator it = entries.find(key);
+  if (it != entries.end()) {
+    if (it->second.refs++ == 0)
+      unused.erase(it->second.unused);
+    pthread_mutex_unlock(&mutex);
+    return it->second.pix;
+  }
+  void* pix = mmap(NULL, img->tileBytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+      img->fd, (off_t)img->tileBytes * t);
+  if (pix == MAP_FAILED) {
+    printf("Failed to map a tile: %s\n", strerror(errno));
+    exit(1);
+  }
+  Entry& e = entries[key];
+  e.pix = (float*)pix;
+  e.bytes = img->tileBytes;
+  e.refs = 1;
+  bytes += e.bytes;
+  peakBytes = std::max(peakBytes, bytes);
+  evict();
+  pthread_mutex_unlock(&mutex);
+  return e.pix;
+}
+
+void TileCache::release(const TiledImage* img, int t) {
+  pthread_mutex_lock(&mutex);
+  std::map<Key, Entry>::iterator it = entries.find(Key(img, t));
+  if (--it->second.refs == 0)
+    it->second.unused = unused.insert(unused.end(), it->first);
+  evict();
+  pthread_mutex_unlock(&mutex);
+}
+
+void TileCache::drop(const TiledImage* img) {
+  pthread_mutex_lock(&mutex);
+  std::map<Key, Entry>::iterator it =
+      entries.lower_bound(Key(img, INT_MIN));
+  while (it != entries.end() && it->first.first == img) {
+    assert(it->second.refs == 0);
+    munmap(it->second.pix, it->second.bytes);
+    bytes -= it->second.bytes;
+    unused.erase(it->second.unused);
+    entries.erase(it++);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// Reads the header of a binary PGM (P5) or PPM (P6) file: magic, width,
+// height, maxval, each followed by whitespace (and comments), then a single
+// whitespace character before the samples. Returns false if it isn't one.
+bool readPnmHeader(FILE* f, int* w, int* h, int* nc, int* maxval) {
+  char magic[3] = { 0 };
+  int values[3] = { 0, 0, 0 }, n = 0, ch = 0;
+  bool ok = fread(magic, 1, 2, f) == 2
+      && (strcmp(magic, "P5") == 0 || strcmp(magic, "P6") == 0);
+  while (ok && n < 3) {
+    ch = fgetc(f);
+    if (ch == '#') {
+      while (ch != EOF && ch != '\n') ch = fgetc(f);
+    } else if (ch >= '0' && ch <= '9') {
+      int v = 0;
+      for (; ch >= '0' && ch <= '9'; ch = fgetc(f))
+        v = std::min(v * 10 + (ch - '0'), 1 << 30);
+      values[n++] = v;
+      ok = ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+    } else {
+      ok = ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+    }
+  }
+  if (!ok || n != 3) return false;
+  *w = values[0];
+  *h = values[1];
+  *maxval = values[2];
+  *nc = magic[1] == '6' ? 3 : 1;
+  return *w > 0 && *h > 0 && *maxval > 0 && *maxval <= 65535;
+}
+
+// Converts n pixels of PNM samples to gray like gray64fromRgb64().
+void pnmToGray(double* dst, const unsigned char* s, int n, int nc,
+    int maxval) {
+  int bytesPerSample = maxval > 255 ? 2 : 1;
+  for (int x = 0; x < n; ++x) {
+    double v[3];
+    for (int c = 0; c < nc; ++c, s += bytesPerSample)
+      v[c] = (bytesPerSample == 2 ? (s[0] << 8) | s[1] : s[0])
+          / (double)maxval;
+    dst[x] = nc == 1 ? v[0] : 0.299 * v[0] + 0.587 * v[1] + 0.114 * v[2];
+  }
+}
+
+// Reads a binary PGM (P5) or PPM (P6) file with 8 or 16 bits per sample into
+// a TiledImage, converting color to gray. Reads a band of kTileSize rows at a
+// time, so memory use only depends on the width.
+TiledImage* readTiledPnm(const char* path, TileCache* cache,
+    std::string* error) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    *error = strprintf("Failed to open %s", path);
+    return NULL;
+  }
+  int w, h, nc, maxval;
+  if (!readPnmHeader(f, &w, &h, &nc, &maxval)) {
+    *error = strprintf("%s is not a binary PGM or PPM file", path);
+    fclose(f);
+    return NULL;
+  }
+
+  TiledImage* img = new TiledImage(cache, w, h);
+  if (!img->ok()) {
+    *error = strprintf("Failed to create tiles for %s", path);
+    delete img;
+    fclose(f);
+    return NULL;
+  }
+
+  int bytesPerSample = maxval > 255 ? 2 : 1;
+  size_t rowBytes = (size_t)w * nc * bytesPerSample;
+  std::vector<unsigned char> band(rowBytes * kTileSize);
+  std::vector<double> tile(kTileSize * kTileSize, 0.0);
+  for (int ty = 0; ty < img->tilesY; ++ty) {
+    int rows = std::min(kTileSize, h - ty * kTileSize);
+    if (fread(&band[0], rowBytes, rows, f) != (size_t)rows) {
+      *error = strprintf("%s is truncated", path);
+      delete img;
+      fclose(f);
+      return NULL;
+    }
+    for (int tx = 0; tx < img->tilesX; ++tx) {
+      int cols = std::min(kTileSize, w - tx * kTileSize);
+      for (int y = 0; y < rows; ++y)
+        pnmToGray(&tile[y * kTileSize], &band[y * rowBytes
+            + (size_t)tx * kTileSize * nc * bytesPerSample], cols, nc,
+            maxval);
+      img->write(ty * img->tilesX + tx, &tile[0]);
+    }
+  }
+  fclose(f);
+  return img;
+}
+
+// Reads a binary PGM or PPM file into img, in gray.
+bool readPnm(const char* path, Img& img, std::string* error) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    *error = strprintf("Failed to open %s", path);
+    return false;
+  }
+  int w, h, nc, maxval;
+  if (!readPnmHeader(f, &w, &h, &nc, &maxval)) {
+    *error = strprintf("%s is not a binary PGM or PPM file", path);
+    fclose(f);
+    return false;
+  }
+  size_t rowBytes = (size_t)w * nc * (maxval > 255 ? 2 : 1);
+  std::vector<unsigned char> row(rowBytes);
+  img.setSize(w, h);
+  for (int y = 0; y < h; ++y) {
+    if (fread(&row[0], 1, rowBytes, f) != rowBytes) {
+      *error = strprintf("%s is truncated", path);
+      fclose(f);
+      return false;
+    }
+    pnmToGray(img.pix + (size_t)y * w, &row[0], w, nc, maxval);
+  }
+  fclose(f);
+  return true;
+}
+
+// Multiplies the template by its mask tile by tile, as basicFlow() expects
+// a premultiplied template (see calcDt()).
+struct TiledPremultiply {
+  TiledImage* img;
+  const TiledImage* mask;
+};
+
+void tiledPremultiplyTile(void* arg, int t) {
+  TiledPremultiply* job = (TiledPremultiply*)arg;
+  TileCache* cache = job->img->cache;
+  float* pix = cache->acquire(job->img, t);
+  const float* mask = cache->acquire(job->mask, t);
+  for (int i = 0; i < kTileSize * kTileSize; ++i)
+    pix[i] *= mask[i];
+  cache->release(job->mask, t);
+  cache->release(job->img, t);
+}
 
-  // Try to reconstruct original distortion
-  //basicFlow(i0.pix, i1.pix, i0.w, i0.h, a);
-  pyramidFlow(i0.pix, i1.pix, i0.w, i0.h, a, 4, 20);
+// One step of a tiled pyramid: filters src like Pyramid does and
+// halves it (rounding up), tile by tile.
+struct TiledDownsample {
+  const TiledImage* src;
+  TiledImage* dst;
+  double f[5 * 5];
+};
+
+void tiledDownsampleTile(void* arg, int t) {
+  TiledDownsample* job = (TiledDownsample*)arg;
+  int x0 = (t % job->dst->tilesX) * kTileSize;
+  int y0 = (t / job->dst->tilesX) * kTileSize;
+
+  // The source pixels the tile's 2x2 boxes cover, plus the filter radius.
+  const int r = 2, rw = 2 * kTileSize + 2 * r;
+  Img region(rw, rw), filtered(rw, rw);
+  job->src->read(region.pix, 2 * x0 - r, 2 * y0 - r, 2 * x0 - r + rw,
+      2 * y0 - r + rw);
+  filter(filtered, region, job->f, 5);
+
+  Img tile(kTileSize, kTileSize);
+  int sw = job->src->w, sh = job->src->h;
+  for (int y = 0; y < kTileSize; ++y) {
+    for (int x = 0; x < kTileSize; ++x) {
+      // Like downsample2(), but with the last pixel repeated at odd sizes.
+      int sx0 = 2 * (x0 + x), sy0 = 2 * (y0 + y);
+      int sx1 = std::min(sx0 + 1, sw - 1), sy1 = std::min(sy0 + 1, sh - 1);
+      sx0 = std::min(sx0, sw - 1);
+      sy0 = std::min(sy0, sh - 1);
+      const double* p = filtered.pix;
+      int ox = 2 * x0 - r, oy = 2 * y0 - r;
+      tile.pix[y * kTileSize + x] = (p[(sy0 - oy) * rw + sx0 - ox]
+          + p[(sy0 - oy) * rw + sx1 - ox] + p[(sy1 - oy) * rw + sx0 - ox]
+          + p[(sy1 - oy) * rw + sx1 - ox]) / 4.0;
+    }
+  }
+  job->dst->write(t, tile.pix);
+}
+
+// Builds levels - 1 coarser levels on top of base, which the pyramid then
+// owns. Returns NULL if a level couldn't be created.
+TiledImage** tiledPyramid(TiledImage* base, int levels, TileCache* cache,
+    ThreadPool& pool) {
+  PROFILE_SCOPE("pyramid");
+  TiledImage** pyr = new TiledImage*[levels];
+  pyr[0] = base;
+  for (int i = 1; i < levels; ++i) {
+    pyr[i] = new TiledImage(cache, (pyr[i - 1]->w + 1) / 2,
+        (pyr[i - 1]->h + 1) / 2);
+    if (!pyr[i]->ok()) {
+      for (int j = 0; j <= i; ++j) delete pyr[j];
+      delete[] pyr;
+      return NULL;
+    }
+    TiledDownsample job;
+    job.src = pyr[i - 1];
+    job.dst = pyr[i];
+    gauss(job.f, 5, 5, 0.8);
+    pool.parallelFor(pyr[i]->numTiles(), tiledDownsampleTile, &job);
+  }
+  return pyr;
+}
+
+void freeTiledPyr(TiledImage** pyr, int levels) {
+  if (!pyr) return;
+  for (int i = 0; i < levels; ++i)
+    delete pyr[i];
+  delete[] pyr;
+}
+
+// One basicFlow() iteration on a tiled level: every tile sums its pixels'
+// contributions to the structure tensor, like basicFlowStrips() does for
+// its rows.
+struct TiledIteration {
+  const TiledImage* i0;
+  const TiledImage* i1;
+  const TiledImage* mask;  // may be NULL
+  double aInv[6];          // see interp2()
+  double fDx[3 * 3], fDy[3 * 3], fDt[3 * 3];
+
+  struct Sums {
+    double structureTensor[16], rhs[4], sse;
+  };
+  std::vector<Sums> sums;  // per tile
+};
+
+void tiledIterationTile(void* arg, int t) {
+  TiledIteration* job = (TiledIteration*)arg;
+  const double* aInv = job->aInv;
+  int w = job->i0->w, h = job->i0->h;
+  int bx0 = (t % job->i0->tilesX) * kTileSize;
+  int by0 = (t / job->i0->tilesX) * kTileSize;
+  int bx1 = std::min(bx0 + kTileSize, w), by1 = std::min(by0 + kTileSize, h);
+
+  // The 3x3 filters read one more pixel around the tile, within the image.
+  int rx0 = std::max(bx0 - 1, 0), ry0 = std::max(by0 - 1, 0);
+  int rx1 = std::min(bx1 + 1, w), ry1 = std::min(by1 + 1, h);
+  int rw = rx1 - rx0, rh = ry1 - ry0;
+
+  // The pixels of i1 that sample() reads for the warped region. The map
+  // only translates and scales, so its corners bound them.
+  double cx[] = { rx0 - (w - 1)/2.0, rx1 - 1 - (w - 1)/2.0 };
+  double cy[] = { ry0 - (h - 1)/2.0, ry1 - 1 - (h - 1)/2.0 };
+  double sx0 = aInv[0] + aInv[1] * cx[0] + (w - 1)/2.0;
+  double sx1 = aInv[0] + aInv[1] * cx[1] + (w - 1)/2.0;
+  double sy0 = aInv[3] + aInv[5] * cy[0] + (h - 1)/2.0;
+  double sy1 = aInv[3] + aInv[5] * cy[1] + (h - 1)/2.0;
+  int srcX0 = clamp((int)std::min(sx0, sx1), 0, w - 1);
+  int srcX1 = clamp((int)std::max(sx0, sx1) + 1, 0, w - 1) + 1;
+  int srcY0 = clamp((int)std::min(sy0, sy1), 0, h - 1);
+  int srcY1 = clamp((int)std::max(sy0, sy1) + 1, 0, h - 1) + 1;
+  int sw = srcX1 - srcX0;
+  Img src(sw, srcY1 - srcY0);
+  job->i1->read(src.pix, srcX0, srcY0, srcX1, srcY1);
+
+  Img warped(rw, rh), i0(rw, rh), mask;
+  for (int y = ry0; y < ry1; ++y) {
+    for (int x = rx0; x < rx1; ++x) {
+      // like interp2Run() and sample()
+      double dx = x - (w - 1)/2.0;
+      double dy = y - (h - 1)/2.0;
+      double sx = aInv[0] + aInv[1] * dx + aInv[2] * dy + (w - 1)/2.0;
+      double sy = aInv[3] + aInv[4] * dx + aInv[5] * dy + (h - 1)/2.0;
+      int x0 = clamp((int)sx, 0, w-1) - srcX0;
+      int x1 = clamp((int)sx + 1, 0, w-1) - srcX0;
+      int y0 = clamp((int)sy, 0, h-1) - srcY0;
+      int y1 = clamp((int)sy + 1, 0, h-1) - srcY0;
+      double fx = sx - (int)sx, fy = sy - (int)sy;
+      double s0 = lerp(fx, src.pix[y0*sw + x0], src.pix[y0*sw + x1]);
+      double s1 = lerp(fx, src.pix[y1*sw + x0], src.pix[y1*sw + x1]);
+      warped.pix[(y - ry0)*rw + x - rx0] = lerp(fy, s0, s1);
+    }
+  }
+  job->i0->read(i0.pix, rx0, ry0, rx1, ry1);
+  if (job->mask) {
+    mask.setSize(rw, rh);
+    job->mask->read(mask.pix, rx0, ry0, rx1, ry1);
+  }
 
-  printf("Result:\n");
-  printMatrix(a, 4, 1);
+  TiledIteration::Sums& sums = job->sums[t];
+  memset(&sums, 0, sizeof(sums));
+  Img dx(rw, 1), dy(rw, 1), dt(rw, 1), filtered0(rw, 1), filteredMask(rw, 1);
+  for (int y = by0; y < by1; ++y) {
+    int rows[] = { std::max(y - 1, 0) - ry0, y - ry0,
+                   std::min(y + 1, h - 1) - ry0 };
+    const double* warpedRows[3], *i0Rows[3];
+    for (int r = 0; r < 3; ++r) {
+      warpedRows[r] = warped.pix + rows[r] * rw;
+      i0Rows[r] = i0.pix + rows[r] * rw;
+    }
+    filterRow33(dx.pix, warpedRows, rw, job->fDx, 1);
+    filterRow33(dy.pix, warpedRows, rw, job->fDy, 1);
+    filterRow33(filtered0.pix, i0Rows, rw, job->fDt, 1);
+    filterRow33(dt.pix, warpedRows, rw, job->fDt, 1);
+    if (job->mask) {
+      const double* maskRows[] = { mask.pix + rows[0] * rw,
+        mask.pix + rows[1] * rw, mask.pix + rows[2] * rw };
+      filterRow33(filteredMask.pix, maskRows, rw, job->fDt, 1);
+    }
+    for (int x = 0; x < rw; ++x) {
+      if (!job->mask)
+        dt.pix[x] -= filtered0.pix[x];
+      else
+        dt.pix[x] = filteredMask.pix[x]*dt.pix[x] - filtered0.pix[x];
+    }
+    accumulateTensorRun(sums.structureTensor, sums.rhs, sums.sse,
+        dx.pix + bx0 - rx0, dy.pix + bx0 - rx0, dt.pix + bx0 - rx0, w, h, 1,
+        y, bx0, bx1);
+  }
+}
+
+// Solves pyramid levels like pyramidFlow(), starting from a on the coarsest
+// level. Levels whose images fit into inCoreBytes are copied into memory and
+// solved by basicFlow(); larger ones are solved tile by tile on pool's
+// threads. The per-tile sums are added in tile order, so results don't
+// depend on the number of threads.
+void solveTiled(TiledImage** pyr0, TiledImage** pyr1, TiledImage** pyrMask,
+    int levels, double* a, size_t inCoreBytes, const FlowOptions& opts,
+    ThreadPool& pool, FlowStats* stats) {
+  for (int i = levels - 1; i >= 0; --i) {
+    PROFILE_SET_LEVEL(i);
+    PROFILE_SCOPE("level");
+    int w = pyr0[i]->w, h = pyr0[i]->h;
+    if (i + 1 < levels) {
+      a[0] *= w / (double)pyr0[i + 1]->w;
+      a[2] *= h / (double)pyr0[i + 1]->h;
+    }
+    int iters = w <= opts.coarseMaxWidth ? opts.coarseIters : opts.fineIters;
+
+    if ((size_t)w * h * 3 * sizeof(double) <= inCoreBytes) {
+      Img i0(w, h), i1(w, h), mask;
+      pyr0[i]->read(i0.pix, 0, 0, w, h);
+      pyr1[i]->read(i1.pix, 0, 0, w, h);
+      if (pyrMask) {
+        mask.setSize(w, h);
+        pyrMask[i]->read(mask.pix, 0, 0, w, h);
+      }
+      basicFlow(i0.pix, i1.pix, w, h, a, 1, iters, mask.pix, 0, opts, stats);
+    } else {
+      TiledIteration job;
+      job.i0 = pyr0[i];
+      job.i1 = pyr1[i];
+      job.mask = pyrMask ? pyrMask[i] : NULL;
+      dxKernel(job.fDx);
+      dyKernel(job.fDy);
+      gauss(job.fDt, 3, 3, 1.0);
+      job.sums.resize(pyr0[i]->numTiles());
+      for (int it = 0; it < iters; ++it) {
+        PROFILE_COUNT("iterations", 1);
+        if (stats) {
+          ++stats->iterations;
+          stats->converged = false;
+        }
+        double aFull[] = { -a[0]/a[1], 1.0/a[1], 0, -a[2]/a[3], 0, 1.0/a[3] };
+        invertAffine(aFull, job.aInv);
+        {
+          PROFILE_SCOPE("tiles");
+          pool.parallelFor(job.sums.size(), tiledIterationTile, &job);
+        }
+        double structureTensor[16] = { 0.0 }, rhs[4] = { 0.0 };
+        double sse = 0.0;
+        for (size_t t = 0; t < job.sums.size(); ++t) {
+          for (int j = 0; j < 16; ++j)
+            structureTensor[j] += job.sums[t].structureTensor[j];
+          for (int j = 0; j < 4; ++j)
+            rhs[j] += job.sums[t].rhs[j];
+          sse += job.sums[t].sse;
+        }
+        if (!applyFlowUpdate(structureTensor, rhs, sse, w * h, a, opts,
+                stats))
+          break;
+      }
+    }
+    if (stats) ++stats->levels;
+  }
+  PROFILE_SET_LEVEL(-1);
+}
 
-  interp2Scale(i1.pix, i0.pix, i0.w, i0.h, a);
-  i1.save("out_estimated.png");
+// The --tiled mode: aligns two large grayscale or color PGM/PPM images (and
+// an optional PGM mask for the template) with about memoryBytes of memory,
+// however large the images are: half of it for mapped tiles, a quarter for
+// levels that are solved in memory, plus buffers of a few tiles per thread.
+// Starts from the identity, as scans usually only need a small correction.
+// Prints the result like the rects.
+int alignTiled(const char* templPath, const char* targetPath,
+    const char* maskPath, size_t memoryBytes, int numThreads,
+    const FlowOptions& opts) {
+  double start = now();
+  TileCache cache(memoryBytes / 2);
+  ThreadPool pool(numThreads);
+  std::string error;
+  TiledImage* base[3] = { NULL, NULL, NULL };
+  const char* paths[] = { templPath, targetPath, maskPath };
+  for (int p = 0; p < 3 && paths[p] && error.empty(); ++p)
+    base[p] = readTiledPnm(paths[p], &cache, &error);
+  for (int p = 1; p < 3 && base[p] && error.empty(); ++p)
+    if (base[p]->w != base[0]->w || base[p]->h != base[0]->h)
+      error = strprintf("%s doesn't have the size of %s", paths[p], templPath);
+  if (!error.empty()) {
+    printf("%s, exiting.\n", error.c_str());
+    for (int p = 0; p < 3; ++p) delete base[p];
+    return 1;
+  }
+  if (base[2]) {
+    TiledPremultiply job = { base[0], base[2] };
+    pool.parallelFor(base[0]->numTiles(), tiledPremultiplyTile, &job);
+  }
+  printf("%dx%d, read in %.2fs\n", base[0]->w, base[0]->h, now() - start);
+
+  int levels = levelsFor(std::min(base[0]->w, base[0]->h));
+  TiledImage** pyr[3] = { NULL, NULL, NULL };
+  for (int p = 0; p < 3; ++p) {
+    if (!base[p]) continue;
+    pyr[p] = tiledPyramid(base[p], levels, &cache, pool);
+    if (!pyr[p]) {
+      printf("Failed to create tiles, exiting.\n");
+      for (int q = 0; q < 3; ++q)
+        if (q < p) freeTiledPyr(pyr[q], levels);
+        else if (q > p) delete base[q];
+      return 1;
+    }
+  }
 
+  double a[4] = { 0.0, 1.0, 0.0, 1.0 };
+  FlowStats stats;
+  solveTiled(pyr[0], pyr[1], pyr[2], levels, a, memoryBytes / 4, opts, pool,
+      &stats);
+  size_t peakTileBytes = cache.getPeakBytes();
+  for (int p = 0; p < 3; ++p)
+    freeTiledPyr(pyr[p], levels);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  double peakRss = usage.ru_maxrss / 1048576.0;
+#else
+  double peakRss = usage.ru_maxrss / 1024.0;
 #endif
+  printf("%d levels, %d iterations, residual %g%s, %.2fs\n", stats.levels,
+      stats.iterations, stats.residual, stats.converged ? ", converged" : "",
+      now() - start);
+  printf("peak tiles %.1f MB, peak RSS %.1f MB\n",
+      peakTileBytes / 1048576.0, peakRss);
+  printf("rect = (%.4f, %.4f, %.4f, %.4f)\n", a[0], a[1], a[2], a[3]);
+  return 0;
+}
 
-  ImageCollection docIcons = loadImageSource(argv[1]);
-  ImageCollection appIcons = loadImageSource(argv[2]);
+// --dense: a flow vector (u, v) for every pixel, so that pixel (x, y) of the
+// first image is at (x + u, y + v) in the second one, e.g. for following
+// what moves between two frames of a screen capture. Lucas-Kanade runs in a
+// window around every pixel, coarse to fine. Window sums are made of running
+// sums, so the cost per pixel doesn't depend on the window size.
 
-  int numDocs = getImageCount(docIcons);
-  int numApps = getImageCount(appIcons);
-  if (numDocs != numApps)
-    printf("Image counts do not match (%d != %d)\n", numDocs, numApps);
+struct DenseOptions {
+  int window;       // side of the square window around each pixel, odd
+  int iters;        // iterations per pyramid level
+  int minSize;      // the coarsest level is at least this wide and high
+  double minEigen;  // pixels whose structure tensor's smaller eigenvalue
+                    // (per window pixel) is below this keep their flow
 
-  std::map<int, std::vector<double> > foundRects;
-  for (int docIndex = 0, appIndex = 0;
-      docIndex < numDocs && appIndex < numApps;) {
-
-
-    bool downsampleAppIcon = false;
-
-    // We assume that sizes get smaller with larger indices (which is true
-    // for most icns files: they contain all truecolor variants in falling
-    // sizes, sometimes followed by low-color larger icons). Good enough,
-    // I only care about truecolor icons.
-    if (getWidth(docIcons, docIndex) < getWidth(appIcons, appIndex)) {
-      ++appIndex; continue;
-    } else if (getWidth(docIcons, docIndex) > getWidth(appIcons, appIndex)) {
-      if (2*getWidth(docIcons, docIndex) == getWidth(appIcons, appIndex - 1)
-          && appIndex > 0) {
-        // if the docicon has a 256x256 icon, but the app icon has only
-        // 512x512 and 128x128, use downsampled 512 variant for detection
-        downsampleAppIcon = true;
-      } else {
-        ++docIndex; continue;
+  DenseOptions() : window(15), iters(2), minSize(32), minEigen(1e-5) {}
+};
+
+const int kDenseBand = 32;  // rows per parallelFor() job
+
+// Sums the nc (at most 3) channels of a row over windows of 2r + 1 pixels,
+// repeating the border.
+void boxRow(double* dst, const double* src, int w, int nc, int r) {
+  double sum[3] = { 0.0, 0.0, 0.0 };
+  for (int k = -r; k <= r; ++k)
+    for (int c = 0; c < nc; ++c)
+      sum[c] += src[clamp(k, 0, w - 1)*nc + c];
+  for (int x = 0; x < w; ++x) {
+    const double* add = src + std::min(x + r + 1, w - 1)*nc;
+    const double* sub = src + std::max(x - r, 0)*nc;
+    for (int c = 0; c < nc; ++c) {
+      dst[x*nc + c] = sum[c];
+      sum[c] += add[c] - sub[c];
+    }
+  }
+}
+
+// Sums rows [y0, y1) of src over windows of 2r + 1 rows into dst (which
+// starts at row y0), repeating the border. With boxRow() on src's rows, that
+// sums src over (2r + 1) x (2r + 1) windows.
+void boxColumns(double* dst, const double* src, int w, int h, int nc, int r,
+    int y0, int y1) {
+  int n = w * nc;
+  std::vector<double> sum(n, 0.0);
+  for (int k = -r; k <= r; ++k) {
+    const double* row = src + clamp(y0 + k, 0, h - 1)*n;
+    for (int i = 0; i < n; ++i)
+      sum[i] += row[i];
+  }
+  for (int y = y0; y < y1; ++y) {
+    double* dstRow = dst + (y - y0)*n;
+    for (int i = 0; i < n; ++i)
+      dstRow[i] = sum[i];
+    if (y + 1 == y1) break;
+    const double* add = src + clamp(y + r + 1, 0, h - 1)*n;
+    const double* sub = src + clamp(y - r, 0, h - 1)*n;
+    for (int i = 0; i < n; ++i)
+      sum[i] += add[i] - sub[i];
+  }
+}
+
+// One pyramid level of denseFlow(). The passes run in bands of kDenseBand
+// rows. The images are allocated for the finest level, coarser levels use
+// their beginning.
+struct DenseLevel {
+  int w, h, r;
+  const double* i0;
+  const double* i1;
+  double minEigen;
+  Img b0, b1;    // i0 and i1 blurred like calcDt() does
+  Img ix, iy;    // gradient of i0
+  Img inverse;   // inverse of the window's structure tensor, 3 values
+  Img sums;      // window sums along rows, 3 or 2 channels
+  double* flow;  // u, v
+};
+
+// Computes rows of b0, b1, ix and iy. The 3x3 filters of calcDt(), calcDx()
+// and calcDy() are separable, so they are applied as a vertical and then a
+// horizontal 3 tap filter, which is much faster at these sizes.
+void denseGradientBand(void* arg, int band) {
+  DenseLevel& l = *(DenseLevel*)arg;
+  int w = l.w, h = l.h;
+  double fd[] = { -0.5, 0, 0.5 };
+  double fs[3]; gauss(fs, 3, 1, 0.8);  // smoothing across the derivative
+  double fb[3]; gauss(fb, 3, 1, 1.0);  // blur of calcDt()
+  std::vector<double> cols(w * 4);  // vertically filtered rows
+  double* smooth = &cols[0];
+  double* deriv = smooth + w;
+  double* blur0 = deriv + w;
+  double* blur1 = blur0 + w;
+  for (int y = band * kDenseBand; y < std::min((band + 1) * kDenseBand, h);
+      ++y) {
+    const double* r0[3];
+    const double* r1[3];
+    for (int k = 0; k < 3; ++k) {
+      r0[k] = l.i0 + clamp(y + k - 1, 0, h - 1)*w;
+      r1[k] = l.i1 + clamp(y + k - 1, 0, h - 1)*w;
+    }
+    for (int x = 0; x < w; ++x) {
+      smooth[x] = fs[0]*r0[0][x] + fs[1]*r0[1][x] + fs[2]*r0[2][x];
+      deriv[x] = fd[0]*r0[0][x] + fd[2]*r0[2][x];
+      blur0[x] = fb[0]*r0[0][x] + fb[1]*r0[1][x] + fb[2]*r0[2][x];
+      blur1[x] = fb[0]*r1[0][x] + fb[1]*r1[1][x] + fb[2]*r1[2][x];
+    }
+    double* ix = l.ix.pix + y*w;
+    double* iy = l.iy.pix + y*w;
+    double* b0 = l.b0.pix + y*w;
+    double* b1 = l.b1.pix + y*w;
+    for (int x = 0; x < w; ++x) {
+      int xm = std::max(x - 1, 0), xp = std::min(x + 1, w - 1);
+      ix[x] = fd[0]*smooth[xm] + fd[2]*smooth[xp];
+      iy[x] = fs[0]*deriv[xm] + fs[1]*deriv[x] + fs[2]*deriv[xp];
+      b0[x] = fb[0]*blur0[xm] + fb[1]*blur0[x] + fb[2]*blur0[xp];
+      b1[x] = fb[0]*blur1[xm] + fb[1]*blur1[x] + fb[2]*blur1[xp];
+    }
+  }
+}
+
+void denseTensorRowsBand(void* arg, int band) {
+  DenseLevel& l = *(DenseLevel*)arg;
+  int w = l.w;
+  std::vector<double> products(w * 3);
+  for (int y = band * kDenseBand; y < std::min((band + 1) * kDenseBand, l.h);
+      ++y) {
+    const double* ix = l.ix.pix + y*w;
+    const double* iy = l.iy.pix + y*w;
+    for (int x = 0; x < w; ++x) {
+      products[x*3 + 0] = ix[x] * ix[x];
+      products[x*3 + 1] = ix[x] * iy[x];
+      products[x*3 + 2] = iy[x] * iy[x];
+    }
+    boxRow(l.sums.pix + y*w*3, &products[0], w, 3, l.r);
+  }
+}
+
+// Sums the tensor over windows and inverts it. Pixels without enough
+// structure get a 0 inverse, and their flow isn't changed.
+void denseTensorColumnsBand(void* arg, int band) {
+  DenseLevel& l = *(DenseLevel*)arg;
+  int w = l.w;
+  int y0 = band * kDenseBand, y1 = std::min(y0 + kDenseBand, l.h);
+  double* inverse = l.inverse.pix + y0*w*3;
+  boxColumns(inverse, l.sums.pix, w, l.h, 3, l.r, y0, y1);
+  double minEigen = l.minEigen * (2*l.r + 1) * (2*l.r + 1);
+  for (int i = 0; i < (y1 - y0) * w; ++i) {
+    double* t = inverse + i*3;
+    double a = t[0], b = t[1], c = t[2];
+    double mean = 0.5 * (a + c);
+    double d = sqrt(0.25 * (a - c)*(a - c) + b*b);
+    double det = a*c - b*b;
+    if (mean - d < minEigen || det <= 0.0) {
+      t[0] = t[1] = t[2] = 0.0;
+    } else {
+      t[0] = c / det;
+      t[1] = -b / det;
+      t[2] = a / det;
+    }
+  }
+}
+
+// Warps the rows of b1 with the flow and sums grad (grad . flow - dt) along
+// rows, where dt is the difference to b0 and grad the gradient of i0.
+//
+// Lucas-Kanade for pixel p needs the differences of its window's pixels q
+// when they are moved by p's flow u_p, but the running sums can only warp
+// each pixel by its own flow u_q. To first order, the difference at u_p is
+// dt_q + grad_q . (u_p - u_q), and with that, p's next flow is the inverse
+// tensor times the window sum of grad_q (grad_q . u_q - dt_q).
+void denseResidualRowsBand(void* arg, int band) {
+  DenseLevel& l = *(DenseLevel*)arg;
+  int w = l.w, h = l.h;
+  std::vector<double> products(w * 2);
+  for (int y = band * kDenseBand; y < std::min((band + 1) * kDenseBand, h);
+      ++y) {
+    const double* flow = l.flow + y*w*2;
+    const double* b0 = l.b0.pix + y*w;
+    const double* ix = l.ix.pix + y*w;
+    const double* iy = l.iy.pix + y*w;
+    for (int x = 0; x < w; ++x) {
+      double sx = clamp(x + flow[x*2], 0.0, w - 1.0);
+      double sy = clamp(y + flow[x*2 + 1], 0.0, h - 1.0);
+      double dt = sample(l.b1.pix, w, h, 1, sx, sy, 0) - b0[x];
+      double d = ix[x]*flow[x*2] + iy[x]*flow[x*2 + 1] - dt;
+      products[x*2 + 0] = ix[x] * d;
+      products[x*2 + 1] = iy[x] * d;
+    }
+    boxRow(l.sums.pix + y*w*2, &products[0], w, 2, l.r);
+  }
+}
+
+// Finishes the window sums and solves for the flow.
+void denseUpdateBand(void* arg, int band) {
+  DenseLevel& l = *(DenseLevel*)arg;
+  int w = l.w;
+  int y0 = band * kDenseBand, y1 = std::min(y0 + kDenseBand, l.h);
+  std::vector<double> rhs((y1 - y0) * w * 2);
+  boxColumns(&rhs[0], l.sums.pix, w, l.h, 2, l.r, y0, y1);
+  const double* inverse = l.inverse.pix + y0*w*3;
+  double* flow = l.flow + y0*w*2;
+  for (int i = 0; i < (y1 - y0) * w; ++i) {
+    const double* t = inverse + i*3;
+    if (t[0] == 0.0) continue;
+    double bx = rhs[i*2], by = rhs[i*2 + 1];
+    flow[i*2 + 0] = t[0]*bx + t[1]*by;
+    flow[i*2 + 1] = t[1]*bx + t[2]*by;
+  }
+}
+
+// Number of pyramid levels for dense flow on a w x h image.
+int denseLevelsFor(int w, int h, int minSize) {
+  int levels = 1;
+  while (std::min(w, h) >> levels >= std::max(minSize, 1) && levels < 16)
+    ++levels;
+  return levels;
+}
+
+// Upsamples the flow of a coarser level to the next level and scales its
+// vectors.
+struct DenseUpsample {
+  const double* src;
+  int sw, sh;
+  double* dst;
+  int dw, dh;
+};
+
+void denseUpsampleBand(void* arg, int band) {
+  DenseUpsample& u = *(DenseUpsample*)arg;
+  double rx = u.sw / (double)u.dw, ry = u.sh / (double)u.dh;
+  for (int y = band * kDenseBand; y < std::min((band + 1) * kDenseBand, u.dh);
+      ++y) {
+    double sy = clamp((y + 0.5) * ry - 0.5, 0.0, u.sh - 1.0);
+    double* dst = u.dst + y*u.dw*2;
+    for (int x = 0; x < u.dw; ++x) {
+      double sx = clamp((x + 0.5) * rx - 0.5, 0.0, u.sw - 1.0);
+      dst[x*2 + 0] = sample(u.src, u.sw, u.sh, 2, sx, sy, 0) / rx;
+      dst[x*2 + 1] = sample(u.src, u.sw, u.sh, 2, sx, sy, 1) / ry;
+    }
+  }
+}
+
+struct DensePyramids {
+  const double* src[2];
+  int w, h, levels;
+  Pyramid* pyr[2];
+};
+
+void densePyramid(void* arg, int i) {
+  DensePyramids& p = *(DensePyramids*)arg;
+  p.pyr[i] = new Pyramid(ImageView(p.src[i], p.w, p.h), 0.8, p.levels);
+  (*p.pyr[i])[p.levels - 1];  // all levels are used, build them here
+}
+
+// Finds the flow from i0 to i1, two gray w x h images, into flow (w x h, 2
+// channels). If flow already has that size, it's the start estimate,
+// otherwise the flow starts at 0.
+void denseFlow(const double* i0, const double* i1, int w, int h, Img& flow,
+    const DenseOptions& opts, ThreadPool& pool) {
+  PROFILE_SCOPE("denseFlow");
+  int levels = denseLevelsFor(w, h, opts.minSize);
+  DensePyramids pyramids = { { i0, i1 }, w, h, levels, { NULL, NULL } };
+  pool.parallelFor(2, densePyramid, &pyramids);
+  Pyramid& pyr0 = *pyramids.pyr[0];
+  Pyramid& pyr1 = *pyramids.pyr[1];
+
+  DenseLevel l;
+  l.r = std::max(opts.window / 2, 1);
+  l.minEigen = opts.minEigen;
+  l.b0.setSize(w, h);
+  l.b1.setSize(w, h);
+  l.ix.setSize(w, h);
+  l.iy.setSize(w, h);
+  l.inverse.setSize(w, h, 3);
+  l.sums.setSize(w, h, 3);
+
+  // The flow of a level is in flow or in other, the other one is where the
+  // next level's flow is upsampled to.
+  bool start = flow.w == w && flow.h == h && flow.c == 2;
+  if (!start) flow.setSize(w, h, 2);
+  Img other(w, h, 2);
+  int fw = pyr0.width(levels - 1), fh = pyr0.height(levels - 1);
+  double* cur = other.pix;
+  if (start) {
+    // Bring the start estimate down to the coarsest level.
+    resample(ImageView(cur, fw, fh, 2), flow);
+    for (int i = 0; i < fw * fh; ++i) {
+      cur[i*2 + 0] *= fw / (double)w;
+      cur[i*2 + 1] *= fh / (double)h;
+    }
+  } else {
+    memset(cur, 0, fw * fh * 2 * sizeof(double));
+  }
+
+  for (int i = levels - 1; i >= 0; --i) {
+    PROFILE_SET_LEVEL(i);
+    l.w = pyr0[i]->w;
+    l.h = pyr0[i]->h;
+    l.i0 = pyr0[i]->pix;
+    l.i1 = pyr1[i]->pix;
+
+    int bands = (l.h + kDenseBand - 1) / kDenseBand;
+    if (fw != l.w || fh != l.h) {
+      DenseUpsample up = { cur, fw, fh, cur == flow.pix ? other.pix : flow.pix,
+          l.w, l.h };
+      pool.parallelFor(bands, denseUpsampleBand, &up);
+      cur = up.dst;
+      fw = l.w;
+      fh = l.h;
+    }
+    l.flow = cur;
+    {
+      PROFILE_SCOPE("denseTensor");
+      pool.parallelFor(bands, denseGradientBand, &l);
+      pool.parallelFor(bands, denseTensorRowsBand, &l);
+      pool.parallelFor(bands, denseTensorColumnsBand, &l);
+    }
+    for (int k = 0; k < opts.iters; ++k) {
+      PROFILE_SCOPE("denseIteration");
+      PROFILE_COUNT("iterations", 1);
+      pool.parallelFor(bands, denseResidualRowsBand, &l);
+      pool.parallelFor(bands, denseUpdateBand, &l);
+    }
+  }
+
+  delete pyramids.pyr[0];
+  delete pyramids.pyr[1];
+  if (cur != flow.pix)
+    memcpy(flow.pix, cur, w * h * 2 * sizeof(double));
+}
+
+// Writes a flow field (2 channels) in the Middlebury .flo format that most
+// optical flow tools read: "PIEH", width and height as 32-bit integers, then
+// u and v of every pixel as 32-bit floats, everything little-endian.
+bool writeFlo(const char* path, const Img& flow) {
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+  std::vector<unsigned char> buf;
+  buf.reserve(12 + (size_t)flow.w * flow.h * 8);
+  const char magic[] = "PIEH";
+  buf.insert(buf.end(), magic, magic + 4);
+  unsigned int header[] = { (unsigned int)flow.w, (unsigned int)flow.h };
+  for (int i = 0; i < 2; ++i)
+    for (int b = 0; b < 4; ++b)
+      buf.push_back((header[i] >> (8 * b)) & 0xff);
+  for (int i = 0; i < flow.w * flow.h * 2; ++i) {
+    float v = (float)flow.pix[i];
+    unsigned int bits;
+    memcpy(&bits, &v, 4);
+    for (int b = 0; b < 4; ++b)
+      buf.push_back((bits >> (8 * b)) & 0xff);
+  }
+  bool ok = fwrite(&buf[0], 1, buf.size(), f) == buf.size();
+  return fclose(f) == 0 && ok;
+}
+
+// The --dense mode: writes the flow from the first to the second PGM/PPM
+// image (in gray) to outPath as a .flo file.
+int denseFlowFiles(const char* path0, const char* path1, const char* outPath,
+    const DenseOptions& opts, int numThreads) {
+  double start = now();
+  Img i0, i1;
+  std::string error;
+  if (!readPnm(path0, i0, &error) || !readPnm(path1, i1, &error)) {
+    printf("%s, exiting.\n", error.c_str());
+    return 1;
+  }
+  if (i0.w != i1.w || i0.h != i1.h) {
+    printf("%s doesn't have the size of %s, exiting.\n", path1, path0);
+    return 1;
+  }
+  double read = now();
+
+  ThreadPool pool(numThreads);
+  Img flow;
+  denseFlow(i0.pix, i1.pix, i0.w, i0.h, flow, opts, pool);
+  double solved = now();
+
+  double sum = 0.0, maxLength = 0.0;
+  for (int i = 0; i < flow.w * flow.h; ++i) {
+    double length = hypot(flow.pix[i*2], flow.pix[i*2 + 1]);
+    sum += length;
+    maxLength = std::max(maxLength, length);
+  }
+  printf("%dx%d, %d levels, read in %.3fs, solved in %.3fs\n", i0.w, i0.h,
+      denseLevelsFor(i0.w, i0.h, opts.minSize), read - start, solved - read);
+  printf("mean flow %.3f px, max %.3f px\n", sum / (flow.w * flow.h),
+      maxLength);
+  if (!writeFlo(outPath, flow)) {
+    printf("Failed to write %s\n", outPath);
+    return 1;
+  }
+  return 0;
+}
+
+// --track: follows a few hundred points from one image to the next (Kanade-
+// Lucas-Tomasi). Points are picked where the structure tensor's smaller
+// eigenvalue is large (Shi-Tomasi corners), so that they can be located in
+// both directions. Each point is then tracked coarse to fine with a 2x2
+// solve per iteration that only samples the pixels of its own window, so
+// tracking costs per point, not per pixel.
+
+struct TrackOptions {
+  int maxFeatures;
+  int block;          // side of the window the corner score sums over
+  double quality;     // weakest corner score, relative to the strongest
+  int minDistance;    // between two picked corners, in pixels
+  int window;         // side of the window a point is tracked with, odd
+  int iters;          // iterations per pyramid level at most
+  double eps;         // stop iterating when the update is shorter, in px
+  double minEigen;    // lose points with less structure (per window pixel)
+  double maxResidual; // lose points whose window differs more (mean abs)
+  int levels;         // pyramid levels at most; the window has to stay small
+                      // against the coarsest level
+  int minSize;        // the coarsest level is at least this wide and high
+
+  TrackOptions() : maxFeatures(500), block(7), quality(0.01), minDistance(10),
+      window(15), iters(20), eps(0.01), minEigen(1e-5), maxResidual(0.02),
+      levels(4), minSize(32) {}
+};
+
+struct Feature {
+  double x, y;    // in the first image
+  double score;   // corner score
+  double u, v;    // flow to the second image
+  double residual;
+  bool tracked;
+};
+
+// Shi-Tomasi corner score of every pixel of a DenseLevel, after
+// denseGradientBand() and denseTensorRowsBand().
+struct CornerScores {
+  DenseLevel* level;
+  Img score;
+};
+
+void cornerScoreBand(void* arg, int band) {
+  CornerScores& c = *(CornerScores*)arg;
+  const DenseLevel& l = *c.level;
+  int w = l.w;
+  int y0 = band * kDenseBand, y1 = std::min(y0 + kDenseBand, l.h);
+  std::vector<double> sums((y1 - y0) * w * 3);
+  boxColumns(&sums[0], l.sums.pix, w, l.h, 3, l.r, y0, y1);
+  double area = (2*l.r + 1) * (2*l.r + 1);
+  for (int i = 0; i < (y1 - y0) * w; ++i) {
+    const double* t = &sums[i*3];
+    double d = sqrt(0.25 * (t[0] - t[2])*(t[0] - t[2]) + t[1]*t[1]);
+    c.score.pix[y0*w + i] = (0.5 * (t[0] + t[2]) - d) / area;
+  }
+}
+
+bool featureScoreGreater(const Feature& a, const Feature& b) {
+  return a.score > b.score;
+}
+
+// Picks up to opts.maxFeatures corners of the w x h gray image i0: local
+// maxima of the corner score that are at least opts.quality times the best
+// one, strongest first, at least opts.minDistance apart.
+void findCorners(const double* i0, int w, int h, const TrackOptions& opts,
+    ThreadPool& pool, std::vector<Feature>& features) {
+  PROFILE_SCOPE("findCorners");
+  DenseLevel l;
+  l.w = w;
+  l.h = h;
+  l.r = std::max(opts.block / 2, 1);
+  l.i0 = l.i1 = i0;
+  l.b0.setSize(w, h);
+  l.b1.setSize(w, h);
+  l.ix.setSize(w, h);
+  l.iy.setSize(w, h);
+  l.sums.setSize(w, h, 3);
+  CornerScores c;
+  c.level = &l;
+  c.score.setSize(w, h);
+  int bands = (h + kDenseBand - 1) / kDenseBand;
+  pool.parallelFor(bands, denseGradientBand, &l);
+  pool.parallelFor(bands, denseTensorRowsBand, &l);
+  pool.parallelFor(bands, cornerScoreBand, &c);
+
+  const double* score = c.score.pix;
+  double best = 0.0;
+  for (int i = 0; i < w * h; ++i)
+    best = std::max(best, score[i]);
+  double threshold = std::max(opts.quality * best, opts.minEigen);
+
+  // Candidates are 3x3 local maxima away from the border.
+  std::vector<Feature> candidates;
+  int border = std::max(opts.window / 2, 1);
+  for (int y = border; y < h - border; ++y) {
+    for (int x = border; x < w - border; ++x) {
+      double s = score[y*w + x];
+      if (s < threshold) continue;
+      bool max = true;
+      for (int dy = -1; dy <= 1 && max; ++dy)
+        for (int dx = -1; dx <= 1 && max; ++dx)
+          max = score[(y + dy)*w + x + dx] <= s;
+      if (!max) continue;
+      Feature f = { (double)x, (double)y, s, 0.0, 0.0, 0.0, false };
+      candidates.push_back(f);
+    }
+  }
+  std::stable_sort(candidates.begin(), candidates.end(), featureScoreGreater);
+
+  // Picked corners by grid cell of minDistance pixels.
+  int cell = std::max(opts.minDistance, 1);
+  int gw = (w + cell - 1) / cell, gh = (h + cell - 1) / cell;
+  std::vector<std::vector<int> > grid(gw * gh);
+  features.clear();
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if ((int)features.size() >= opts.maxFeatures) break;
+    const Feature& f = candidates[i];
+    int gx = (int)f.x / cell, gy = (int)f.y / cell;
+    bool far = true;
+    for (int y = std::max(gy - 1, 0); y <= std::min(gy + 1, gh - 1); ++y) {
+      for (int x = std::max(gx - 1, 0); x <= std::min(gx + 1, gw - 1); ++x) {
+        const std::vector<int>& picked = grid[y*gw + x];
+        for (size_t j = 0; j < picked.size() && far; ++j) {
+          const Feature& p = features[picked[j]];
+          far = hypot(p.x - f.x, p.y - f.y) >= opts.minDistance;
+        }
       }
     }
+    if (!far) continue;
+    grid[gy*gw + gx].push_back(features.size());
+    features.push_back(f);
+  }
+}
+
+const int kTrackBatch = 16;  // features per parallelFor() job
+
+struct TrackJob {
+  const Pyramid* pyr0;
+  const Pyramid* pyr1;
+  int levels;
+  std::vector<Feature>* features;
+  const TrackOptions* opts;
+};
+
+// Tracks one feature through all levels. patch, dx and dy hold the window
+// of i0 around the feature plus a border of one pixel for calcDx() and
+// calcDy().
+void trackFeature(const TrackJob& job, Feature& f, Img& patch, Img& dx,
+    Img& dy) {
+  const TrackOptions& opts = *job.opts;
+  const Pyramid& pyr0 = *job.pyr0;
+  const Pyramid& pyr1 = *job.pyr1;
+  int r = std::max(opts.window / 2, 1);
+  int pw = 2*r + 3;
+  double area = (2*r + 1) * (2*r + 1);
+  int w0 = pyr0[0]->w, h0 = pyr0[0]->h;
+  double u = 0.0, v = 0.0;  // flow at the current level
+  f.tracked = true;
+
+  for (int i = job.levels - 1; i >= 0 && f.tracked; --i) {
+    const Img& i0 = *pyr0[i];
+    const Img& i1 = *pyr1[i];
+    double sx = i0.w / (double)w0, sy = i0.h / (double)h0;
+    double x = (f.x + 0.5) * sx - 0.5, y = (f.y + 0.5) * sy - 0.5;
+    if (i < job.levels - 1) {
+      u *= i0.w / (double)pyr0.width(i + 1);
+      v *= i0.h / (double)pyr0.height(i + 1);
+    }
 
-    if (
-        // flow can only deal with power-of-two images (wouldn't take too much
-        // work, but I'm too lazy).
-        getWidth(docIcons, docIndex) == 48
+    for (int py = 0; py < pw; ++py)
+      for (int px = 0; px < pw; ++px)
+        patch.pix[py*pw + px] = sample(i0.pix, i0.w, i0.h, 1,
+            clamp(x + px - r - 1, 0.0, i0.w - 1.0),
+            clamp(y + py - r - 1, 0.0, i0.h - 1.0), 0);
+    calcDx(dx, patch);
+    calcDy(dy, patch);
+
+    double g[3] = { 0.0, 0.0, 0.0 };
+    for (int py = 1; py < pw - 1; ++py) {
+      for (int px = 1; px < pw - 1; ++px) {
+        double gx = dx.pix[py*pw + px], gy = dy.pix[py*pw + px];
+        g[0] += gx*gx;
+        g[1] += gx*gy;
+        g[2] += gy*gy;
+      }
+    }
+    double det = g[0]*g[2] - g[1]*g[1];
+    double d = sqrt(0.25 * (g[0] - g[2])*(g[0] - g[2]) + g[1]*g[1]);
+    if ((0.5 * (g[0] + g[2]) - d) / area < opts.minEigen || det <= 0.0) {
+      f.tracked = false;
+      break;
+    }
 
-        // The 1-bit variants are useless, the indexed variants not interesting.
-        || !trueColor(docIcons, docIndex) || !trueColor(appIcons, appIndex)
-       ) {
-      printf("Skipping doc variant %d, app variant %d\n", docIndex, appIndex);
-      ++appIndex; ++docIndex; continue;
+    double residual = 0.0;
+    for (int k = 0; k < opts.iters; ++k) {
+      PROFILE_COUNT("trackIterations", 1);
+      double b[2] = { 0.0, 0.0 };
+      residual = 0.0;
+      for (int py = 1; py < pw - 1; ++py) {
+        for (int px = 1; px < pw - 1; ++px) {
+          double wx = clamp(x + u + px - r - 1, 0.0, i1.w - 1.0);
+          double wy = clamp(y + v + py - r - 1, 0.0, i1.h - 1.0);
+          double dt = sample(i1.pix, i1.w, i1.h, 1, wx, wy, 0)
+              - patch.pix[py*pw + px];
+          b[0] += dx.pix[py*pw + px] * dt;
+          b[1] += dy.pix[py*pw + px] * dt;
+          residual += fabs(dt);
+        }
+      }
+      double du = -(g[2]*b[0] - g[1]*b[1]) / det;
+      double dv = -(g[0]*b[1] - g[1]*b[0]) / det;
+      u += du;
+      v += dv;
+      if (du*du + dv*dv < opts.eps*opts.eps) break;
     }
+    f.residual = residual / area;
 
+    double tx = x + u, ty = y + v;
+    if (tx < 0.0 || ty < 0.0 || tx > i0.w - 1.0 || ty > i0.h - 1.0)
+      f.tracked = false;
+  }
 
+  f.u = u;
+  f.v = v;
+  if (f.tracked && f.residual > opts.maxResidual)
+    f.tracked = false;
+}
 
-    printf("Collection index %d\n", docIndex);
+void trackBatch(void* arg, int batch) {
+  const TrackJob& job = *(TrackJob*)arg;
+  std::vector<Feature>& features = *job.features;
+  int pw = 2 * std::max(job.opts->window / 2, 1) + 3;
+  Img patch(pw, pw), dx(pw, pw), dy(pw, pw);
+  int end = std::min((batch + 1) * kTrackBatch, (int)features.size());
+  for (int i = batch * kTrackBatch; i < end; ++i)
+    trackFeature(job, features[i], patch, dx, dy);
+}
 
-    Img docIcon, appIcon, appIconMask;
+// Tracks features from the image of pyr0 to the image of pyr1, in parallel
+// batches of kTrackBatch.
+void trackFeatures(const Pyramid& pyr0, const Pyramid& pyr1, int levels,
+    std::vector<Feature>& features, const TrackOptions& opts,
+    ThreadPool& pool) {
+  PROFILE_SCOPE("trackFeatures");
+  TrackJob job = { &pyr0, &pyr1, levels, &features, &opts };
+  pool.parallelFor((features.size() + kTrackBatch - 1) / kTrackBatch,
+      trackBatch, &job);
+}
 
-    if (!imageFromSource(docIcons, docIndex, docIcon)) {
-      printf("Failed to load %d %s, exiting.\n", docIndex, argv[1]);
-      return -1;
+// The --track mode: picks corners in the first PGM/PPM image, tracks them to
+// the second and writes one line per corner to outPath (or stdout):
+//   x y u v residual tracked
+int trackFiles(const char* path0, const char* path1, const char* outPath,
+    const TrackOptions& opts, int numThreads) {
+  double start = now();
+  Img i0, i1;
+  std::string error;
+  if (!readPnm(path0, i0, &error) || !readPnm(path1, i1, &error)) {
+    printf("%s, exiting.\n", error.c_str());
+    return 1;
+  }
+  if (i0.w != i1.w || i0.h != i1.h) {
+    printf("%s doesn't have the size of %s, exiting.\n", path1, path0);
+    return 1;
+  }
+  double read = now();
+
+  ThreadPool pool(numThreads);
+  std::vector<Feature> features;
+  findCorners(i0.pix, i0.w, i0.h, opts, pool, features);
+  double found = now();
+
+  int levels = std::min(denseLevelsFor(i0.w, i0.h, opts.minSize),
+      std::max(opts.levels, 1));
+  DensePyramids pyramids = { { i0.pix, i1.pix }, i0.w, i0.h, levels,
+      { NULL, NULL } };
+  pool.parallelFor(2, densePyramid, &pyramids);
+  double built = now();
+  trackFeatures(*pyramids.pyr[0], *pyramids.pyr[1], levels, features, opts,
+      pool);
+  double tracked = now();
+  delete pyramids.pyr[0];
+  delete pyramids.pyr[1];
+
+  int numTracked = 0;
+  for (size_t i = 0; i < features.size(); ++i)
+    numTracked += features[i].tracked;
+  // On stderr, so that it doesn't get mixed up with the tracks on stdout.
+  fprintf(stderr, "%dx%d, read in %.3fs, %d corners in %.3fs, pyramids in "
+      "%.3fs, %d tracked in %.3fs\n", i0.w, i0.h, read - start,
+      (int)features.size(), found - read, built - found, numTracked,
+      tracked - built);
+
+  FILE* out = outPath ? fopen(outPath, "w") : stdout;
+  if (!out) {
+    printf("Failed to write %s\n", outPath);
+    return 1;
+  }
+  for (size_t i = 0; i < features.size(); ++i) {
+    const Feature& f = features[i];
+    fprintf(out, "%.0f %.0f %.3f %.3f %.4f %d\n", f.x, f.y, f.u, f.v,
+        f.residual, f.tracked ? 1 : 0);
+  }
+  if (outPath && fclose(out) != 0) {
+    printf("Failed to write %s\n", outPath);
+    return 1;
+  }
+  return 0;
+}
+
+// --sequence: aligns every frame of a sequence (a screen recording, the
+// frames of an animated icon) to the one before it, with the transform
+// pyramidFlow() solves for, and accumulates those into the transform from
+// the first frame. Each frame's pyramid is built once and used for both pairs
+// it is in, and each pair starts from the motion of the pair before, so that
+// only the finest levels need to be refined.
+
+struct SequenceOptions {
+  // Pairs after the first one refine this many of the finest levels,
+  // |warmIters| iterations each, starting from the motion of the pair before.
+  int warmLevels;
+  int warmIters;
+
+  // Scales outside [1 / maxScale, maxScale] mean the solve went wrong; the
+  // next pair is solved from the identity on all levels then.
+  double maxScale;
+
+  SequenceOptions() : warmLevels(3), warmIters(15), maxScale(2.0) {}
+};
+
+// Reads the frames of a sequence: the binary PGM/PPM files in a directory, in
+// the order of their names, or frames of w x h 8-bit gray pixels from stdin.
+class FrameReader {
+ public:
+  FrameReader() : index(0), in(NULL), rawW(0), rawH(0) {}
+
+  bool openDirectory(const char* path, std::string* error) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+      *error = strprintf("Failed to open %s", path);
+      return false;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      size_t dot = name.rfind('.');
+      std::string ext = dot == std::string::npos ? "" : name.substr(dot);
+      if (ext == ".pgm" || ext == ".ppm" || ext == ".pnm")
+        paths.push_back(std::string(path) + "/" + name);
     }
+    closedir(dir);
+    std::sort(paths.begin(), paths.end());
+    return true;
+  }
+
+  void openRaw(FILE* f, int w, int h) {
+    in = f;
+    rawW = w;
+    rawH = h;
+    row.resize(w);
+  }
 
-    if (!downsampleAppIcon) {
-      if (!imageFromSource(appIcons, appIndex, appIcon, &appIconMask)) {
-        printf("Failed to load %d %s, exiting.\n", appIndex, argv[2]);
-        return -1;
+  // Reads the next frame into frame. Returns false at the end (error empty)
+  // or on errors.
+  bool next(Img& frame, std::string* error) {
+    PROFILE_SCOPE("readFrame");
+    error->clear();
+    if (!in) {
+      if (index >= paths.size()) return false;
+      return readPnm(paths[index++].c_str(), frame, error);
+    }
+    frame.setSize(rawW, rawH);
+    for (int y = 0; y < rawH; ++y) {
+      size_t n = fread(&row[0], 1, rawW, in);
+      if (n == 0 && y == 0) return false;
+      if (n != (size_t)rawW) {
+        *error = strprintf("Frame %d is truncated", (int)index);
+        return false;
       }
+      pnmToGray(frame.pix + (size_t)y * rawW, &row[0], rawW, 1, 255);
+    }
+    ++index;
+    return true;
+  }
+
+ private:
+  std::vector<std::string> paths;
+  size_t index;
+  FILE* in;
+  int rawW, rawH;
+  std::vector<unsigned char> row;
+};
+
+// Makes total, which maps frame 0 to frame t, map frame 0 to frame t + 1,
+// given the transform a from frame t to frame t + 1.
+void composeParams(double* total, const double* a) {
+  total[0] = a[0] + a[1] * total[0];
+  total[1] *= a[1];
+  total[2] = a[2] + a[3] * total[2];
+  total[3] *= a[3];
+}
+
+// The --sequence mode: reads frames from dirPath, or raw frames of w x h
+// from stdin if dirPath is "-", and prints a line per frame as soon as it's
+// solved:
+//   frame  transform from the frame before (4 numbers)  from frame 0 (4)
+//   iterations
+// A transform a maps (x, y) to (a[0] + a[1] x, a[2] + a[3] y), in pixels from
+// the image center, like pyramidFlow().
+int alignSequence(const char* dirPath, int w, int h, FlowOptions opts,
+    const SequenceOptions& seq) {
+  double start = now();
+  FrameReader reader;
+  std::string error;
+  if (strcmp(dirPath, "-") == 0)
+    reader.openRaw(stdin, w, h);
+  else if (!reader.openDirectory(dirPath, &error)) {
+    printf("%s, exiting.\n", error.c_str());
+    return 1;
+  }
+
+  Img frame;
+  if (!reader.next(frame, &error)) {
+    printf("%s, exiting.\n", error.empty() ? "No frames" : error.c_str());
+    return 1;
+  }
+  w = frame.w;
+  h = frame.h;
+  double step = opts.pyramidStep;
+  int levels = levelsFor(std::min(w, h), step);
+  Img ones(w, h);
+  for (int i = 0; i < w * h; ++i)
+    ones.pix[i] = 1.0;
+  bool recursive = opts.smoothSigma > 0;
+  Pyramid pyrMask(ones, 0.8, levels, step, recursive);
+  Pyramid* pyr0 = new Pyramid(frame, 0.8, levels, step, recursive);
+
+  double total[4] = { 0.0, 1.0, 0.0, 1.0 };
+  double motion[4] = { 0.0, 1.0, 0.0, 1.0 };
+  bool warm = false;
+  int frames = 1, iterations = 0;
+  printf("0 %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.4f 0\n", motion[0],
+      motion[1], motion[2], motion[3], total[0], total[1], total[2], total[3]);
+  fflush(stdout);
+  while (reader.next(frame, &error)) {
+    if (frame.w != w || frame.h != h) {
+      error = strprintf("Frame %d doesn't have the size of frame 0", frames);
+      break;
+    }
+    Pyramid* pyr1 = new Pyramid(frame, 0.8, levels, step, recursive);
+
+    // The first pair, and pairs after a failed one, run all levels from the
+    // identity; the others start from the motion of the pair before.
+    double a[4] = { 0.0, 1.0, 0.0, 1.0 };
+    if (warm) {
+      memcpy(a, motion, sizeof(a));
+      opts.warmLevels = seq.warmLevels;
+      opts.warmIters = seq.warmIters;
     } else {
-      Img tmp, tmpMask;
-      appIndex--;  // this is incremented again later on
-      if (!imageFromSource(appIcons, appIndex, tmp, &tmpMask)) {
-        printf("Failed to load %d %s, exiting.\n", appIndex, argv[2]);
-        return -1;
+      opts.warmLevels = levels;
+      opts.warmIters = opts.fineIters;
+    }
+    FlowStats stats;
+    pyramidFlow(*pyr0, *pyr1, pyrMask, levels, a, frames, opts, &stats);
+    warm = a[1] > 1.0 / seq.maxScale && a[1] < seq.maxScale
+        && a[3] > 1.0 / seq.maxScale && a[3] < seq.maxScale;
+    if (warm) {
+      memcpy(motion, a, sizeof(a));
+      composeParams(total, a);
+    }
+    iterations += stats.iterations;
+    printf("%d %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %d%s\n", frames, a[0],
+        a[1], a[2], a[3], total[0], total[1], total[2], total[3],
+        stats.iterations, warm ? "" : " failed");
+    fflush(stdout);
+
+    // This frame's pyramid is the next pair's first one.
+    delete pyr0;
+    pyr0 = pyr1;
+    ++frames;
+  }
+  delete pyr0;
+  if (!error.empty()) {
+    printf("%s, exiting.\n", error.c_str());
+    return 1;
+  }
+  double seconds = now() - start;
+  fprintf(stderr, "%d frames of %dx%d, %d levels, %.1f iterations and "
+      "%.4fs per frame\n", frames, w, h, levels,
+      iterations / (double)std::max(frames - 1, 1), seconds / frames);
+  return 0;
+}
+
+void usage() {
+  printf("Usage: flow [--warm[=size]] [--roi] [--sqrt2] [--select=n[,tile]]\n"
+"            [--select-report] [--quiet] [--profile=summary.json]\n"
+"            [--trace=trace.json] [--profile-hw] [--results=cache]\n"
+"            [--prefetch=n] [--budget=ms] [--smooth=sigma]\n"
+"            docicon.icns appicon.icns [docicon2.icns ...]\n"
+"       flow --bench[=results.tsv]\n"
+"       flow --synth[=trials]\n"
+"       flow --serve=socket [--threads=n] [--queue=n] [--cache=mb]\n"
+"            [--results=cache] [--warm[=size]] [--roi] [--select=n[,tile]]\n"
+"            [--budget=ms] [--sqrt2] [--smooth=sigma]\n"
+"       flow --tiled[=mb] [--threads=n] template.pnm target.pnm [mask.pgm]\n"
+"       flow --dense[=window] [--threads=n] first.pnm second.pnm out.flo\n"
+"       flow --track[=n] [--threads=n] first.pnm second.pnm [out.txt]\n"
+"       flow --sequence[=WxH] [--sqrt2] [--select=n[,tile]] framedir|-\n"
+"       flow --shard=n [--launcher=cmd] [--output=file] [--warm[=size]]\n"
+"            [--roi] [--sqrt2] [--select=n[,tile]] [--results=cache]\n"
+"            manifest.txt\n"
+"       flow --render[=split] [--threads=n] background.icns manifest.txt\n"
+"       flow --discover[=list] [--threads=n] [--shard=n] [--output=file]\n"
+"            [--quiet] [--warm[=size]] [--roi] [--budget=ms] appsdir\n"
+"\n"
+"  --bench        Time all kernels on synthetic icons and print the results\n"
+"                 (or write them to results.tsv) for diffing between builds.\n"
+"  --synth        Solve |trials| (default 8) synthetic icons per size with\n"
+"                 known transforms using several solver settings, and print\n"
+"                 error and time of each (grayMinWidth -1 means never gray).\n"
+"  --warm[=size]  Solve only the variant closest to |size| (default: the\n"
+"                 largest) from scratch. All other variants start from its\n"
+"                 rescaled result and are only refined.\n"
+"  --roi          Only look at the pixels around the app icon's mask.\n"
+"  --sqrt2        Shrink pyramid levels by sqrt(2) instead of 2.\n"
+"  --strips=width Solve levels at least width pixels wide row by row, which\n"
+"                 needs less memory (default 256, 0 for all levels).\n"
+"  --smooth=sigma Blur the pyramids and the image derivatives with\n"
+"                 recursive Gaussians, the derivatives by sigma, instead of\n"
+"                 the fixed 5x5 and 3x3 kernels. Wider blurs help on noisy,\n"
+"                 textured icons and don't cost more. Not for --tiled.\n"
+"  --select=n[,tile]\n"
+"                 On levels >= 128px, only look at the n pixels with the\n"
+"                 strongest app icon gradient (picked per tile x tile\n"
+"                 block if tile is given).\n"
+"  --select-report\n"
+"                 Also solve every variant without --select and print how\n"
+"                 far apart the results are.\n"
+"  --quiet        Don't print every iteration or save debug images.\n"
+"  --profile=summary.json\n"
+"                 Write time per stage, variant and pyramid level, and\n"
+"                 iteration and allocation counts.\n"
+"  --trace=trace.json\n"
+"                 Write every stage as a Chrome trace event.\n"
+"  --profile-hw   Count cycles and instructions per stage too (Linux).\n"
+"  --results=cache\n"
+"                 Look up the rects of variants that were solved with the\n"
+"                 same pixels and settings before in the file |cache|, and\n"
+"                 add new ones to it. --shard's workers share it (with\n"
+"                 --launcher, |cache| is opened where they run).\n"
+"  --prefetch=n   Decode the next variants and icon files on n (default 1)\n"
+"                 threads while the current one is solved.\n"
+"  --budget=ms    Give each pair of icon files at most ms milliseconds; when\n"
+"                 they're up, use the best rects found so far. Each variant\n"
+"                 gets a share by size, each pyramid level a share of that.\n"
+"  --serve=socket Answer alignment requests on the Unix-domain socket\n"
+"                 |socket| until killed, see serve() in flow.cpp for the\n"
+"                 protocol. --threads (default: one per core) requests are\n"
+"                 solved at once and up to --queue (default 64) wait.\n"
+"                 Decoded icons are kept in a cache of --cache (default 256)\n"
+"                 megabytes.\n"
+"  --tiled[=mb]   Align two binary PGM/PPM images of any size (e.g. scans)\n"
+"                 in grayscale, starting from the identity, with about |mb|\n"
+"                 (default 512) megabytes of memory plus a few per thread.\n"
+"                 Pyramid levels are kept as tiles in temporary files in\n"
+"                 $TMPDIR.\n"
+"  --dense[=window]\n"
+"                 Find a flow vector for every pixel of two PGM/PPM images\n"
+"                 (in gray) with Lucas-Kanade in window x window (default\n"
+"                 15) blocks, and write them as a Middlebury .flo file.\n"
+"  --track[=n]    Pick up to n (default 500) corners in the first PGM/PPM\n"
+"                 image and track them to the second. Writes a line\n"
+"                 |x y u v residual tracked| per corner.\n"
+"  --sequence[=WxH]\n"
+"                 Align each frame of a sequence to the one before, starting\n"
+"                 from the motion of the pair before, and print the\n"
+"                 transforms from the previous and the first frame as each\n"
+"                 frame is done. Frames are the PGM/PPM files in |framedir|\n"
+"                 by name, or 8-bit gray WxH frames on stdin for |-|.\n"
+"  --shard=n      Align the icon pairs listed in |manifest.txt| (a\n"
+"                 tab-separated docicon and appicon path per line) on n\n"
+"                 worker processes and print their rects in manifest\n"
+"                 order (or write them to --output). A pair that crashes\n"
+"                 a worker twice is reported as failed; the run goes on.\n"
+"  --launcher=cmd Start workers with |cmd flow --worker ...| through\n"
+"                 /bin/sh instead of forking, e.g. \"ssh build%%d\" (%%d is\n"
+"                 the worker's index). Workers answer requests on\n"
+"                 stdin/stdout.\n"
+"  --render[=split]\n"
+"                 Draw app icons onto every variant of a background icon\n"
+"                 like docerator.py, as out%%d.png per size or as one icns\n"
+"                 file. Manifest lines are\n"
+"                 |appicon.icns<tab>out[%%d.png|.icns][<tab>docicon.icns]|;\n"
+"                 with a docicon, the rects are found by aligning the app\n"
+"                 icon to it, otherwise docerator.py's default rects are\n"
+"                 used.\n"
+"                 split: put the background's shadow over the app icon,\n"
+"                 like docerator.py does with the generic document icon.\n"
+"  --discover[=list]\n"
+"                 Find the .app bundles below |appsdir| on --threads\n"
+"                 threads, pair each CFBundleTypeIconFile of their\n"
+"                 Info.plists (XML or binary) with their CFBundleIconFile,\n"
+"                 and align the pairs like a manifest (with --shard, on\n"
+"                 workers). Bundles without pairs are listed on stderr\n"
+"                 unless --quiet. list: just write the pairs as a manifest\n"
+"                 (to --output or stdout).\n");
+}
+
+// Writes what gProfiler collected, see --profile and --trace.
+#ifndef FLOW_NO_PROFILE
+void writeProfile(const char* profilePath, const char* tracePath) {
+  if (profilePath && !gProfiler.writeSummary(profilePath))
+    printf("Failed to write %s\n", profilePath);
+  if (tracePath && !gProfiler.writeTrace(tracePath))
+    printf("Failed to write %s\n", tracePath);
+}
+#else
+void writeProfile(const char*, const char*) {}
+#endif
+
+int main(int argc, char* argv[]) {
+  int warmSize = -1;  // see AlignSettings
+  bool useRoi = false;
+  double pyramidStep = 2.0;
+  int stripMinWidth = FlowOptions().stripMinWidth;
+  size_t tiledBytes = 0;
+  int denseWindow = 0;
+  int trackCount = 0;
+  bool sequence = false;
+  int sequenceW = 0, sequenceH = 0;
+  int shardWorkers = 0;
+  const char* launcher = NULL;
+  const char* outputPath = NULL;
+  bool worker = false;
+  const char* renderMode = NULL;
+  const char* discoverMode = NULL;
+  int selectN = 0, selectTile = 0;
+  bool selectReport = false;
+  bool quiet = false;
+  const char* profilePath = NULL;
+  const char* tracePath = NULL;
+  bool profileHw = false;
+  bool bench = false;
+  const char* benchPath = NULL;
+  int synthTrials = 0;
+  const char* resultsPath = NULL;
+  const char* servePath = NULL;
+  int numThreads = std::max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+  int queueSize = 64;
+  size_t cacheBytes = 256 << 20;
+  int prefetch = AlignSettings().prefetch;
+  double budget = 0;
+  double smoothSigma = 0;
+
+  int argi = 1;
+  for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; ++argi) {
+    if (strcmp(argv[argi], "--bench") == 0)
+      bench = true;
+    else if (strncmp(argv[argi], "--bench=", 8) == 0) {
+      bench = true;
+      benchPath = argv[argi] + 8;
+    } else if (strcmp(argv[argi], "--synth") == 0
+        || strncmp(argv[argi], "--synth=", 8) == 0) {
+      synthTrials = argv[argi][7] == '=' ? atoi(argv[argi] + 8) : 8;
+      synthTrials = std::max(synthTrials, 1);
+    } else if (strcmp(argv[argi], "--warm") == 0)
+      warmSize = 0;
+    else if (strncmp(argv[argi], "--warm=", 7) == 0)
+      warmSize = atoi(argv[argi] + 7);
+    else if (strcmp(argv[argi], "--roi") == 0)
+      useRoi = true;
+    else if (strcmp(argv[argi], "--sqrt2") == 0)
+      pyramidStep = sqrt(2.0);
+    else if (strcmp(argv[argi], "--tiled") == 0)
+      tiledBytes = (size_t)512 << 20;
+    else if (strncmp(argv[argi], "--tiled=", 8) == 0)
+      tiledBytes = (size_t)std::max(atoi(argv[argi] + 8), 16) << 20;
+    else if (strcmp(argv[argi], "--dense") == 0)
+      denseWindow = DenseOptions().window;
+    else if (strncmp(argv[argi], "--dense=", 8) == 0)
+      denseWindow = std::max(atoi(argv[argi] + 8), 3) | 1;
+    else if (strcmp(argv[argi], "--track") == 0)
+      trackCount = TrackOptions().maxFeatures;
+    else if (strncmp(argv[argi], "--track=", 8) == 0)
+      trackCount = std::max(atoi(argv[argi] + 8), 1);
+    else if (strcmp(argv[argi], "--sequence") == 0)
+      sequence = true;
+    else if (strncmp(argv[argi], "--sequence=", 11) == 0) {
+      sequence = true;
+      if (sscanf(argv[argi] + 11, "%dx%d", &sequenceW, &sequenceH) != 2
+          || sequenceW <= 0 || sequenceH <= 0) {
+        usage();
+        return 1;
       }
+    } else if (strncmp(argv[argi], "--strips=", 9) == 0)
+      stripMinWidth = std::max(atoi(argv[argi] + 9), 0);
+    else if (strncmp(argv[argi], "--smooth=", 9) == 0)
+      smoothSigma = std::max(atof(argv[argi] + 9), 0.0);
+    else if (strncmp(argv[argi], "--select=", 9) == 0) {
+      selectN = atoi(argv[argi] + 9);
+      const char* comma = strchr(argv[argi], ',');
+      if (comma) selectTile = atoi(comma + 1);
+    } else if (strcmp(argv[argi], "--select-report") == 0)
+      selectReport = true;
+    else if (strcmp(argv[argi], "--quiet") == 0)
+      quiet = true;
+    else if (strncmp(argv[argi], "--profile=", 10) == 0)
+      profilePath = argv[argi] + 10;
+    else if (strncmp(argv[argi], "--trace=", 8) == 0)
+      tracePath = argv[argi] + 8;
+    else if (strcmp(argv[argi], "--profile-hw") == 0)
+      profileHw = true;
+    else if (strncmp(argv[argi], "--results=", 10) == 0)
+      resultsPath = argv[argi] + 10;
+    else if (strncmp(argv[argi], "--serve=", 8) == 0)
+      servePath = argv[argi] + 8;
+    else if (strncmp(argv[argi], "--shard=", 8) == 0)
+      shardWorkers = std::max(atoi(argv[argi] + 8), 1);
+    else if (strncmp(argv[argi], "--launcher=", 11) == 0)
+      launcher = argv[argi] + 11;
+    else if (strncmp(argv[argi], "--output=", 9) == 0)
+      outputPath = argv[argi] + 9;
+    else if (strcmp(argv[argi], "--worker") == 0)
+      worker = true;
+    else if (strcmp(argv[argi], "--discover") == 0)
+      discoverMode = "";
+    else if (strcmp(argv[argi], "--discover=list") == 0)
+      discoverMode = "list";
+    else if (strcmp(argv[argi], "--render") == 0)
+      renderMode = "";
+    else if (strcmp(argv[argi], "--render=split") == 0)
+      renderMode = "split";
+    else if (strncmp(argv[argi], "--threads=", 10) == 0)
+      numThreads = std::max(atoi(argv[argi] + 10), 0);
+    else if (strncmp(argv[argi], "--queue=", 8) == 0)
+      queueSize = atoi(argv[argi] + 8);
+    else if (strncmp(argv[argi], "--cache=", 8) == 0)
+      cacheBytes = (size_t)std::max(atoi(argv[argi] + 8), 0) << 20;
+    else if (strncmp(argv[argi], "--prefetch=", 11) == 0)
+      prefetch = std::max(atoi(argv[argi] + 11), 0);
+    else if (strncmp(argv[argi], "--budget=", 9) == 0)
+      budget = std::max(atof(argv[argi] + 9), 0.0) / 1000;
+    else {
+      usage();
+      return 1;
+    }
+  }
 
-      appIcon.setSize(tmp.w/2, tmp.h/2, tmp.c);
-      downsample2(appIcon.pix, tmp.pix, tmp.w, tmp.h, tmp.c);
-      appIconMask.setSize(tmp.w/2, tmp.h/2);
-      downsample2(appIconMask.pix, tmpMask.pix, tmpMask.w, tmpMask.h, 1);
+#ifndef FLOW_NO_PROFILE
+  gProfiler.enabled = profilePath || tracePath;
+  gProfiler.trace = tracePath != NULL;
+  if (profileHw && !gProfiler.enableHardwareCounters())
+    printf("Hardware counters not available, ignoring --profile-hw\n");
+#else
+  if (profilePath || tracePath || profileHw)
+    printf("Built with FLOW_NO_PROFILE, ignoring --profile, --trace and "
+        "--profile-hw\n");
+#endif
+
+  if (bench) {
+    FILE* out = benchPath ? fopen(benchPath, "w") : stdout;
+    if (!out) {
+      printf("Failed to open %s\n", benchPath);
+      return 1;
     }
+    runBenchmarks(out);
+    if (benchPath) fclose(out);
+    writeProfile(profilePath, tracePath);
+    return 0;
+  }
 
-    if (docIcon.w != appIcon.w || docIcon.h != appIcon.h) {
-      printf("Image dimensions do not match, exiting.\n");
-      return -1;
+  if (synthTrials > 0) {
+    runSynthetic(stdout, synthTrials);
+    writeProfile(profilePath, tracePath);
+    return 0;
+  }
+
+  ResultCache results;
+  if (resultsPath && !results.open(resultsPath)) {
+    printf("Failed to open result cache %s\n", resultsPath);
+    return 1;
+  }
+
+  AlignSettings settings;
+  settings.warmSize = warmSize;
+  settings.opts.debugOutput = !quiet;
+  settings.opts.roi = useRoi;
+  settings.opts.pyramidStep = pyramidStep;
+  settings.opts.stripMinWidth = stripMinWidth;
+  settings.opts.smoothSigma = smoothSigma;
+  settings.opts.selectPixels = selectN;
+  settings.opts.selectTile = selectTile;
+  settings.selectReport = selectReport;
+  settings.prefetch = prefetch;
+  settings.budget = budget;
+
+  if (servePath)
+    return serve(servePath, settings, numThreads, queueSize, cacheBytes,
+        resultsPath ? &results : NULL);
+
+  if (worker) {
+    settings.opts.debugOutput = false;
+    settings.verbose = false;
+    // Replies go to the real stdout, anything printed to stderr.
+    int replyFd = dup(1);
+    dup2(2, 1);
+    runShardWorker(0, replyFd, settings, resultsPath ? &results : NULL);
+    return 0;
+  }
+
+  std::vector<std::pair<std::string, std::string> > pairs;
+  if (discoverMode) {
+    if (argc - argi != 1) {
+      printf("Expected one argument\n");
+      usage();
+      return 1;
     }
+    discoverIconPairs(argv[argi], numThreads, pairs, !quiet);
+    // Thousands of apps are too many for debug images.
+    settings.opts.debugOutput = false;
+    settings.verbose = false;
+  }
+
+  if (discoverMode && strcmp(discoverMode, "list") == 0) {
+    FILE* out = outputPath ? fopen(outputPath, "w") : stdout;
+    if (!out) {
+      printf("Failed to write %s\n", outputPath);
+      return 1;
+    }
+    for (size_t i = 0; i < pairs.size(); ++i)
+      fprintf(out, "%s\t%s\n", pairs[i].first.c_str(),
+          pairs[i].second.c_str());
+    if (outputPath && fclose(out) != 0) {
+      printf("Failed to write %s\n", outputPath);
+      return 1;
+    }
+    return 0;
+  }
 
-    printf("%dx%d\n", appIcon.w, appIcon.h);
+  if (shardWorkers) {
+    std::string error;
+    if (!discoverMode && argc - argi != 1) {
+      printf("Expected one argument\n");
+      usage();
+      return 1;
+    }
+    if (!discoverMode && !readManifest(argv[argi], pairs, &error)) {
+      printf("%s, exiting.\n", error.c_str());
+      return 1;
+    }
+    std::string command;
+    bool found;
+    if (launcher && !substituteIndex(launcher, 0, &command, &found)) {
+      printf("--launcher can only have one %%d (and %%%%), exiting.\n");
+      return 1;
+    }
+    settings.opts.debugOutput = false;
+    settings.verbose = false;
+    // Workers started by the launcher get the solver flags and --results.
+    std::string workerCommand = shellQuote(argv[0]) + " --worker";
+    const char* coordinatorOnly[] = { "--shard=", "--launcher=", "--output=",
+        "--profile", "--trace=", "--discover" };
+    for (int i = 1; i < argi; ++i) {
+      bool pass = true;
+      for (size_t f = 0; f < sizeof(coordinatorOnly) / sizeof(char*); ++f)
+        if (strncmp(argv[i], coordinatorOnly[f], strlen(coordinatorOnly[f]))
+            == 0)
+          pass = false;
+      if (pass) workerCommand += " " + shellQuote(argv[i]);
+    }
+    int result = runShards(pairs, shardWorkers, launcher, workerCommand,
+        outputPath, settings, resultsPath);
+    writeProfile(profilePath, tracePath);
+    return result;
+  }
 
-    //double f[5 * 5]; gauss(f, 5, 5, 0.8);
-    //filter(i0.pix, i1.pix, i0.w, i0.h, f, 5, n);
+  if (renderMode) {
+    if (argc - argi != 2) {
+      printf("Expected two arguments\n");
+      usage();
+      return 1;
+    }
+    int result = renderDocIcons(argv[argi], argv[argi + 1],
+        strcmp(renderMode, "split") == 0, numThreads, settings);
+    writeProfile(profilePath, tracePath);
+    return result;
+  }
 
-    SaveImage(docIcon, "%d_in.png", docIndex);
-    SaveImage(appIconMask, "%d_out_mask.png", docIndex);
-    SaveImage(appIcon, "%d_out.png", docIndex);
+  if (tiledBytes) {
+    if (argc - argi != 2 && argc - argi != 3) {
+      printf("Expected two or three arguments\n");
+      usage();
+      return 1;
+    }
+    settings.opts.debugOutput = false;
+    int result = alignTiled(argv[argi], argv[argi + 1],
+        argc - argi == 3 ? argv[argi + 2] : NULL, tiledBytes, numThreads,
+        settings.opts);
+    writeProfile(profilePath, tracePath);
+    return result;
+  }
 
-    int levels = 0;
-    while ((1 << levels) < docIcon.w) ++levels;
-    //levels -= 4; // smallest size is 32x32 (for Preview.app) (3 successes, few close)
-    levels -= 3; // smallest size is 16x16 (for Terminal.app) (5 successes)
-    if (levels < 1) levels = 1;  // don't ignore 16x16 version
+  if (denseWindow) {
+    if (argc - argi != 3) {
+      printf("Expected three arguments\n");
+      usage();
+      return 1;
+    }
+    DenseOptions dense;
+    dense.window = denseWindow;
+    int result = denseFlowFiles(argv[argi], argv[argi + 1], argv[argi + 2],
+        dense, numThreads);
+    writeProfile(profilePath, tracePath);
+    return result;
+  }
 
-    double a[4];
-    pyramidFlow(appIcon.pix, docIcon.pix, docIcon.w, docIcon.h, a, levels,
-        appIconMask.pix, docIndex);
+  if (trackCount) {
+    if (argc - argi != 2 && argc - argi != 3) {
+      printf("Expected two or three arguments\n");
+      usage();
+      return 1;
+    }
+    TrackOptions track;
+    track.maxFeatures = trackCount;
+    int result = trackFiles(argv[argi], argv[argi + 1],
+        argc - argi == 3 ? argv[argi + 2] : NULL, track, numThreads);
+    writeProfile(profilePath, tracePath);
+    return result;
+  }
 
-    printMatrix(a, 4, 1);
-    interp2Scale(docIcon.pix, appIcon.pix, docIcon.w, docIcon.h, a, 3);
-    SaveImage(docIcon, "%d_out_estimated.png", docIndex);
+  if (sequence) {
+    if (argc - argi != 1) {
+      printf("Expected one argument\n");
+      usage();
+      return 1;
+    }
+    if (strcmp(argv[argi], "-") == 0 && sequenceW == 0) {
+      printf("Reading frames from stdin needs --sequence=WxH\n");
+      return 1;
+    }
+    settings.opts.debugOutput = false;
+    int result = alignSequence(argv[argi], sequenceW, sequenceH,
+        settings.opts, SequenceOptions());
+    writeProfile(profilePath, tracePath);
+    return result;
+  }
 
-    for (int t = 0; t < 4; ++t)
-      foundRects[docIcon.w].push_back(a[t]);
+  std::vector<IconFilePair> files;
+  if (discoverMode) {
+    for (size_t i = 0; i < pairs.size(); ++i)
+      files.push_back(IconFilePair(pairs[i].first.c_str(),
+          pairs[i].second.c_str()));
+  } else {
+    if (argc - argi < 2 || (argc - argi) % 2 != 0) {
+      printf("Expected pairs of arguments\n");
+      usage();
+      return 1;
+    }
+    for (int i = argi; i < argc; i += 2)
+      files.push_back(IconFilePair(argv[i], argv[i + 1]));
+  }
 
-    ++docIndex, ++appIndex;
+  bool ok = alignIconFiles(files, settings, NULL,
+      resultsPath ? &results : NULL);
+  if (!discoverMode && files.size() == 1 && !ok) {
+    printf("%s, exiting.\n", files[0].error.c_str());
+    return -1;
   }
 
-  std::map<int, std::vector<double> >::iterator it, end = foundRects.end();
-  printf("\nrects = {\n");
-  for (it = foundRects.begin(); it != end; ++it) {
-    printf("    %3d: (", it->first);
-    for (int t = 0; t < 4; ++t)
-      printf("%8.4f%s", it->second[t], t == 3 ? "" : ", ");
-    printf("),\n");
+  for (size_t f = 0; f < files.size(); ++f) {
+    if (discoverMode || files.size() > 1)
+      printf("\n%s %s\n", files[f].docPath, files[f].appPath);
+    if (!files[f].error.empty()) {
+      printf("%s\n", files[f].error.c_str());
+      continue;
+    }
+    printRects(stdout, files[f].rects);
   }
-  printf("}\n");
 
-  freeImageSource(docIcons);
-  freeImageSource(appIcons);
+  writeProfile(profilePath, tracePath);
+  return ok ? 0 : 1;
 }
-
+#endif  // FLOW_LIBRARY
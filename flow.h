@@ -0,0 +1,117 @@
+// C interface to flow.cpp, for calling the solver in-process (e.g. from
+// Python through ctypes, see flowlib.py) instead of running the flow binary.
+//
+// Build the library with
+//   g++ -O2 -shared -fPIC -DFLOW_LIBRARY -o libflow.so flow.cpp -lpthread
+// (-dynamiclib -o libflow.dylib on OS X).
+//
+// Written by nicolasweber@gmx.de, released under MIT license
+
+#ifndef FLOW_H_
+#define FLOW_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Pixel formats of flow_image. Color is not premultiplied.
+enum {
+  FLOW_RGBA8,      // 4 bytes per pixel, r g b a
+  FLOW_ARGB8,      // 4 bytes per pixel, a r g b (what NSBitmapImageRep has)
+  FLOW_GRAY8,      // 1 byte per pixel
+  FLOW_RGBA_F32,   // 4 floats per pixel in [0, 1]
+  FLOW_RGB_F32,    // 3 floats per pixel in [0, 1]
+  FLOW_GRAY_F32    // 1 float per pixel in [0, 1]
+};
+
+// Return values.
+enum {
+  FLOW_OK = 0,
+  FLOW_ERROR_ARGUMENT = -1,  // NULL pointer or unknown format
+  FLOW_ERROR_SIZE = -2       // images don't have the same size
+};
+
+// A caller-owned image. flow only reads it during the call.
+typedef struct {
+  const void* data;
+  int width, height;
+  int stride;  // bytes from one row to the next
+  int format;
+} flow_image;
+
+typedef struct {
+  int levels;          // pyramid levels, 0: what flow uses for this size
+  int fine_iters;      // iterations per level, see FlowOptions in flow.cpp
+  int coarse_iters;
+  double eps;
+  int gray_min_width;
+  int roi;             // see --roi
+  int select_pixels;   // see --select
+  int select_tile;
+
+  // If warm_levels > 0, initial holds an estimate for this image size, and
+  // only the finest warm_levels levels are refined. Otherwise flow starts from
+  // its own guess.
+  int warm_levels;
+  double initial[4];
+
+  double pyramid_step;  // size ratio between pyramid levels, e.g. 2 or sqrt(2)
+
+  // If > 0, the seconds flow_align() (or a whole flow_align_batch()) may take.
+  // Converting the images counts, but isn't cut short. When they're up, the
+  // result is the best estimate found so far, with timed_out set. 0: no
+  // limit.
+  double budget;
+
+  // If > 0, blur with recursive Gaussians, the image derivatives by this
+  // sigma, instead of flow's fixed kernels (see --smooth). 0: the kernels.
+  double smooth_sigma;
+} flow_options;
+
+typedef struct {
+  int status;          // FLOW_OK or an error
+  double a[4];         // x offset, x scale, y offset, y scale like flow's rects
+  int iterations;      // over all levels
+  int levels;          // levels solved
+  int converged;       // the finest level's updates got smaller than eps
+  double update_norm;  // length of the last update
+  double residual;     // mean squared brightness difference at the end
+  double seconds;
+  int timed_out;       // options->budget ran out before the solve was done
+} flow_result;
+
+typedef struct flow_context flow_context;
+
+// A context keeps num_threads worker threads (for flow_align_batch()) and
+// their scratch buffers around between calls. num_threads 0 does all work on
+// the calling thread. A context must not be used from several threads at once.
+flow_context* flow_context_create(int num_threads);
+void flow_context_destroy(flow_context* context);
+
+// Fills options with flow's defaults.
+void flow_options_init(flow_options* options);
+
+// Finds where templ (the app icon) sits in target (the doc icon). If mask is
+// NULL, templ's alpha is used. target is composited onto black first, like
+// flow does with icns files. options may be NULL for the defaults.
+int flow_align(flow_context* context, const flow_image* templ,
+    const flow_image* mask, const flow_image* target,
+    const flow_options* options, flow_result* result);
+
+// Solves n independent flow_align() problems on the context's threads.
+// masks may be NULL. Returns FLOW_OK if all of them succeeded, otherwise the
+// first error; every result has its own status. The results are the same as
+// from flow_align(), but the small pyramid levels of several problems are
+// solved together, which is faster than calling flow_align() n times. The
+// problems are worked on a few per thread at a time, so memory doesn't grow
+// with n. A result's seconds counts from its preparation until the problems
+// solved with it are done.
+int flow_align_batch(flow_context* context, int n, const flow_image* templs,
+    const flow_image* masks, const flow_image* targets,
+    const flow_options* options, flow_result* results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // FLOW_H_
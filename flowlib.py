@@ -0,0 +1,220 @@
+"""ctypes bindings for libflow (see flow.h), so that docerator can find rects
+in-process instead of running the flow binary and parsing its output."""
+
+import ctypes
+import ctypes.util
+import numbers
+import os
+
+
+RGBA8, ARGB8, GRAY8, RGBA_F32, RGB_F32, GRAY_F32 = range(6)
+
+OK, ERROR_ARGUMENT, ERROR_SIZE = 0, -1, -2
+
+
+class Image(ctypes.Structure):
+  _fields_ = [
+      ('data', ctypes.c_void_p),
+      ('width', ctypes.c_int),
+      ('height', ctypes.c_int),
+      ('stride', ctypes.c_int),
+      ('format', ctypes.c_int),
+  ]
+
+
+class Options(ctypes.Structure):
+  _fields_ = [
+      ('levels', ctypes.c_int),
+      ('fine_iters', ctypes.c_int),
+      ('coarse_iters', ctypes.c_int),
+      ('eps', ctypes.c_double),
+      ('gray_min_width', ctypes.c_int),
+      ('roi', ctypes.c_int),
+      ('select_pixels', ctypes.c_int),
+      ('select_tile', ctypes.c_int),
+      ('warm_levels', ctypes.c_int),
+      ('initial', ctypes.c_double * 4),
+      ('pyramid_step', ctypes.c_double),
+      ('budget', ctypes.c_double),
+      ('smooth_sigma', ctypes.c_double),
+  ]
+
+
+class Result(ctypes.Structure):
+  _fields_ = [
+      ('status', ctypes.c_int),
+      ('a', ctypes.c_double * 4),
+      ('iterations', ctypes.c_int),
+      ('levels', ctypes.c_int),
+      ('converged', ctypes.c_int),
+      ('update_norm', ctypes.c_double),
+      ('residual', ctypes.c_double),
+      ('seconds', ctypes.c_double),
+      ('timed_out', ctypes.c_int),
+  ]
+
+
+def loadLibrary(path=None):
+  """Loads libflow from path, from next to this file, or from the system."""
+  candidates = [path] if path else []
+  d = os.path.dirname(os.path.abspath(__file__))
+  candidates += [os.path.join(d, 'libflow.dylib'),
+                 os.path.join(d, 'libflow.so'),
+                 ctypes.util.find_library('flow')]
+  for c in candidates:
+    if c and (os.path.exists(c) or not os.path.dirname(c)):
+      try:
+        lib = ctypes.CDLL(c)
+        break
+      except OSError:
+        pass
+  else:
+    raise Exception('Could not find libflow')
+
+  lib.flow_context_create.restype = ctypes.c_void_p
+  lib.flow_context_create.argtypes = [ctypes.c_int]
+  lib.flow_context_destroy.argtypes = [ctypes.c_void_p]
+  lib.flow_options_init.argtypes = [ctypes.POINTER(Options)]
+  lib.flow_align.argtypes = [ctypes.c_void_p, ctypes.POINTER(Image),
+      ctypes.POINTER(Image), ctypes.POINTER(Image), ctypes.POINTER(Options),
+      ctypes.POINTER(Result)]
+  lib.flow_align_batch.argtypes = [ctypes.c_void_p, ctypes.c_int,
+      ctypes.POINTER(Image), ctypes.POINTER(Image), ctypes.POINTER(Image),
+      ctypes.POINTER(Options), ctypes.POINTER(Result)]
+  return lib
+
+
+def image(data, w, h, format=ARGB8, stride=None):
+  """Wraps pixels without copying them. data can be a byte string, a
+  writable buffer (e.g. a bytearray) or an address. The pixels have to stay
+  alive while flow uses the image."""
+  bytesPerPixel = {RGBA8: 4, ARGB8: 4, GRAY8: 1,
+                   RGBA_F32: 16, RGB_F32: 12, GRAY_F32: 4}[format]
+  if stride is None:
+    stride = w * bytesPerPixel
+  if isinstance(data, numbers.Integral):
+    address = int(data)
+  elif isinstance(data, bytes):
+    address = ctypes.cast(ctypes.c_char_p(data), ctypes.c_void_p).value
+  else:
+    address = ctypes.addressof(ctypes.c_char.from_buffer(data))
+  return Image(address, w, h, stride, format)
+
+
+class Flow(object):
+  """Finds rects with a reusable libflow context."""
+
+  def __init__(self, threads=0, path=None):
+    self.lib = loadLibrary(path)
+    self.context = self.lib.flow_context_create(threads)
+
+  def __del__(self):
+    if getattr(self, 'context', None):
+      self.lib.flow_context_destroy(self.context)
+      self.context = None
+
+  def options(self, **kw):
+    o = Options()
+    self.lib.flow_options_init(ctypes.byref(o))
+    for k in kw:
+      if k == 'initial':
+        o.warm_levels = o.warm_levels or 1
+        for i in range(4):
+          o.initial[i] = kw[k][i]
+      else:
+        setattr(o, k, kw[k])
+    return o
+
+  def align(self, template, target, mask=None, **kw):
+    """Returns the Result of finding the Image template in the Image target.
+    result.a is a rect like the ones in docerator.py's rects."""
+    r = Result()
+    o = self.options(**kw)
+    self.lib.flow_align(self.context, ctypes.byref(template),
+        ctypes.byref(mask) if mask is not None else None,
+        ctypes.byref(target), ctypes.byref(o), ctypes.byref(r))
+    if r.status != OK:
+      raise Exception('flow_align failed: %d' % r.status)
+    return r
+
+  def alignMany(self, templates, targets, masks=None, **kw):
+    """Like align() for lists of images, solved in parallel."""
+    n = len(templates)
+    results = (Result * n)()
+    o = self.options(**kw)
+    self.lib.flow_align_batch(self.context, n, (Image * n)(*templates),
+        (Image * n)(*masks) if masks else None, (Image * n)(*targets),
+        ctypes.byref(o), results)
+    return list(results)
+
+
+class Client(object):
+  """Talks to a `flow --serve=socket` daemon. Requests can be sent without
+  waiting with send() and collected with receive(), or one at a time with
+  the other methods."""
+
+  def __init__(self, path):
+    import socket
+    self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    self.sock.connect(path)
+    self.nextId = 0
+
+  def close(self):
+    self.sock.close()
+
+  def send(self, command, *args):
+    """Sends a request and returns its id."""
+    import struct
+    self.nextId += 1
+    fields = [command, str(self.nextId)] + [str(a) for a in args]
+    payload = b'\0'.join(f.encode('utf-8') for f in fields)
+    self.sock.sendall(struct.pack('>I', len(payload)) + payload)
+    return str(self.nextId)
+
+  def _read(self, n):
+    data = b''
+    while len(data) < n:
+      chunk = self.sock.recv(n - len(data))
+      if not chunk:
+        raise Exception('flow daemon closed the connection')
+      data += chunk
+    return data
+
+  def receive(self):
+    """Returns (id, fields) of the next reply. Raises on errors."""
+    import struct
+    size, = struct.unpack('>I', self._read(4))
+    fields = [f.decode('utf-8') for f in self._read(size).split(b'\0')]
+    if fields[1] != 'ok':
+      raise Exception('flow request %s failed: %s' % (fields[0], fields[2]))
+    return fields[0], fields[2:]
+
+  def _call(self, command, *args):
+    requestId = self.send(command, *args)
+    replyId, fields = self.receive()
+    assert replyId == requestId
+    return fields
+
+  def alignIcns(self, docPath, appPath, budgetMs=None):
+    """Returns rects like docerator.py's, keyed by variant size. With
+    budgetMs, the best rects found in that time."""
+    args = [docPath, appPath] + ([budgetMs] if budgetMs is not None else [])
+    fields = self._call('icns', *args)
+    rects = {}
+    for i in range(0, len(fields), 5):
+      rects[int(fields[i])] = tuple(float(f) for f in fields[i + 1:i + 5])
+    return rects
+
+  def alignShm(self, name, w, h, format, stride, templOffset, maskOffset,
+               targetOffset, budgetMs=None):
+    """Aligns images in the shared memory object name (maskOffset -1 for
+    none). Returns (rect, iterations, residual)."""
+    args = [name, w, h, format, stride, templOffset, maskOffset, targetOffset]
+    if budgetMs is not None:
+      args.append(budgetMs)
+    f = self._call('shm', *args)
+    return tuple(float(v) for v in f[:4]), int(f[4]), float(f[5])
+
+  def stats(self):
+    """Returns (requests, cache hits, cache misses, cached bytes)."""
+    return tuple(int(v) for v in self._call('stats'))